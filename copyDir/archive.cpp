@@ -0,0 +1,229 @@
+#include "archive.h"
+#include "metrics.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <initializer_list>
+
+const char *archiveFormatName(ArchiveFormat format)
+{
+    switch ( format ) {
+        case ARCHIVE_TAR:     return "tar";
+        case ARCHIVE_LENGTHS: return "lengths";
+    }
+    return "?";
+}
+
+bool archiveFormatFromName(const char *name, ArchiveFormat& format)
+{
+    for(ArchiveFormat f: {ARCHIVE_TAR, ARCHIVE_LENGTHS}) {
+        if ( !strcasecmp( name, archiveFormatName( f ) ) ) { format = f; return true; }
+    }
+    return false;
+}
+
+// POSIX ustar header; numbers in octal text, NUL terminated
+struct TarHeader {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+};
+static_assert( sizeof( TarHeader ) == 512, "tar blocks are 512 bytes" );
+
+static const unsigned int tarBlock = 512;
+
+// Whether 'value' fits a field of 'width' bytes: its digits, and the NUL
+static bool fitsOctal(size_t width, unsigned long value)
+{
+    return value < 1ul << 3 * (width - 1);
+}
+
+static void octal(char *field, size_t width, unsigned long value)
+{
+    snprintf( field, width, "%0*lo", (int) width - 1, fitsOctal( width, value ) ? value : 0 );
+}
+
+// A pax record is "<length> key=value\n", the length counting its own digits
+static std::string paxRecord(const std::string& key, const std::string& value)
+{
+    size_t len    = key.size() + value.size() + 3;
+    size_t digits = std::to_string( len ).size();
+    if ( std::to_string( len + digits ).size() != digits ) digits++;
+    return std::to_string( len + digits ) + " " + key + "=" + value + "\n";
+}
+
+static void fillHeader(TarHeader& h, char type, const std::string& name, const std::string& prefix,
+                       unsigned long size, const struct stat& statbuf)
+{
+    memset( &h, 0, sizeof( h ) );
+    memcpy( h.name, name.data(), std::min( name.size(), sizeof( h.name ) ) );
+    memcpy( h.prefix, prefix.data(), std::min( prefix.size(), sizeof( h.prefix ) ) );
+    octal( h.mode,  sizeof( h.mode ),  statbuf.st_mode & 07777 );
+    octal( h.uid,   sizeof( h.uid ),   statbuf.st_uid );
+    octal( h.gid,   sizeof( h.gid ),   statbuf.st_gid );
+    octal( h.size,  sizeof( h.size ),  size );
+    octal( h.mtime, sizeof( h.mtime ), statbuf.st_mtime > 0 ? statbuf.st_mtime : 0 );
+    h.typeflag = type;
+    memcpy( h.magic, "ustar", 6 );
+    memcpy( h.version, "00", 2 );
+
+    // Summed with its own field as spaces
+    memset( h.chksum, ' ', sizeof( h.chksum ) );
+    unsigned int sum = 0;
+    for(unsigned int i=0; i<sizeof( h ); i++) sum += ((const unsigned char *) &h)[i];
+    snprintf( h.chksum, sizeof( h.chksum ), "%06o", sum );
+    h.chksum[7] = ' ';
+}
+
+ArchiveWriter::~ArchiveWriter()
+{
+    if ( ownFd && fd != -1 ) close( fd );
+}
+
+int ArchiveWriter::open(const std::string& path, ArchiveFormat _format)
+{
+    format = _format;
+    ownFd  = path != "-";
+    fd     = ownFd ? ::open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 ) : STDOUT_FILENO;
+    if ( fd == -1 ) return err = errno;
+
+    if ( format == ARCHIVE_LENGTHS ) {
+        const char *magic = "copyDir-stream 1\n";
+        err = writeAll( magic, strlen( magic ) );
+    }
+    return err;
+}
+
+int ArchiveWriter::writeAll(const void *data, size_t len)
+{
+    for(size_t written = 0; written < len; ) {
+        ssize_t w = write( fd, (const char *) data + written, len - written );
+        if ( w == -1 ) { if ( errno == EINTR ) continue; return errno; }
+        written += w;
+    }
+    return 0;
+}
+
+int ArchiveWriter::writeZeroes(unsigned long len)
+{
+    static const char zeroes[64 * 1024] = {};
+    while ( len ) {
+        size_t n = std::min( len, (unsigned long) sizeof( zeroes ) );
+        int errWrite = writeAll( zeroes, n );
+        if ( errWrite ) return errWrite;
+        len -= n;
+    }
+    return 0;
+}
+
+int ArchiveWriter::writeTarHeader(const std::string& name, const struct stat& statbuf)
+{
+    const unsigned long size = statbuf.st_size;
+    TarHeader h;
+
+    // Long names split at a slash: up to 155 bytes of dirs in the prefix, 100 in the name
+    std::string shortName = name, prefix;
+    if ( name.size() > sizeof( h.name ) ) {
+        size_t slash = name.find( '/', name.size() - sizeof( h.name ) - 1 );
+        if ( slash != std::string::npos && slash <= sizeof( h.prefix ) && slash + 1 < name.size() ) {
+            prefix    = name.substr( 0, slash );
+            shortName = name.substr( slash + 1 );
+        }
+    }
+
+    std::string pax;
+    if ( shortName.size() > sizeof( h.name ) ) pax += paxRecord( "path", name );
+    if ( !fitsOctal( sizeof( h.size ), size ) ) pax += paxRecord( "size", std::to_string( size ) );
+    if ( !fitsOctal( sizeof( h.uid ), statbuf.st_uid ) ) pax += paxRecord( "uid", std::to_string( statbuf.st_uid ) );
+    if ( !fitsOctal( sizeof( h.gid ), statbuf.st_gid ) ) pax += paxRecord( "gid", std::to_string( statbuf.st_gid ) );
+
+    if ( !pax.empty() ) {
+        fillHeader( h, 'x', "././@PaxHeader", "", pax.size(), statbuf );
+        int errPax = writeAll( &h, sizeof( h ) );
+        if ( !errPax ) errPax = writeAll( pax.data(), pax.size() );
+        if ( !errPax ) errPax = writeZeroes( (tarBlock - pax.size() % tarBlock) % tarBlock );
+        if ( errPax ) return errPax;
+        if ( shortName.size() > sizeof( h.name ) ) prefix.clear();      // the pax path stands
+    }
+
+    fillHeader( h, '0', shortName, prefix, size, statbuf );
+    return writeAll( &h, sizeof( h ) );
+}
+
+int ArchiveWriter::add(const std::string& srcFilepath, const std::string& name, CopyMethod& method, CopyStats& stats)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    int fdIn = ::open( srcFilepath.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fdIn == -1 ) return errno;
+    struct stat statbuf;
+    if ( fstat( fdIn, &statbuf ) ) { int errStat = errno; close( fdIn ); return errStat; }
+    const unsigned long size = statbuf.st_size;
+
+    std::lock_guard<std::mutex> lock( mutex );
+    if ( err ) { close( fdIn ); return err; }
+
+    if ( format == ARCHIVE_TAR ) err = writeTarHeader( name, statbuf );
+    else {
+        std::string line = std::to_string( name.size() ) + " " + std::to_string( size ) + "\n" + name;
+        err = writeAll( line.data(), line.size() );
+    }
+
+    off_t done    = 0;
+    int   errFile = err ? err : copyToStream( fdIn, fd, size, done, method );
+    close( fdIn );
+
+    // The header promised 'size' bytes; what the file did not have is zeroes. Should the
+    // stream be what failed, this fails as well.
+    if ( !err && errFile ) err = writeZeroes( size - done );
+    if ( !err && format == ARCHIVE_TAR ) err = writeZeroes( (tarBlock - size % tarBlock) % tarBlock );
+    if ( err ) return err;
+    if ( errFile ) return errFile;
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    metricsRecord( STAGE_COPY, std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count(), size );
+
+    stats.files++;
+    stats.bytes += size;
+    stats.filesBy[method]++;
+    stats.seconds += std::chrono::duration<double>( elapsed ).count();
+
+    return 0;
+}
+
+int ArchiveWriter::finish()
+{
+    std::lock_guard<std::mutex> lock( mutex );
+    if ( !err ) {
+        // Two zero blocks end a tar
+        if ( format == ARCHIVE_TAR ) err = writeZeroes( 2 * tarBlock );
+        else                         err = writeAll( "0 0\n", 4 );
+    }
+    if ( ownFd && fd != -1 ) {
+        if ( close( fd ) && !err ) err = errno;
+        fd = -1;
+    }
+    return err;
+}
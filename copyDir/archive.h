@@ -0,0 +1,75 @@
+#ifndef __COPYDIR_ARCHIVE_H__
+#define __COPYDIR_ARCHIVE_H__
+
+#include "copyEngine.h"
+
+#include <mutex>
+#include <string>
+
+// How an archive run (--archive) lays the files out in the stream
+enum ArchiveFormat {
+    ARCHIVE_TAR,                // POSIX tar (ustar, pax records for what does not fit)
+    ARCHIVE_LENGTHS,            // a text line per file with its lengths, then its bytes
+};
+
+const char *archiveFormatName(ArchiveFormat format);
+bool        archiveFormatFromName(const char *name, ArchiveFormat& format);
+
+/*!
+  * @brief Writes files one after another into a single stream, as they are found to be
+  *        missing from the target, for whatever reads the other end of a pipe: no staging
+  *        dir to copy them to first.
+  *
+  * Tar entries are regular files with their mode, owner, group and times; no entries for
+  * the dirs, extractors make the missing ones. Names, sizes or ids ustar has no room for
+  * go in a pax extended header ahead of the entry.
+  *
+  * The 'lengths' format is there for scripts that would rather not parse tar: after a
+  * "copyDir-stream 1" line, every file is a line "<name length> <size>", then that many
+  * bytes of name, then that many bytes of contents; a "0 0" line ends the stream.
+  *
+  * Contents go through copyToStream, so into a pipe they are spliced from the page cache
+  * and never copied through user space. A file's size is written ahead of its contents:
+  * one that shrank meanwhile is padded with zeroes, and reported; one that grew is cut.
+  * Either way the stream is still good. It is not once writing to it failed: every
+  * later call fails the same.
+  */
+class ArchiveWriter {
+public:
+    ArchiveWriter() : fd(-1), ownFd(false), format(ARCHIVE_TAR), err(0) {}
+    ~ArchiveWriter();
+
+    /*!
+      * @brief Starts the archive at 'path', created or truncated; "-" for stdout, which
+      *        has to be something else than a terminal.
+      * @return 0 on success, errno otherwise
+      */
+    int open(const std::string& path, ArchiveFormat format);
+
+    /*!
+      * @brief Appends a file under 'name', relative to wherever it gets extracted; thread
+      *        safe, files go in one at a time.
+      * @param method how the contents went in, as copyToStream says
+      * @return 0 on success, errno otherwise: the file then is not in the stream, or (ESTALE)
+      *         is in it padded, unless broken() says the stream is gone
+      */
+    int add(const std::string& srcFilepath, const std::string& name, CopyMethod& method, CopyStats& stats);
+
+    // Ends the stream (and closes a file); 0 or errno
+    int finish();
+
+    bool broken() const { return err != 0; }
+
+private:
+    int           fd;
+    bool          ownFd;        // a file of ours, not stdout
+    ArchiveFormat format;
+    int           err;          // of the stream; sticky
+    std::mutex    mutex;
+
+    int writeAll(const void *data, size_t len);
+    int writeZeroes(unsigned long len);
+    int writeTarHeader(const std::string& name, const struct stat& statbuf);
+};
+
+#endif
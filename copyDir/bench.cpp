@@ -0,0 +1,521 @@
+/*
+ * Micro benchmarks for the copyDir building blocks.
+ *
+ * Usage: benchCopyDir [case ...]      (no case means all of them)
+ *
+ * Each case times the current implementation against the one it replaced, on synthetic
+ * data, and prints one line per data set so runs are easy to diff.
+ */
+
+extern "C" {
+#include "md5.h"
+#include "md5_mb.h"
+#include "fasthash.h"
+}
+
+#include "fileHash.h"
+#include "fileTable.h"
+#include "hashPool.h"
+#include "copyEngine.h"
+#include "ioRing.h"
+#include "dirScan.h"
+#include "sizeIndex.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock benchClock;
+
+static double msSince(benchClock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>( benchClock::now() - start ).count();
+}
+
+// Synthetic directory listing: a mix of 'standard' sizes shared by many files (think of
+// fixed-size records or thumbnails) and a long tail of unique ones.
+static unsigned long syntheticSize(std::mt19937_64& rng)
+{
+    std::uniform_int_distribution<unsigned long> standard( 1, 64 );
+    std::uniform_int_distribution<unsigned long> tail( 0, 1ul << 30 );
+
+    return (rng() & 3) ? tail( rng ) : standard( rng ) * 4096;
+}
+
+static void makeSyntheticDir(FileTable& entries, unsigned int numFiles, unsigned int seed)
+{
+    std::mt19937_64 rng( seed );
+
+    entries.clear();
+    for(unsigned int i=0; i<numFiles; i++)
+        entries.add( "file" + std::to_string( i ), syntheticSize( rng ), false );
+}
+
+/*
+ * Size matching: linear std::find_if per source file (previous approach) vs SizeIndex.
+ * Both walk all same-size candidates, and count them as a cheap correctness check.
+ */
+static void benchSizeIndex()
+{
+    std::cout << "== size index: destination lookup, src files = dst files" << std::endl;
+
+    for(unsigned int numFiles: {1000u, 10000u, 100000u}) {
+        FileTable srcEntries, dstEntries;
+        makeSyntheticDir( srcEntries, numFiles, 1 );
+        makeSyntheticDir( dstEntries, numFiles, 2 );
+
+        unsigned long linearHits = 0;
+        auto start = benchClock::now();
+        for(FileTable::Handle s=0; s<srcEntries.count(); s++) {
+            for(FileTable::Handle d=0; d<dstEntries.count(); d++)
+                if ( dstEntries.size( d ) == srcEntries.size( s ) ) linearHits++;
+        }
+        double linearMs = msSince( start );
+
+        unsigned long indexHits = 0;
+        start = benchClock::now();
+        SizeIndex index;
+        index.build( dstEntries );
+        double buildMs = msSince( start );
+        for(FileTable::Handle s=0; s<srcEntries.count(); s++) {
+            unsigned int count;
+            const unsigned int *run = index.find( srcEntries.size( s ), count );
+            for(unsigned int i=0; i<count; i++)
+                if ( dstEntries.size( run[i] ) == srcEntries.size( s ) ) indexHits++;
+        }
+        double indexMs = msSince( start );
+
+        std::cout << std::setw(7) << numFiles << " files: linear " << std::setw(10) << std::fixed
+                  << std::setprecision(3) << linearMs << " ms, index " << std::setw(8) << indexMs
+                  << " ms (build " << buildMs << " ms), x" << std::setprecision(1)
+                  << linearMs / indexMs << ( linearHits == indexHits ? "" : "  MISMATCH" )
+                  << std::endl;
+    }
+}
+
+/*
+ * MD5 throughput on in-memory data: 8 streams hashed one after the other with the
+ * scalar body() vs all together on the multi-buffer kernel.
+ */
+static void benchMD5x8()
+{
+    std::cout << "== md5: 8 buffers, scalar vs multi-buffer AVX2" << std::endl;
+    if ( !MD5x8_Available() ) { std::cout << "no AVX2 on this CPU; skipped" << std::endl; return; }
+
+    for(unsigned long bufSize: {4096ul, 1ul << 20, 16ul << 20}) {
+        std::vector<unsigned char> bufs[MD5X8_LANES];
+        for(int lane=0; lane<MD5X8_LANES; lane++) bufs[lane].assign( bufSize, (unsigned char) lane );
+
+        // Aim at ~256 MB hashed per variant
+        unsigned long reps = std::max( 1ul, (256ul << 20) / (bufSize * MD5X8_LANES) );
+        unsigned char md5[MD5X8_LANES][16];
+
+        auto start = benchClock::now();
+        for(unsigned long r=0; r<reps; r++)
+            for(int lane=0; lane<MD5X8_LANES; lane++) {
+                MD5_CTX ctx;
+                MD5_Init(&ctx);
+                MD5_Update(&ctx, bufs[lane].data(), bufSize);
+                MD5_Final(md5[lane], &ctx);
+            }
+        double scalarMs = msSince( start );
+
+        start = benchClock::now();
+        for(unsigned long r=0; r<reps; r++) {
+            const void *ptrs[MD5X8_LANES];
+            for(int lane=0; lane<MD5X8_LANES; lane++) ptrs[lane] = bufs[lane].data();
+            MD5x8_CTX ctx;
+            MD5x8_Init(&ctx);
+            MD5x8_Update(&ctx, ptrs, bufSize);
+            MD5x8_Final(md5, &ctx);
+        }
+        double x8Ms = msSince( start );
+
+        double totalMB = reps * bufSize * MD5X8_LANES / 1e6;
+        std::cout << std::setw(9) << bufSize << " bytes/buffer: scalar " << std::fixed << std::setprecision(1)
+                  << std::setw(7) << totalMB / scalarMs * 1e3 << " MB/s, x8 " << std::setw(7)
+                  << totalMB / x8Ms * 1e3 << " MB/s, x" << scalarMs / x8Ms << std::endl;
+    }
+}
+
+// Scratch file of 'size' pseudo random bytes under $TMPDIR (or /tmp); returns its path
+static std::string makeScratchFile(unsigned long size)
+{
+    const char *tmpDir = getenv( "TMPDIR" );
+    std::string path = std::string( tmpDir ? tmpDir : "/tmp" ) + "/benchCopyDir.XXXXXX";
+    int fd = mkstemp( &path[0] );
+
+    std::vector<unsigned char> buf( 1 << 20 );
+    std::mt19937_64 rng( 3 );
+    for(unsigned long done=0; done<size; done+=buf.size()) {
+        for(size_t i=0; i<buf.size(); i+=8) *(unsigned long *) &buf[i] = rng();
+        if ( write( fd, buf.data(), std::min( (unsigned long) buf.size(), size - done ) ) < 0 ) break;
+    }
+    fsync( fd );
+    close( fd );
+
+    return path;
+}
+
+// Drops the file from the page cache; it is clean after the fsync, so this sticks
+static void evictFromCache(const std::string& path)
+{
+    int fd = open( path.c_str(), O_RDONLY );
+    posix_fadvise( fd, 0, 0, POSIX_FADV_DONTNEED );
+    close( fd );
+}
+
+/*
+ * Digest throughput: kernels on memory, then whole files through computeDigest, both
+ * cached and cold. Size in MB from $BENCH_FILE_MB (default 256). Cold numbers are only
+ * meaningful on a real disk; on tmpfs there is no cache to drop.
+ */
+static void benchDigest()
+{
+    const char *fileMB = getenv( "BENCH_FILE_MB" );
+    unsigned long size = (fileMB ? atol( fileMB ) : 256) << 20;
+
+    std::cout << "== digest: MD5 vs fast128, " << (size >> 20) << " MB" << std::endl;
+
+    std::vector<unsigned char> mem( size, 0x5a );
+    struct { const char *name; DigestKind kind; int avx2; } kernels[] = {
+        { "MD5 scalar    ", DIGEST_MD5,     0 },
+        { "fast128 scalar", DIGEST_FAST128, 0 },
+        { "fast128 AVX2  ", DIGEST_FAST128, 1 },
+    };
+    for(auto& k: kernels) {
+        if ( k.avx2 && !FH128_UseAVX2( 1 ) ) continue;
+        if ( !k.avx2 ) FH128_UseAVX2( 0 );
+
+        unsigned char digest[16];
+        auto start = benchClock::now();
+        DigestCtx ctx( k.kind );
+        ctx.update( mem.data(), mem.size() );
+        ctx.final( digest );
+        double ms = msSince( start );
+        std::cout << "memory  " << k.name << ": " << std::fixed << std::setprecision(2)
+                  << size / ms / 1e6 << " GB/s" << std::endl;
+    }
+    FH128_UseAVX2( 1 );
+    mem.clear();
+    mem.shrink_to_fit();
+
+    std::string path = makeScratchFile( size );
+    for(DigestKind kind: {DIGEST_MD5, DIGEST_FAST128}) {
+        for(bool cold: {false, true}) {
+            unsigned char digest[16];
+            if ( cold ) evictFromCache( path );
+            else        computeDigest( kind, path, digest );       // warm it up
+
+            auto start = benchClock::now();
+            computeDigest( kind, path, digest );
+            double ms = msSince( start );
+            std::cout << (cold ? "cold    " : "cached  ") << std::setw(14) << std::left
+                      << digestName( kind ) << std::right << ": " << size / ms / 1e6 << " GB/s" << std::endl;
+        }
+    }
+    unlink( path.c_str() );
+}
+
+// computeDigest before the mmap path: read() into a 2 KB malloc'ed buffer
+static int computeDigest2KB(DigestKind kind, const std::string& filepath, unsigned char *digest)
+{
+    const int bufSize = 2048;
+
+    int fd = open( filepath.c_str(), O_RDONLY );
+    if ( fd == -1 ) return errno;
+
+    char *buf = (char *) malloc( bufSize );
+    DigestCtx ctx( kind );
+    int nbytes;
+    while ( (nbytes = read( fd, buf, bufSize )) > 0 ) ctx.update( buf, nbytes );
+    ctx.final( digest );
+
+    free( buf );
+    close( fd );
+    return nbytes ? errno : 0;
+}
+
+/*
+ * Hashing read paths, 4 KB to $BENCH_HASH_MAX_MB MB files (default 1024; up to 16384 for
+ * 16 GB): the old 2 KB read() loop, a 256 KB buffer, mmap, and the automatic pick. fast128
+ * digests, so that the reading shows rather than MD5. Files are cached after a first pass;
+ * past the RAM size that is a disk benchmark.
+ */
+static void benchMmap()
+{
+    const char *maxEnv = getenv( "BENCH_HASH_MAX_MB" );
+    unsigned long maxSize = (maxEnv ? atol( maxEnv ) : 1024) << 20;
+
+    std::cout << "== mmap: hashing read paths, fast128, cached files (GB/s)" << std::endl
+              << "      size  files      2KB read   256KB read         mmap         auto" << std::endl;
+
+    for(unsigned long size = 4096; size <= maxSize; size *= 4) {
+        unsigned int numFiles = std::max( 1ul, std::min( 1024ul, (256ul << 20) / size ) );
+        std::vector<std::string> paths;
+        for(unsigned int i=0; i<numFiles; i++) paths.push_back( makeScratchFile( size ) );
+
+        unsigned char digest[16];
+        for(const std::string& path: paths) computeDigest( DIGEST_FAST128, path, digest );   // warm up
+
+        std::cout << std::setw(8) << (size >= (1ul << 20) ? size >> 20 : size >> 10)
+                  << (size >= (1ul << 20) ? " MB" : " KB") << std::setw(6) << numFiles << std::fixed
+                  << std::setprecision(2);
+        for(int path=0; path<4; path++) {
+            auto start = benchClock::now();
+            for(const std::string& p: paths) {
+                if ( !path ) computeDigest2KB( DIGEST_FAST128, p, digest );
+                else         computeDigest( DIGEST_FAST128, p, digest,
+                                            path == 1 ? HASH_READ_BUFFERED : path == 2 ? HASH_READ_MMAP : HASH_READ_AUTO );
+            }
+            std::cout << std::setw(13) << (double) size * numFiles / msSince( start ) / 1e6;
+        }
+        std::cout << std::endl;
+
+        for(const std::string& path: paths) unlink( path.c_str() );
+    }
+}
+
+/*
+ * Blocking vs io_uring, hashing then copying a batch of cold files: $BENCH_FILES files
+ * (default 64) of $BENCH_FILE_MB MB each (default 4). Like the digest case, cold numbers
+ * only mean something on a real disk.
+ */
+static void benchUring()
+{
+    const char *numEnv = getenv( "BENCH_FILES" ), *mbEnv = getenv( "BENCH_FILE_MB" );
+    unsigned int  numFiles = numEnv ? atoi( numEnv ) : 64;
+    unsigned long size     = (mbEnv ? atol( mbEnv ) : 4) << 20;
+
+    std::cout << "== uring: " << numFiles << " cold files of " << (size >> 20) << " MB, 1 hashing thread"
+              << std::endl;
+    if ( !IoRing::available() ) { std::cout << "no io_uring here; skipped" << std::endl; return; }
+
+    std::vector<std::string> paths;
+    for(unsigned int i=0; i<numFiles; i++) paths.push_back( makeScratchFile( size ) );
+
+    for(IoEngine io: {IO_SYNC, IO_URING}) {
+        FileTable            entries;
+        std::vector<HashJob> hashJobs;
+        std::vector<CopyJob> copyJobs;
+        for(unsigned int i=0; i<numFiles; i++) {
+            evictFromCache( paths[i] );
+            hashJobs.push_back( { paths[i], &entries, entries.add( paths[i], size, false ) } );
+        }
+
+        HashStats hashStats;
+        hashFiles( hashJobs, DIGEST_FAST128, 1, io, hashStats );
+
+        for(unsigned int i=0; i<numFiles; i++) {
+            evictFromCache( paths[i] );
+            copyJobs.emplace_back( paths[i], paths[i] + ".copy" );
+        }
+        CopyStats copyStats;
+        copyFiles( copyJobs, io, copyStats );
+        for(const CopyJob& job: copyJobs) unlink( job.dstFilepath.c_str() );
+
+        std::cout << std::setw(5) << ioEngineName( io ) << ": hash " << std::fixed << std::setprecision(1)
+                  << std::setw(7) << hashStats.bytes / hashStats.seconds / 1e6 << " MB/s, copy " << std::setw(7)
+                  << copyStats.bytes / copyStats.seconds / 1e6 << " MB/s" << std::endl;
+    }
+
+    for(const std::string& path: paths) unlink( path.c_str() );
+}
+
+// The scandir + alphasort + stat per full path scan that dirScan.cpp replaced
+static int scanDirEntriesScandir(FileTable& fileEntries, std::string dirName)
+{
+    struct dirent **namelist;
+    int numEntries = scandir( dirName.c_str(), &namelist,
+                              [] (const struct dirent *e) { return (int) (strcmp( ".", e->d_name ) && strcmp( "..", e->d_name )); },
+                              alphasort );
+    if ( numEntries == -1 ) return errno;
+
+    struct stat statbuf;
+    for(int i=0; i<numEntries; i++) {
+        std::string fullPath = dirName + "/" + namelist[i]->d_name;
+        if ( !stat( fullPath.c_str(), &statbuf ) )
+            fileEntries.add( namelist[i]->d_name, strlen( namelist[i]->d_name ), statbuf.st_size, namelist[i]->d_type == DT_DIR );
+    }
+
+    for(int i=0; i<numEntries; i++) free( namelist[i] );
+    free( namelist );
+    return 0;
+}
+
+/*
+ * Directory enumeration, entries/s with a warm dentry cache: scandir + stat vs
+ * getdents64 + statx. $BENCH_SCAN_FILES empty files (default 200000; try 1000000).
+ */
+static void benchScan()
+{
+    const char *numEnv = getenv( "BENCH_SCAN_FILES" );
+    unsigned int numFiles = numEnv ? atoi( numEnv ) : 200000;
+
+    std::cout << "== scan: one directory of " << numFiles << " files" << std::endl;
+
+    const char *tmpDir = getenv( "TMPDIR" );
+    std::string dir = std::string( tmpDir ? tmpDir : "/tmp" ) + "/benchCopyDir.XXXXXX";
+    if ( !mkdtemp( &dir[0] ) ) { std::cout << "cannot create scratch dir; skipped" << std::endl; return; }
+
+    for(unsigned int i=0; i<numFiles; i++)
+        close( open( (dir + "/file" + std::to_string( i )).c_str(), O_WRONLY | O_CREAT, 0644 ) );
+
+    struct { const char *name; std::function<int(FileTable&)> scan; } scans[] = {
+        { "scandir+stat    ", [&dir] (FileTable& e) { return scanDirEntriesScandir( e, dir ); } },
+        { "getdents64+statx", [&dir] (FileTable& e) { return scanDirEntries( e, dir, false ); } },
+    };
+    for(auto& s: scans) {
+        double ms = 0;
+        for(int round=0; round<2; round++) {        // first one warms the caches up
+            FileTable entries;
+            auto start = benchClock::now();
+            s.scan( entries );
+            ms = msSince( start );
+            if ( entries.count() != numFiles ) std::cout << "MISMATCH: " << entries.count() << " entries" << std::endl;
+        }
+        std::cout << s.name << ": " << std::fixed << std::setprecision(0) << numFiles / ms * 1e3
+                  << " entries/s" << std::endl;
+    }
+
+    for(unsigned int i=0; i<numFiles; i++) unlink( (dir + "/file" + std::to_string( i )).c_str() );
+    rmdir( dir.c_str() );
+}
+
+// The entry struct FileTable replaced, as it was, one per file in a std::vector
+struct FileEntry {
+    std::string   name;
+    unsigned long size;
+    bool          isDir;
+    unsigned long dev;
+    unsigned long ino;
+    long long     mtimeNs;
+    long long     ctimeNs;
+    bool          sampleCached;
+    unsigned char sample[16];
+    bool          digestCached;
+    unsigned char digest[16];
+
+    FileEntry(const char *_name, unsigned long _size, bool _isDir) :
+        name( _name ), size(_size), isDir(_isDir), dev(0), ino(0), mtimeNs(0), ctimeNs(0),
+        sampleCached(false), digestCached(false)
+    {
+        memset(sample, 0, 16);
+        memset(digest, 0, 16);
+    }
+};
+
+static size_t heapInUse()
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+/*
+ * Entry storage: heap taken by $BENCH_ENTRIES entries (default 2000000) named like
+ * camera files, as a vector of FileEntry vs a FileTable, and the size-match loop over
+ * them: by-value FileEntry copies (as the source loop used to) vs table handles.
+ */
+static void benchEntries()
+{
+    const char *numEnv = getenv( "BENCH_ENTRIES" );
+    unsigned int numFiles = numEnv ? atoi( numEnv ) : 2000000;
+
+    std::cout << "== entries: " << numFiles << " files named like IMG_20240101_123456_000001.jpg" << std::endl;
+
+    auto nameOf = [] (unsigned int i) {
+        char name[64];
+        snprintf( name, sizeof(name), "IMG_2024%02u%02u_%06u_%06u.jpg", i % 12 + 1, i % 28 + 1, i % 240000, i );
+        return std::string( name );
+    };
+
+    // Destination side, the same for both, only the index is looked at. Sizes all over
+    // the place, so the loop is about going through the entries, not the collisions.
+    std::mt19937_64 rng( 2 );
+    FileTable dstTable;
+    for(unsigned int i=0; i<numFiles; i++) dstTable.add( nameOf( i ), rng() >> 34, false );
+    SizeIndex index;
+    index.build( dstTable );
+
+    rng.seed( 1 );
+    size_t heapBefore = heapInUse();
+    auto   start      = benchClock::now();
+    std::vector<FileEntry> vec;
+    for(unsigned int i=0; i<numFiles; i++) vec.emplace_back( nameOf( i ).c_str(), rng() >> 34, false );
+    double vecBuildMs = msSince( start );
+    size_t vecBytes   = heapInUse() - heapBefore;
+
+    unsigned long vecHits = 0;
+    start = benchClock::now();
+    for(FileEntry srcEntry: vec) {
+        unsigned int count;
+        const unsigned int *run = index.find( srcEntry.size, count );
+        for(unsigned int i=0; i<count; i++)
+            if ( dstTable.size( run[i] ) == srcEntry.size ) vecHits++;
+    }
+    double vecMatchMs = msSince( start );
+    std::vector<FileEntry>().swap( vec );
+
+    rng.seed( 1 );
+    heapBefore = heapInUse();
+    start      = benchClock::now();
+    FileTable table;
+    for(unsigned int i=0; i<numFiles; i++) table.add( nameOf( i ), rng() >> 34, false );
+    double tableBuildMs = msSince( start );
+    size_t tableBytes   = heapInUse() - heapBefore;
+
+    unsigned long tableHits = 0;
+    start = benchClock::now();
+    for(FileTable::Handle s=0; s<table.count(); s++) {
+        unsigned int count;
+        const unsigned int *run = index.find( table.size( s ), count );
+        for(unsigned int i=0; i<count; i++)
+            if ( dstTable.size( run[i] ) == table.size( s ) ) tableHits++;
+    }
+    double tableMatchMs = msSince( start );
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "vector<FileEntry>: " << std::setw(7) << vecBytes / 1e6 << " MB, " << std::setw(5)
+              << vecBytes / (double) numFiles << " B/entry, build " << std::setw(7) << vecBuildMs
+              << " ms, size match " << std::setw(7) << vecMatchMs << " ms" << std::endl
+              << "FileTable        : " << std::setw(7) << tableBytes / 1e6 << " MB, " << std::setw(5)
+              << tableBytes / (double) numFiles << " B/entry, build " << std::setw(7) << tableBuildMs
+              << " ms, size match " << std::setw(7) << tableMatchMs << " ms" << std::endl
+              << "x" << (double) vecBytes / tableBytes << " memory, x" << vecMatchMs / tableMatchMs
+              << " size match" << ( vecHits == tableHits ? "" : "  MISMATCH" ) << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    struct BenchCase { const char *name; std::function<void()> run; };
+    const BenchCase cases[] = {
+        { "index", benchSizeIndex },
+        { "md5x8", benchMD5x8 },
+        { "digest", benchDigest },
+        { "mmap", benchMmap },
+        { "uring", benchUring },
+        { "scan", benchScan },
+        { "entries", benchEntries },
+    };
+
+    for(const BenchCase& c: cases) {
+        bool selected = (argc == 1);
+        for(int i=1; i<argc; i++) selected |= !strcmp( argv[i], c.name );
+        if ( selected ) c.run();
+    }
+
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include "catalogue.h"
+#include "dirScan.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <iostream>
+
+int Catalogue::build(const std::string& _root)
+{
+    root = _root;
+    entries.clear();
+    dirOf.clear();
+    dirs.clear();
+
+    // Breadth first, with an explicit queue of relative dir paths; deep trees would
+    // otherwise mean deep recursion, and we do not need any particular order. The queue
+    // is 'dirs' itself; each path is kept once, however many files the dir holds.
+    dirs.push_back( "" );
+
+    FileTable                dirEntries;
+    std::vector<std::string> skipped;
+    for(unsigned int next = 0; next < dirs.size(); next++) {
+        std::string relDir = dirs[next];              // copy; vector may grow below
+        std::string absDir = relDir.empty() ? root : root + "/" + relDir;
+
+        dirEntries.clear();
+        skipped.clear();
+        int errScan = scanDirEntries( dirEntries, absDir, false, &skipped );
+        for(const std::string& path: skipped) std::cout << "Err retrieving data for file; skipping " << path << std::endl;
+        if ( errScan ) {
+            if ( relDir.empty() && errScan == ENOENT ) break;   // nothing to dedup against
+            if ( relDir.empty() ) return errScan;
+
+            std::cout << "Err scanning " << absDir << "; skipping it" << std::endl;
+            continue;
+        }
+
+        for(FileTable::Handle d=0; d<dirEntries.count(); d++) {
+            if ( dirEntries.isDir( d ) ) {
+                dirs.push_back( relDir.empty() ? std::string( dirEntries.name( d ) ) : relDir + "/" + dirEntries.name( d ) );
+                continue;
+            }
+
+            FileTable::Handle h = entries.add( dirEntries.name( d ), strlen( dirEntries.name( d ) ),
+                                               dirEntries.size( d ), false );
+            entries.setIdentity( h, dirEntries.dev( d ), dirEntries.ino( d ),
+                                 dirEntries.mtimeNs( d ), dirEntries.ctimeNs( d ) );
+            dirOf.push_back( next );
+        }
+    }
+
+    index.build( entries );
+
+    return 0;
+}
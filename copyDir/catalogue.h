@@ -0,0 +1,40 @@
+#ifndef __COPYDIR_CATALOGUE_H__
+#define __COPYDIR_CATALOGUE_H__
+
+#include "fileTable.h"
+#include "sizeIndex.h"
+
+#include <string>
+#include <vector>
+
+/*!
+  * @brief All the files under a destination tree, indexed by size.
+  *
+  * Used for tree-wide deduplication: a source file is skipped if its content exists
+  * anywhere under the target, not only in the directory at its same relative level.
+  * Digests are not computed here; they are filled in lazily into the entries, the same
+  * way per-directory scans do, so the catalogue ends up being a (size, digest) one at
+  * the cost of hashing only files involved in size collisions.
+  */
+struct Catalogue {
+    std::string               root;
+    FileTable                 entries;  // names are relative to their own dir...
+    std::vector<unsigned int> dirOf;    // ...which is this one, for each entry
+    std::vector<std::string>  dirs;     // relative to root; "" is root itself
+    SizeIndex                 index;
+
+    /*!
+      * @brief Scans the whole tree under 'root' and indexes its files.
+      * @return 0 on success (a missing root is just an empty catalogue), errno otherwise
+      * @remark unreadable subdirectories are reported and skipped
+      */
+    int build(const std::string& root);
+
+    std::string relPathOf(FileTable::Handle h) const {
+        const std::string& dir = dirs[ dirOf[h] ];
+        return dir.empty() ? std::string( entries.name( h ) ) : dir + "/" + entries.name( h );
+    }
+    std::string pathOf(FileTable::Handle h) const { return root + "/" + relPathOf( h ); }
+};
+
+#endif
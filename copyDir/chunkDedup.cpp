@@ -0,0 +1,284 @@
+#include "chunkDedup.h"
+#include "metadata.h"
+#include "metrics.h"
+#include "pageCache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+// Random 64-bit values, one per byte value; splitmix64 of a fixed seed, so boundaries
+// stay the same from run to run
+struct GearTable {
+    unsigned long long values[256];
+
+    GearTable() {
+        unsigned long long x = 0x636f70794469720aull;
+        for(int i=0; i<256; i++) {
+            unsigned long long z = (x += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            values[i] = z ^ (z >> 31);
+        }
+    }
+};
+
+static const unsigned long long *gearTable()
+{
+    static const GearTable table;
+    return table.values;
+}
+
+// The top 'bits' bits; the low ones of a Gear hash only depend on the last few bytes
+static unsigned long long topBits(int bits)
+{
+    return ~0ull << (64 - bits);
+}
+
+Chunker::Chunker(unsigned int _avgSize) : minSize(_avgSize / 4), maxSize(_avgSize * 4), avgSize(_avgSize)
+{
+    int bits = 0;
+    while ( (1u << (bits + 1)) <= avgSize ) bits++;
+    maskS = topBits( bits + 2 );
+    maskL = topBits( bits - 2 );
+}
+
+size_t Chunker::cut(const unsigned char *data, size_t size) const
+{
+    if ( size <= minSize ) return size;
+
+    const unsigned long long *gear = gearTable();
+    size_t end    = std::min( size, (size_t) maxSize );
+    size_t normal = std::min( end, (size_t) avgSize );
+
+    // Nothing can end before minSize, so those bytes are not even hashed
+    unsigned long long h = 0;
+    size_t i = minSize;
+    for(; i<normal; i++) {
+        h = (h << 1) + gear[data[i]];
+        if ( !(h & maskS) ) return i + 1;
+    }
+    for(; i<end; i++) {
+        h = (h << 1) + gear[data[i]];
+        if ( !(h & maskL) ) return i + 1;
+    }
+    return end;
+}
+
+// Reads fd to EOF, handing each chunk to 'chunk' along with its offset; 0 or errno,
+// the first one 'chunk' returns included
+template <typename Fn>
+static int forEachChunk(int fd, const Chunker& chunker, Fn chunk)
+{
+    const size_t bufSize = 4 << 20;     // well above maxSize
+    std::vector<unsigned char> buf( bufSize );
+
+    size_t        have = 0, pos = 0;
+    unsigned long offset = 0;
+    bool          eof = false;
+    while ( 1 ) {
+        // Keep a whole max size chunk ahead, or what is left of the file
+        if ( !eof && have - pos < chunker.maxSize ) {
+            memmove( buf.data(), buf.data() + pos, have - pos );
+            have -= pos;
+            pos = 0;
+            while ( have < bufSize ) {
+                ssize_t n = read( fd, buf.data() + have, bufSize - have );
+                if ( n == -1 ) { if ( errno == EINTR ) continue; return errno; }
+                if ( !n ) { eof = true; break; }
+                have += n;
+            }
+        }
+        if ( pos == have ) return 0;
+
+        size_t len = chunker.cut( buf.data() + pos, have - pos );
+        int err = chunk( buf.data() + pos, len, offset );
+        if ( err ) return err;
+        pos    += len;
+        offset += len;
+    }
+}
+
+static void chunkDigest(DigestKind kind, const unsigned char *data, size_t len, unsigned char *digest)
+{
+    DigestCtx ctx( kind );
+    ctx.update( data, len );
+    ctx.final( digest );
+}
+
+static bool digestLess(const ChunkIndex::Ref& a, const ChunkIndex::Ref& b)
+{
+    return memcmp( a.digest, b.digest, 16 ) < 0;
+}
+
+int ChunkIndex::add(const std::string& path)
+{
+    StageTimer timer( STAGE_CHUNK );
+
+    int fd = open( path.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fd == -1 ) return errno;
+
+    size_t       first = refs.size();
+    unsigned int file  = paths.size();
+    int err = forEachChunk( fd, chunker, [&] (const unsigned char *data, size_t len, unsigned long offset) {
+        Ref ref;
+        chunkDigest( kind, data, len, ref.digest );
+        ref.file   = file;
+        ref.length = len;
+        ref.offset = offset;
+        refs.push_back( ref );
+        timer.addBytes( len );
+        return 0;
+    } );
+    DropBehind( fd, false ).finish();
+
+    if ( err ) { close( fd ); refs.resize( first ); return err; }
+
+    paths.push_back( path );
+    fds.push_back( fd );
+    // Only a handful of target files get indexed per dir; a full sort each time is fine
+    std::stable_sort( refs.begin(), refs.end(), digestLess );
+    return 0;
+}
+
+ChunkIndex::~ChunkIndex()
+{
+    for(int fd: fds) close( fd );
+}
+
+const ChunkIndex::Ref *ChunkIndex::find(const unsigned char *digest) const
+{
+    Ref key;
+    memcpy( key.digest, digest, 16 );
+    auto it = std::lower_bound( refs.begin(), refs.end(), key, digestLess );
+    return it != refs.end() && !memcmp( it->digest, digest, 16 ) ? &*it : NULL;
+}
+
+// Errors meaning 'not this way', as in copyEngine.cpp
+static bool refused(int err)
+{
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == EOPNOTSUPP || err == ENOTSUP;
+}
+
+static int writeAt(int fd, const unsigned char *data, size_t len, off_t offset)
+{
+    while ( len ) {
+        ssize_t w = pwrite( fd, data, len, offset );
+        if ( w == -1 ) { if ( errno == EINTR ) continue; return errno; }
+        data   += w;
+        len    -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+// Copies a range between two files, in kernel if allowed; a source ending early means it
+// changed since it was chunked
+static int copyRange(int fdIn, off_t from, int fdOut, off_t to, size_t len)
+{
+    while ( len ) {
+        loff_t in = from, out = to;
+        ssize_t n = copy_file_range( fdIn, &in, fdOut, &out, len, 0 );
+        if ( n == -1 && errno == EINTR ) continue;
+        if ( n == -1 && !refused( errno ) ) return errno;
+
+        if ( n == -1 ) {
+            // Through user space then, a chunk at a time
+            unsigned char buf[64 * 1024];
+            n = pread( fdIn, buf, std::min( len, sizeof(buf) ), from );
+            if ( n == -1 ) { if ( errno == EINTR ) continue; return errno; }
+            if ( n ) { int err = writeAt( fdOut, buf, n, to ); if ( err ) return err; }
+        }
+        if ( !n ) return ESTALE;
+
+        from += n;
+        to   += n;
+        len  -= n;
+    }
+    return 0;
+}
+
+int copyFileChunked(const std::string& srcFilepath, const std::string& dstFilepath, const ChunkIndex& index,
+                    DigestCtx *digest, ChunkStats& chunkStats, CopyStats& stats)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    int fdIn = open( srcFilepath.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fdIn == -1 ) return errno;
+
+    std::string tmpFilepath = tempPathFor( dstFilepath );
+    int fdOut = open( tmpFilepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 );
+    if ( fdOut == -1 ) { int err = errno; close( fdIn ); return err; }
+
+    // Target files as they were indexed, whatever their paths hold now
+    const std::vector<int>& fds = index.fds;
+    std::vector<bool>       used( fds.size() );
+
+    // Consecutive chunks of the same target file, still in order there, make a single
+    // copy_file_range; the longer the range, the more the filesystem can share blocks
+    struct Range { unsigned int file; off_t from, to; size_t len; } pending = { 0, 0, 0, 0 };
+    auto flush = [&] () {
+        int err = pending.len ? copyRange( fds[pending.file], pending.from, fdOut, pending.to, pending.len ) : 0;
+        pending.len = 0;
+        return err;
+    };
+
+    ChunkStats local;
+    unsigned long size = 0;
+    int err = forEachChunk( fdIn, index.chunker, [&] (const unsigned char *data, size_t len, unsigned long offset) {
+        if ( digest ) digest->update( data, len );
+        size = offset + len;
+        local.chunks++;
+
+        unsigned char chunk[16];
+        chunkDigest( index.kind, data, len, chunk );
+        const ChunkIndex::Ref *ref = index.find( chunk );
+        if ( !ref || ref->length != len ) {
+            int errFlush = flush();
+            return errFlush ? errFlush : writeAt( fdOut, data, len, offset );
+        }
+
+        used[ref->file] = true;
+        local.reusedChunks++;
+        local.reusedBytes += len;
+        if ( pending.len && pending.file == ref->file && pending.from + (off_t) pending.len == (off_t) ref->offset ) {
+            pending.len += len;
+            return 0;
+        }
+        int errFlush = flush();
+        pending = { ref->file, (off_t) ref->offset, (off_t) offset, len };
+        return errFlush;
+    } );
+    if ( !err ) err = flush();
+
+    // Files are dropped from the page cache as a whole here, if the policy says so
+    for(size_t f=0; f<fds.size(); f++) {
+        if ( used[f] ) DropBehind( fds[f], false ).finish();
+    }
+    DropBehind( fdIn, false ).finish();
+    DropBehind( fdOut, true ).finish();
+    if ( !err && preserveMetadata() ) err = copyMetadata( fdIn, fdOut );
+    close( fdIn );
+    if ( close( fdOut ) && !err ) err = errno;
+
+    if ( !err && rename( tmpFilepath.c_str(), dstFilepath.c_str() ) ) err = errno;
+    if ( err ) { unlink( tmpFilepath.c_str() ); return err; }
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    metricsRecord( STAGE_COPY, std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count(), size );
+
+    local.files = 1;
+    local.bytes = size;
+    chunkStats += local;
+
+    stats.files++;
+    stats.bytes += size;
+    stats.filesBy[COPY_CHUNKED]++;
+    stats.seconds += std::chrono::duration<double>( elapsed ).count();
+
+    return 0;
+}
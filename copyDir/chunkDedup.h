@@ -0,0 +1,120 @@
+#ifndef __COPYDIR_CHUNKDEDUP_H__
+#define __COPYDIR_CHUNKDEDUP_H__
+
+#include "copyEngine.h"
+#include "fileHash.h"
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+/*!
+  * @brief Content-defined chunking, FastCDC style.
+  *
+  * A Gear rolling hash (one shift and one add per byte) runs over the data, and a chunk
+  * ends where its top bits are all zero. Boundaries depend on the contents only, not on
+  * offsets, so bytes inserted or removed somewhere shift the chunks after them but do
+  * not change them: two versions of a big file share all the chunks but a few.
+  * @remark normalized chunking: a stricter mask below the average size and a looser one
+  *         above keep chunk sizes close to the average; min and max are 1/4 and 4 times it.
+  */
+class Chunker {
+public:
+    explicit Chunker(unsigned int avgSize = 64 * 1024);    // power of 2
+
+    /*!
+      * @brief Length of the chunk starting at 'data'.
+      * @param size bytes available; unless they are the end of the file, at least maxSize
+      */
+    size_t cut(const unsigned char *data, size_t size) const;
+
+    unsigned int minSize;
+    unsigned int maxSize;
+
+private:
+    unsigned int       avgSize;
+    unsigned long long maskS;       // more bits: chunks shorter than the average are rare
+    unsigned long long maskL;       // fewer bits: chunks longer than it end soon
+};
+
+// Accumulated over all the chunked copies of a run
+struct ChunkStats {
+    unsigned long files;
+    unsigned long bytes;            // size of the files rebuilt
+    unsigned long reusedBytes;      // of them, copied from target files rather than written
+    unsigned long chunks;
+    unsigned long reusedChunks;
+
+    ChunkStats() : files(0), bytes(0), reusedBytes(0), chunks(0), reusedChunks(0) {}
+
+    ChunkStats& operator+=(const ChunkStats& other) {
+        files        += other.files;
+        bytes        += other.bytes;
+        reusedBytes  += other.reusedBytes;
+        chunks       += other.chunks;
+        reusedChunks += other.reusedChunks;
+        return *this;
+    }
+};
+
+/*!
+  * @brief The chunks of some target files, by digest: where new files can get their
+  *        contents from without them going through the source device again.
+  *
+  * Files indexed are kept open until the index goes: chunks are read from the very inode
+  * that was chunked, even once a copy has been renamed over its path.
+  */
+class ChunkIndex {
+public:
+    explicit ChunkIndex(DigestKind _kind, unsigned int avgChunk = 64 * 1024) : kind(_kind), chunker(avgChunk) {}
+    ~ChunkIndex();
+
+    ChunkIndex(const ChunkIndex&) = delete;
+    ChunkIndex& operator=(const ChunkIndex&) = delete;
+
+    /*!
+      * @brief Chunks a target file and indexes its chunks; reads it all.
+      * @return 0 on success, errno otherwise (the file is left out then)
+      */
+    int add(const std::string& path);
+
+    bool empty() const { return refs.empty(); }
+
+    // Where a chunk lives
+    struct Ref {
+        unsigned char digest[16];
+        unsigned int  file;         // in paths
+        unsigned int  length;
+        unsigned long offset;
+    };
+
+    // The first chunk with that digest, or NULL if none
+    const Ref *find(const unsigned char *digest) const;
+
+    DigestKind               kind;
+    Chunker                  chunker;
+    std::vector<std::string> paths;
+    std::vector<int>         fds;   // of those paths, open since indexed
+
+private:
+    std::vector<Ref> refs;          // sorted by digest
+};
+
+/*!
+  * @brief Copies a file by chunks: the ones found in the index are copied from their
+  *        target file with copy_file_range (so in kernel, or shared blocks where the
+  *        filesystem can), only the others are written out.
+  *
+  * The source is read once, chunked and hashed on the way. The copy is written to a
+  * temporary file next to the destination, then renamed over it, as the destination
+  * itself may be one of the files chunks are taken from; later copies still get that
+  * file's chunks from the index, which has it open.
+  * @param digest if not NULL, fed with the whole contents
+  * @return 0 on success, errno otherwise; a target file changed since it was indexed
+  *         (shorter now) gives ESTALE. The destination is untouched on failure.
+  */
+int copyFileChunked(const std::string& srcFilepath, const std::string& dstFilepath, const ChunkIndex& index,
+                    DigestCtx *digest, ChunkStats& chunkStats, CopyStats& stats);
+
+#endif
@@ -0,0 +1,1509 @@
+extern "C" {
+#include "md5.h"
+#include "md5_mb.h"
+#include "fasthash.h"
+}
+
+#include "archive.h"
+#include "chunkDedup.h"
+#include "copyEngine.h"
+#include "deltaUpdate.h"
+#include "digestCache.h"
+#include "dirScan.h"
+#include "dupGroups.h"
+#include "fileHash.h"
+#include "fileTable.h"
+#include "hashPool.h"
+#include "ioRing.h"
+#include "journal.h"
+#include "metadata.h"
+#include "metrics.h"
+#include "pageCache.h"
+#include "plan.h"
+#include "sizeIndex.h"
+#include "taskPool.h"
+
+#include "gtest/gtest.h"
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/xattr.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <random>
+#include <string>
+#include <thread>
+#include <map>
+#include <vector>
+
+namespace copyDir {
+
+// Names stay put while the arena grows block after block, including names bigger than a
+// block; digests are all zeroes until an entry gets room for them
+TEST(fileTableTest, KeepsNamesAndDigestsApart) {
+    FileTable entries;
+    std::vector<std::string> names;
+    for(unsigned int i=0; i<20000; i++) {
+        names.push_back( "file" + std::to_string( i ) + (i % 1000 ? "" : std::string( 70000, 'x' )) );
+        entries.add( names.back(), i, i % 3 == 0 );
+    }
+    entries.add( "dropped", 1, false );
+    entries.removeLast();
+
+    unsigned char digest[16];
+    memset( digest, 0xab, 16 );
+    entries.setDigest( 7, digest );
+
+    ASSERT_EQ( names.size(), entries.count() );
+    for(unsigned int i=0; i<names.size(); i++) {
+        ASSERT_STREQ( names[i].c_str(), entries.name( i ) );
+        EXPECT_EQ( i, entries.size( i ) );
+        EXPECT_EQ( i % 3 == 0, entries.isDir( i ) );
+        EXPECT_EQ( i == 7, entries.digestCached( i ) );
+        EXPECT_EQ( i == 7 ? 0xab : 0, entries.digest( i )[15] );
+        EXPECT_FALSE( entries.sampleCached( i ) );
+    }
+
+    FileTable more;
+    more.append( entries );
+    EXPECT_STREQ( names[12345].c_str(), more.name( 12345 ) );
+    EXPECT_EQ( 0, memcmp( digest, more.digest( 7 ), 16 ) );
+}
+
+TEST(sizeIndexTest, EmptyIndexFindsNothing) {
+    SizeIndex index;
+    unsigned int count = 1;
+    EXPECT_EQ( NULL, index.find( 0, count ) );
+    EXPECT_EQ( 0u, count );
+
+    FileTable entries;
+    index.build( entries );
+    EXPECT_EQ( NULL, index.find( 0, count ) );
+    EXPECT_EQ( 0u, count );
+}
+
+TEST(sizeIndexTest, RunsHoldAllEntriesOfSameSizeInScanOrder) {
+    FileTable entries;
+    for(unsigned int i=0; i<1000; i++)
+        entries.add( "f", (i % 7) * 4096, false );
+    entries.add( "dir", 4096, true );               // dirs never show up
+
+    SizeIndex index;
+    index.build( entries );
+
+    for(unsigned long k=0; k<7; k++) {
+        unsigned int count;
+        const unsigned int *run = index.find( k * 4096, count );
+        ASSERT_NE( (const unsigned int *) NULL, run );
+        ASSERT_EQ( k < 6 ? 143u : 142u, count );
+        for(unsigned int i=0; i<count; i++) {
+            EXPECT_EQ( k * 4096, entries.size( run[i] ) );
+            if ( i ) { EXPECT_LT( run[i-1], run[i] ); }
+        }
+    }
+
+    unsigned int count;
+    EXPECT_EQ( NULL, index.find( 123, count ) );
+}
+
+// Reference: the scalar body() in md5.c, through the classic API
+static void scalarMD5(const unsigned char *data, unsigned long size, unsigned char *md5)
+{
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, data, size);
+    MD5_Final(md5, &ctx);
+}
+
+class md5x8Test : public ::testing::Test {
+    protected:
+
+    void SetUp() override {
+        if ( !MD5x8_Available() ) GTEST_SKIP() << "no AVX2 on this CPU";
+
+        // Different content per lane, so a lane mixup cannot go unnoticed
+        std::mt19937 rng( 42 );
+        for(int lane=0; lane<MD5X8_LANES; lane++) {
+            data[lane].resize( maxSize );
+            for(unsigned char& byte: data[lane]) byte = rng();
+        }
+    }
+
+    // Hashes the first 'size' bytes of each lane, fed in pieces of 'step' bytes
+    void CheckAgainstScalar(unsigned long size, unsigned long step) {
+        MD5x8_CTX ctx;
+        MD5x8_Init(&ctx);
+        for(unsigned long done=0; done<size; done+=step) {
+            const void *ptrs[MD5X8_LANES];
+            for(int lane=0; lane<MD5X8_LANES; lane++) ptrs[lane] = data[lane].data() + done;
+            MD5x8_Update(&ctx, ptrs, std::min( step, size - done ));
+        }
+
+        unsigned char results[MD5X8_LANES][16];
+        MD5x8_Final(results, &ctx);
+
+        for(int lane=0; lane<MD5X8_LANES; lane++) {
+            unsigned char expected[16];
+            scalarMD5( data[lane].data(), size, expected );
+            ASSERT_EQ( 0, memcmp( expected, results[lane], 16 ) ) << "size " << size << ", step "
+                                                                  << step << ", lane " << lane;
+        }
+    }
+
+    static const unsigned long maxSize = 4096 + 300;
+    std::vector<unsigned char> data[MD5X8_LANES];
+};
+
+TEST_F(md5x8Test, KnownVector) {
+    const char *abc = "abc";
+    const void *ptrs[MD5X8_LANES];
+    for(int lane=0; lane<MD5X8_LANES; lane++) ptrs[lane] = abc;
+
+    MD5x8_CTX ctx;
+    MD5x8_Init(&ctx);
+    MD5x8_Update(&ctx, ptrs, 3);
+
+    unsigned char results[MD5X8_LANES][16];
+    MD5x8_Final(results, &ctx);
+
+    const unsigned char expected[16] = { 0x90, 0x01, 0x50, 0x98, 0x3c, 0xd2, 0x4f, 0xb0,
+                                         0xd6, 0x96, 0x3f, 0x7d, 0x28, 0xe1, 0x7f, 0x72 };
+    for(int lane=0; lane<MD5X8_LANES; lane++)
+        EXPECT_EQ( 0, memcmp( expected, results[lane], 16 ) );
+}
+
+// All the padding corner cases (55, 56, 63, 64 bytes...) and multi-block bodies
+TEST_F(md5x8Test, BitExactWithScalarAllSizesSingleUpdate) {
+    for(unsigned long size=0; size<=300; size++) CheckAgainstScalar( size, maxSize );
+    CheckAgainstScalar( maxSize, maxSize );
+}
+
+// Partial blocks carried over in the lane buffers between updates
+TEST_F(md5x8Test, BitExactWithScalarSplitUpdates) {
+    for(unsigned long step: {1ul, 7ul, 63ul, 64ul, 65ul, 1000ul})
+        CheckAgainstScalar( maxSize, step );
+}
+
+static std::vector<unsigned char> fastHash(const std::vector<unsigned char>& data, unsigned long step)
+{
+    FH128_CTX ctx;
+    FH128_Init(&ctx);
+    for(unsigned long done=0; done<data.size(); done+=step)
+        FH128_Update(&ctx, data.data() + done, std::min( step, data.size() - done ));
+
+    std::vector<unsigned char> result( 16 );
+    FH128_Final(result.data(), &ctx);
+    return result;
+}
+
+// The AVX2 bulk loop must give the very same hashes as the scalar one, however fed
+TEST(fastHashTest, AVX2BitExactWithScalar) {
+    if ( !FH128_UseAVX2( 1 ) ) GTEST_SKIP() << "no AVX2 on this CPU";
+
+    std::mt19937 rng( 7 );
+    std::vector<unsigned char> data( 5000 );
+    for(unsigned char& byte: data) byte = rng();
+
+    for(unsigned long size: {0ul, 1ul, 63ul, 64ul, 65ul, 1023ul, 1024ul, 1025ul, 2048ul, 5000ul})
+        for(unsigned long step: {1ul, 64ul, 100ul, 5000ul}) {
+            std::vector<unsigned char> prefix( data.begin(), data.begin() + size );
+
+            FH128_UseAVX2( 0 );
+            std::vector<unsigned char> scalar = fastHash( prefix, step );
+            FH128_UseAVX2( 1 );
+            EXPECT_EQ( scalar, fastHash( prefix, step ) ) << "size " << size << ", step " << step;
+        }
+}
+
+// Length, trailing zeros and stripe order must all change the hash
+TEST(fastHashTest, DistinguishesLengthAndOrder) {
+    std::vector<unsigned char> a( 128, 0 ), b( 129, 0 );
+    EXPECT_NE( fastHash( a, 128 ), fastHash( b, 129 ) );
+
+    std::vector<unsigned char> c( 2048 ), d;
+    for(unsigned int i=0; i<c.size(); i++) c[i] = i / 64;      // each stripe differs
+    d = c;
+    std::swap_ranges( d.begin(), d.begin() + 64, d.begin() + 64 );
+    EXPECT_NE( fastHash( c, 2048 ), fastHash( d, 2048 ) );
+    std::swap_ranges( d.begin(), d.begin() + 64, d.begin() + 64 );
+    std::swap_ranges( d.begin(), d.begin() + 1024, d.begin() + 1024 );   // whole blocks
+    EXPECT_NE( fastHash( c, 2048 ), fastHash( d, 2048 ) );
+}
+
+// Quality checks in the spirit of SMHasher, for a hash that decides copies are skippable.
+// Seeds are fixed, so a pass is a pass every time.
+struct Hash128 {
+    unsigned long long lo, hi;
+    bool operator==(const Hash128& o) const { return lo == o.lo && hi == o.hi; }
+    bool operator<(const Hash128& o) const { return lo != o.lo ? lo < o.lo : hi < o.hi; }
+};
+
+static Hash128 fastHash128(const unsigned char *data, size_t size)
+{
+    FH128_CTX ctx;
+    FH128_Init(&ctx);
+    FH128_Update(&ctx, data, size);
+    Hash128 h;
+    FH128_Final((unsigned char *) &h, &ctx);
+    return h;
+}
+
+// No collision in the 128 bits, nor in either half; a 32-bit slice collides about as
+// often as a random function's would
+static void ExpectNoCollisions(std::vector<Hash128> hashes, const char *what)
+{
+    const size_t n = hashes.size();
+    const double expected32 = (double) n * (n - 1) / 2 / 4294967296.0;
+    for(int part=0; part<3; part++) {
+        std::vector<unsigned long long> keys( n );
+        for(size_t i=0; i<n; i++) keys[i] = part == 0 ? hashes[i].lo : part == 1 ? hashes[i].hi : hashes[i].lo >> 32;
+        std::sort( keys.begin(), keys.end() );
+        size_t collisions = 0;
+        for(size_t i=1; i<n; i++) collisions += keys[i] == keys[i - 1];
+        if ( part < 2 ) {
+            EXPECT_EQ( 0u, collisions ) << what << ", 64-bit half " << part;
+        }
+        else {
+            EXPECT_LE( collisions, 2 * expected32 + 5 * sqrt( expected32 ) + 3 ) << what << ", top 32 bits";
+        }
+    }
+}
+
+// Every input bit flips every output bit half the time, whatever the length: short keys,
+// stripe and 1 KB block boundaries, a partial last stripe. From 3 bytes on, as SMHasher:
+// shorter keys are too few to sample, the collision test below goes through all of them.
+// The worst of some 130k cells of pure noise is near 5 sigma; 6 is the limit.
+TEST(fastHashTest, Avalanche) {
+    const unsigned int samples = 300;
+    const double       maxBias = 6 * 0.5 / sqrt( (double) samples );
+    std::mt19937_64 rng( 5 );
+
+    for(size_t len: {3ul, 4ul, 7ul, 8ul, 15ul, 16ul, 31ul, 32ul, 63ul, 64ul, 65ul, 127ul, 128ul,
+                     1023ul, 1024ul, 1025ul, 3000ul}) {
+        // Every bit of short keys; a spread of about 1024 of the long ones
+        const size_t bits = len * 8, stride = bits > 1024 ? bits / 1024 : 1;
+        std::vector<unsigned int> flips( (bits / stride + 1) * 128 );
+        std::vector<unsigned char> key( len );
+
+        for(unsigned int s=0; s<samples; s++) {
+            for(unsigned char& byte: key) byte = rng();
+            Hash128 h0 = fastHash128( key.data(), len );
+            for(size_t b=0, row=0; b<bits; b+=stride, row++) {
+                key[b / 8] ^= 1 << (b % 8);
+                Hash128 h1 = fastHash128( key.data(), len );
+                key[b / 8] ^= 1 << (b % 8);
+                unsigned long long d[2] = { h0.lo ^ h1.lo, h0.hi ^ h1.hi };
+                for(int o=0; o<128; o++) flips[row * 128 + o] += (d[o / 64] >> (o % 64)) & 1;
+            }
+        }
+
+        double worst = 0;
+        for(size_t row=0; row<(bits + stride - 1) / stride; row++)
+            for(int o=0; o<128; o++) worst = std::max( worst, fabs( (double) flips[row * 128 + o] / samples - 0.5 ) );
+        EXPECT_LT( worst, maxBias ) << "length " << len;
+    }
+}
+
+// Keys with at most 2 bits set out of 512 and 2048: zero products and near-empty stripes
+TEST(fastHashTest, SparseKeysDoNotCollide) {
+    for(size_t len: {64ul, 256ul}) {
+        std::vector<unsigned char> key( len, 0 );
+        std::vector<Hash128> hashes;
+        hashes.push_back( fastHash128( key.data(), len ) );
+        for(size_t a=0; a<len * 8; a++) {
+            key[a / 8] ^= 1 << (a % 8);
+            hashes.push_back( fastHash128( key.data(), len ) );
+            for(size_t b=a+1; b<len * 8; b++) {
+                key[b / 8] ^= 1 << (b % 8);
+                hashes.push_back( fastHash128( key.data(), len ) );
+                key[b / 8] ^= 1 << (b % 8);
+            }
+            key[a / 8] ^= 1 << (a % 8);
+        }
+        ExpectNoCollisions( hashes, len == 64 ? "sparse, 64 bytes" : "sparse, 256 bytes" );
+    }
+}
+
+// Repeating words over several blocks, where identical stripes could cancel out; all the
+// 2-byte keys; zero runs of every length up to 4 KB; numbered text keys
+TEST(fastHashTest, StructuredKeysDoNotCollide) {
+    std::mt19937_64 rng( 9 );
+    std::vector<Hash128> cyclic;
+    for(unsigned int i=0; i<50000; i++) {
+        std::vector<unsigned long long> words( 2048 / 8, rng() );
+        if ( i % 2 ) for(size_t w=0; w<words.size(); w+=2) words[w] = words[1] ^ 1;
+        cyclic.push_back( fastHash128( (const unsigned char *) words.data(), 2048 ) );
+    }
+    ExpectNoCollisions( cyclic, "cyclic" );
+
+    std::vector<Hash128> twoBytes;
+    for(unsigned int i=0; i<65536 + 256 + 1; i++) {
+        unsigned int  value = i < 65536 ? i : i - 65536;
+        unsigned char key[2] = { (unsigned char) value, (unsigned char) (value >> 8) };
+        twoBytes.push_back( fastHash128( key, i < 65536 ? 2 : i < 65536 + 256 ? 1 : 0 ) );
+    }
+    ExpectNoCollisions( twoBytes, "2 bytes and less" );
+
+    std::vector<unsigned char> zeroes( 4096, 0 );
+    std::vector<Hash128> zeroRuns;
+    for(size_t len=0; len<=zeroes.size(); len++) zeroRuns.push_back( fastHash128( zeroes.data(), len ) );
+    ExpectNoCollisions( zeroRuns, "zero runs" );
+
+    std::vector<Hash128> text;
+    for(unsigned int i=0; i<200000; i++) {
+        std::string key = "copyDir/file" + std::to_string( i ) + ".dat";
+        text.push_back( fastHash128( (const unsigned char *) key.data(), key.size() ) );
+    }
+    ExpectNoCollisions( text, "text" );
+}
+
+// Writes 'data' to a new scratch file under $TMPDIR (or /tmp); returns its path
+static std::string writeScratchFile(const std::vector<unsigned char>& data)
+{
+    const char *tmpDir = getenv( "TMPDIR" );
+    std::string path = std::string( tmpDir ? tmpDir : "/tmp" ) + "/copyDirTests.XXXXXX";
+    close( mkstemp( &path[0] ) );
+
+    std::ofstream out( path, std::ios::binary );
+    out.write( (const char *) data.data(), data.size() );
+    return path;
+}
+
+static std::vector<unsigned char> readWholeFile(const std::string& path)
+{
+    std::ifstream in( path, std::ios::binary );
+    return std::vector<unsigned char>( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+}
+
+// More entries than one getdents64 buffer holds, files and subdirs: every one comes back
+// once, with its size, dirs left out on request; the same when d_type is left unknown
+TEST(dirScanTest, ReadsWholeDirWithOrWithoutDType) {
+    const char *tmpDir = getenv( "TMPDIR" );
+    std::string dir = std::string( tmpDir ? tmpDir : "/tmp" ) + "/copyDirTests.XXXXXX";
+    ASSERT_TRUE( mkdtemp( &dir[0] ) );
+
+    // ~130 byte records: some 2000 per 256 KB buffer
+    const unsigned int numFiles = 6000, numDirs = 50;
+    const std::string  padding( 100, 'n' );
+    for(unsigned int i=0; i<numFiles; i++) {
+        int fd = open( (dir + "/" + padding + std::to_string( i )).c_str(), O_WRONLY | O_CREAT, 0644 );
+        ASSERT_NE( -1, fd );
+        ASSERT_EQ( 0, ftruncate( fd, i ) );
+        close( fd );
+    }
+    for(unsigned int i=0; i<numDirs; i++) ASSERT_EQ( 0, mkdir( (dir + "/dir" + std::to_string( i )).c_str(), 0755 ) );
+
+    for(bool ignore: {false, true}) {
+        scanIgnoreDType( ignore );
+        for(bool skipDirs: {false, true}) {
+            FileTable entries;
+            ASSERT_EQ( 0, scanDirEntries( entries, dir, skipDirs ) );
+            ASSERT_EQ( numFiles + (skipDirs ? 0 : numDirs), entries.count() ) << ignore << skipDirs;
+
+            std::vector<bool> seenFile( numFiles ), seenDir( numDirs );
+            for(FileTable::Handle h=0; h<entries.count(); h++) {
+                std::string name = entries.name( h );
+                if ( entries.isDir( h ) ) {
+                    ASSERT_EQ( 0u, name.find( "dir" ) ) << name;
+                    seenDir[std::stoul( name.substr( 3 ) )] = true;
+                    continue;
+                }
+                ASSERT_EQ( 0u, name.find( padding ) ) << name;
+                unsigned int i = std::stoul( name.substr( padding.size() ) );
+                EXPECT_EQ( i, entries.size( h ) );
+                EXPECT_FALSE( seenFile[i] );
+                seenFile[i] = true;
+            }
+            EXPECT_EQ( numFiles, (unsigned int) std::count( seenFile.begin(), seenFile.end(), true ) );
+            EXPECT_EQ( skipDirs ? 0 : numDirs, (unsigned int) std::count( seenDir.begin(), seenDir.end(), true ) );
+        }
+    }
+    scanIgnoreDType( false );
+
+    FileTable none;
+    EXPECT_EQ( ENOENT, scanDirEntries( none, dir + "/missing", false ) );
+    EXPECT_EQ( ENOTDIR, scanDirEntries( none, dir + "/" + padding + "0", false ) );
+
+    for(unsigned int i=0; i<numFiles; i++) unlink( (dir + "/" + padding + std::to_string( i )).c_str() );
+    for(unsigned int i=0; i<numDirs; i++) rmdir( (dir + "/dir" + std::to_string( i )).c_str() );
+    rmdir( dir.c_str() );
+}
+
+// Only the ends count: a change in the middle goes unnoticed, one near either end does not
+TEST(sampleTest, ComparesOnlyBothEnds) {
+    const unsigned long sampleBytes = 4096, size = 5 * sampleBytes;
+    std::mt19937 rng( 11 );
+    std::vector<unsigned char> base( size );
+    for(unsigned char& byte: base) byte = rng();
+
+    std::vector<unsigned char> middle = base, head = base, tail = base;
+    middle[ size / 2 ]++;
+    head[ sampleBytes - 1 ]++;
+    tail[ size - sampleBytes ]++;
+
+    unsigned char samples[4][16];
+    const std::vector<unsigned char> *datas[4] = { &base, &middle, &head, &tail };
+    for(int i=0; i<4; i++) {
+        std::string path = writeScratchFile( *datas[i] );
+        ASSERT_EQ( 0, computeSample( path, size, sampleBytes, samples[i] ) );
+        unlink( path.c_str() );
+    }
+
+    EXPECT_EQ( 0, memcmp( samples[0], samples[1], 16 ) );
+    EXPECT_NE( 0, memcmp( samples[0], samples[2], 16 ) );
+    EXPECT_NE( 0, memcmp( samples[0], samples[3], 16 ) );
+}
+
+TEST(sampleTest, ShrunkFileIsAnError) {
+    std::string path = writeScratchFile( std::vector<unsigned char>( 1000, 1 ) );
+    unsigned char sample[16];
+    EXPECT_EQ( EAGAIN, computeSample( path, 9000, 4096, sample ) );
+    unlink( path.c_str() );
+}
+
+// Mapped or read, small or past the mmap threshold, empty even: the same digests
+TEST(digestTest, ReadPathsAgree) {
+    std::mt19937 rng( 9 );
+    for(size_t size: {(size_t) 0, (size_t) 5000, (size_t) HASH_MMAP_MIN_BYTES + 4097}) {
+        std::vector<unsigned char> data( size );
+        for(unsigned char& byte: data) byte = rng();
+        std::string path = writeScratchFile( data );
+
+        unsigned char expected[16], got[16];
+        DigestCtx ctx( DIGEST_MD5 );
+        ctx.update( data.data(), data.size() );
+        ctx.final( expected );
+        for(HashRead how: {HASH_READ_AUTO, HASH_READ_BUFFERED, HASH_READ_MMAP}) {
+            ASSERT_EQ( 0, computeDigest( DIGEST_MD5, path, got, how ) );
+            EXPECT_EQ( 0, memcmp( expected, got, 16 ) ) << size << " bytes, read path " << how;
+        }
+        unlink( path.c_str() );
+    }
+}
+
+// Entries survive a reopen, and a changed mtime, a different digest kind or sample size
+// read as a miss; enough of them force the table to grow on the way
+TEST(digestCacheTest, RoundTripAndStaleness) {
+    std::string path = writeScratchFile( std::vector<unsigned char>() );
+
+    FileTable entries, fresh;
+    for(unsigned int i=0; i<3000; i++) {
+        unsigned char digest[16], sample[16];
+        memset( digest, i & 0xff, 16 );
+        memset( sample, ~i & 0xff, 16 );
+
+        FileTable::Handle h = entries.add( "f", 1000 + i, false );
+        entries.setIdentity( h, 42, i + 1, 7, 9 );
+        entries.setDigest( h, digest );
+        entries.setSample( h, sample );
+
+        h = fresh.add( "f", 1000 + i, false );
+        fresh.setIdentity( h, 42, i + 1, i == 5 ? 8 : 7, 9 );
+    }
+    {
+        DigestCache cache;
+        ASSERT_EQ( 0, cache.open( path ) );
+        cache.save( entries, DIGEST_MD5, 16 );
+        EXPECT_EQ( 3000u, cache.stores );
+    }
+
+    DigestCache cache;
+    ASSERT_EQ( 0, cache.open( path ) );
+    cache.load( fresh, DIGEST_FAST128, 32 );
+    EXPECT_EQ( 0u, cache.hits );
+
+    cache.load( fresh, DIGEST_MD5, 16 );
+    EXPECT_EQ( 2999u, cache.hits );
+    EXPECT_FALSE( fresh.digestCached( 5 ) );
+    for(unsigned int i=0; i<fresh.count(); i++) {
+        if ( i == 5 ) continue;
+        ASSERT_TRUE( fresh.digestCached( i ) && fresh.sampleCached( i ) );
+        EXPECT_EQ( 0, memcmp( entries.digest( i ), fresh.digest( i ), 16 ) );
+        EXPECT_EQ( 0, memcmp( entries.sample( i ), fresh.sample( i ), 16 ) );
+    }
+
+    cache.close();
+    unlink( path.c_str() );
+}
+
+// Whatever the method the kernel lets through, the copy must be exact and overwrite
+TEST(copyEngineTest, CopiesExactlyOverExistingFile) {
+    std::mt19937 rng( 5 );
+    std::vector<unsigned char> data( (3 << 20) + 123 );
+    for(unsigned char& byte: data) byte = rng();
+
+    std::string src = writeScratchFile( data );
+    std::string dst = writeScratchFile( std::vector<unsigned char>( 5 << 20, 1 ) );
+
+    CopyStats  stats;
+    CopyMethod method;
+    ASSERT_EQ( 0, copyFile( src, dst, NULL, method, stats ) );
+    EXPECT_EQ( 1u, stats.files );
+    EXPECT_EQ( data.size(), stats.bytes );
+    EXPECT_EQ( 1u, stats.filesBy[method] );
+
+    std::ifstream in( dst, std::ios::binary );
+    std::vector<unsigned char> copied( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+    EXPECT_TRUE( copied == data );
+
+    EXPECT_EQ( ENOENT, copyFile( src + ".missing", dst, NULL, method, stats ) );
+
+    unlink( src.c_str() );
+    unlink( dst.c_str() );
+}
+
+// Whatever the workers and the batching, each file gets the digest it gets on its own;
+// a missing one fails alone, with its errno in the job
+TEST(hashPoolTest, DigestsMatchAcrossThreadCounts) {
+    std::mt19937 rng( 13 );
+    std::vector<std::string> paths;
+    for(int i=0; i<40; i++) {
+        std::vector<unsigned char> data( i % 3 ? rng() % 300000 : 4096 );     // some batch together
+        for(unsigned char& byte: data) byte = rng();
+        paths.push_back( writeScratchFile( data ) );
+    }
+    paths.push_back( paths.back() + ".missing" );
+
+    for(IoEngine io: {IO_SYNC, IO_URING}) {
+        if ( io == IO_URING && !IoRing::available() ) continue;
+        for(DigestKind kind: {DIGEST_MD5, DIGEST_FAST128})
+            for(unsigned int numThreads: {1u, 2u, 3u, 8u}) {
+                FileTable            entries;
+                std::vector<HashJob> jobs;
+                for(const std::string& path: paths) {
+                    struct stat statbuf;
+                    unsigned long size = stat( path.c_str(), &statbuf ) ? 4096 : statbuf.st_size;
+                    jobs.push_back( { path, &entries, entries.add( path, size, false ), -1 } );
+                }
+
+                HashStats stats;
+                EXPECT_EQ( 1u, hashFiles( jobs, kind, numThreads, io, stats ) );
+                EXPECT_EQ( paths.size() - 1, stats.files );
+
+                for(size_t i=0; i+1<paths.size(); i++) {
+                    unsigned char expected[16];
+                    ASSERT_EQ( 0, computeDigest( kind, paths[i], expected ) );
+                    EXPECT_EQ( 0, jobs[i].err );
+                    ASSERT_TRUE( entries.digestCached( i ) );
+                    EXPECT_EQ( 0, memcmp( expected, entries.digest( i ), 16 ) )
+                        << ioEngineName( io ) << ", " << numThreads << " threads, file " << i;
+                }
+                EXPECT_EQ( ENOENT, jobs.back().err );
+                EXPECT_FALSE( entries.digestCached( paths.size() - 1 ) );
+            }
+    }
+
+    for(size_t i=0; i+1<paths.size(); i++) unlink( paths[i].c_str() );
+}
+
+// Files around the chunk sizes of the ring, more of them than it keeps in flight
+class uringTest : public ::testing::Test {
+    protected:
+
+    void SetUp() override {
+        if ( !IoRing::available() ) GTEST_SKIP() << "no io_uring here";
+
+        std::mt19937 rng( 9 );
+        for(unsigned long size: {0ul, 1ul, 131071ul, 131072ul, 131073ul, 524288ul, 600000ul, (3ul << 20) + 123})
+            for(int copies=0; copies<5; copies++) {
+                std::vector<unsigned char> data( size );
+                for(unsigned char& byte: data) byte = rng();
+                datas.push_back( data );
+                paths.push_back( writeScratchFile( data ) );
+            }
+    }
+
+    void TearDown() override {
+        for(const std::string& path: paths) unlink( path.c_str() );
+    }
+
+    std::vector<std::vector<unsigned char>> datas;
+    std::vector<std::string>                paths;
+};
+
+TEST_F(uringTest, HashesLikeBlockingReads) {
+    for(DigestKind kind: {DIGEST_MD5, DIGEST_FAST128}) {
+        FileTable            entries;
+        std::vector<HashJob> jobs;
+        for(size_t i=0; i<paths.size(); i++)
+            jobs.push_back( { paths[i], &entries, entries.add( paths[i], datas[i].size(), false ) } );
+
+        HashStats stats;
+        EXPECT_EQ( 0u, hashFiles( jobs, kind, 2, IO_URING, stats ) );
+
+        for(size_t i=0; i<paths.size(); i++) {
+            unsigned char expected[16];
+            ASSERT_EQ( 0, computeDigest( kind, paths[i], expected ) );
+            ASSERT_TRUE( entries.digestCached( i ) );
+            EXPECT_EQ( 0, memcmp( expected, entries.digest( i ), 16 ) ) << "size " << datas[i].size();
+        }
+    }
+}
+
+TEST_F(uringTest, CopiesExactly) {
+    std::vector<CopyJob> jobs;
+    for(const std::string& path: paths) jobs.emplace_back( path, path + ".copy" );
+    jobs.emplace_back( "/nonexistent/file", "/tmp/never" );
+
+    CopyStats stats;
+    copyFiles( jobs, IO_URING, stats );
+    EXPECT_EQ( paths.size(), stats.files );
+    EXPECT_EQ( paths.size(), stats.filesBy[COPY_URING] );
+    EXPECT_EQ( ENOENT, jobs.back().err );
+
+    for(size_t i=0; i<paths.size(); i++) {
+        ASSERT_EQ( 0, jobs[i].err );
+        std::ifstream in( jobs[i].dstFilepath, std::ios::binary );
+        std::vector<unsigned char> copied( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+        EXPECT_TRUE( copied == datas[i] ) << "size " << datas[i].size();
+        unlink( jobs[i].dstFilepath.c_str() );
+    }
+}
+
+// A file whose contents are not of the size it said at the start (procfs says 0) is
+// not copied short, or long: the copy fails and leaves nothing
+TEST_F(uringTest, FailsWhatChangedSize) {
+    std::string dst = paths[0] + ".proc";
+    std::vector<CopyJob> jobs;
+    jobs.emplace_back( "/proc/self/status", dst );
+    jobs[0].hash = true;
+
+    CopyStats stats;
+    copyFiles( jobs, IO_URING, stats );
+    EXPECT_EQ( ESTALE, jobs[0].err );
+    EXPECT_FALSE( jobs[0].digestCached );
+    EXPECT_NE( 0, access( dst.c_str(), F_OK ) );
+    EXPECT_NE( 0, access( tempPathFor( dst ).c_str(), F_OK ) );
+}
+
+// Sysfs says 4096 bytes and holds a line: whatever the kernel methods make of it, the
+// copy is the line, all of it
+TEST(copyEngineTest, CopiesFilesKernelMethodsStopShortOn) {
+    const char *sysfsFile = "/sys/kernel/mm/transparent_hugepage/enabled";
+    std::ifstream in( sysfsFile );
+    std::string expected( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+    if ( expected.empty() ) GTEST_SKIP() << "no " << sysfsFile << " here";
+
+    std::string dst = writeScratchFile( std::vector<unsigned char>() );
+    CopyStats   stats;
+    CopyMethod  method;
+    ASSERT_EQ( 0, copyFile( sysfsFile, dst, NULL, method, stats ) );
+    std::vector<unsigned char> copied = readWholeFile( dst );
+    EXPECT_EQ( expected, std::string( copied.begin(), copied.end() ) ) << copyMethodName( method );
+    unlink( dst.c_str() );
+}
+
+// Hashing on the way must give the digest of the source, on both engines
+TEST(copyEngineTest, HashesWhileCopying) {
+    std::mt19937 rng( 6 );
+    std::vector<unsigned char> data( (1 << 20) + 77 );
+    for(unsigned char& byte: data) byte = rng();
+    std::string src = writeScratchFile( data );
+
+    unsigned char expected[16];
+    ASSERT_EQ( 0, computeDigest( DIGEST_MD5, src, expected ) );
+
+    for(IoEngine io: {IO_SYNC, IO_URING}) {
+        if ( io == IO_URING && !IoRing::available() ) continue;
+
+        std::vector<CopyJob> jobs;
+        jobs.emplace_back( src, src + ".copy" );
+        jobs[0].hash = true;
+
+        CopyStats stats;
+        copyFiles( jobs, io, stats );
+        ASSERT_EQ( 0, jobs[0].err );
+        ASSERT_TRUE( jobs[0].digestCached );
+        EXPECT_EQ( 0, memcmp( expected, jobs[0].digest, 16 ) ) << ioEngineName( io );
+
+        unsigned char copied[16];
+        ASSERT_EQ( 0, computeDigest( DIGEST_MD5, jobs[0].dstFilepath, copied ) );
+        EXPECT_EQ( 0, memcmp( expected, copied, 16 ) );
+        unlink( jobs[0].dstFilepath.c_str() );
+    }
+
+    unlink( src.c_str() );
+}
+
+// A full binary tree of tasks, each one spawning its children like dirs do subdirs
+TEST(taskPoolTest, RunsTasksSpawnedByTasks) {
+    const int depth = 12;
+    std::atomic<unsigned int> visited( 0 );
+
+    TaskPool pool( 4 );
+    std::function<void(int)> visit = [&] (int level) {
+        visited++;
+        if ( level < depth )
+            for(int child=0; child<2; child++) pool.submit( [&visit, level] () { visit( level + 1 ); } );
+    };
+    pool.submit( [&visit] () { visit( 0 ); } );
+    pool.wait();
+    EXPECT_EQ( (1u << (depth + 1)) - 1, visited );
+
+    // Reusable once drained
+    pool.submit( [&visited] () { visited = 0; } );
+    pool.wait();
+    EXPECT_EQ( 0u, visited );
+}
+
+// Runs the copyDir binary built next to the tests (make tests builds it too), its output
+// thrown away; returns its exit status, or -1 if it could not run
+static int runCopyDir(std::vector<std::string> args, const std::string& stdoutPath = "/dev/null",
+                      const std::string& stderrPath = "/dev/null")
+{
+    args.insert( args.begin(), "./copyDir" );
+    std::vector<char *> argv;
+    for(std::string& arg: args) argv.push_back( &arg[0] );
+    argv.push_back( NULL );
+
+    pid_t pid = fork();
+    if ( pid == 0 ) {
+        dup2( open( stdoutPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 ), STDOUT_FILENO );
+        dup2( open( stderrPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 ), STDERR_FILENO );
+        execv( argv[0], argv.data() );
+        _exit( 127 );
+    }
+    int status;
+    if ( pid == -1 || waitpid( pid, &status, 0 ) != pid || !WIFEXITED( status ) ) return -1;
+    return WEXITSTATUS( status ) == 127 ? -1 : (signed char) WEXITSTATUS( status );
+}
+
+// A tree as relative path -> "dir", or size and MD5 of the contents
+static void listTree(const std::string& root, const std::string& rel, std::map<std::string, std::string>& tree)
+{
+    FileTable entries;
+    ASSERT_EQ( 0, scanDirEntries( entries, root + rel, false ) );
+    for(FileTable::Handle h=0; h<entries.count(); h++) {
+        std::string path = rel + "/" + entries.name( h );
+        if ( entries.isDir( h ) ) {
+            tree[path] = "dir";
+            listTree( root, path, tree );
+            continue;
+        }
+        unsigned char digest[16];
+        ASSERT_EQ( 0, computeDigest( DIGEST_MD5, root + path, digest ) );
+        tree[path] = std::to_string( entries.size( h ) ) + " " + std::string( (char *) digest, 16 );
+    }
+}
+
+static std::string makeScratchDir()
+{
+    const char *tmpDir = getenv( "TMPDIR" );
+    std::string dir = std::string( tmpDir ? tmpDir : "/tmp" ) + "/copyDirTests.XXXXXX";
+    return mkdtemp( &dir[0] ) ? dir : "";
+}
+
+static void writeFile(const std::string& path, const std::string& contents)
+{
+    std::ofstream out( path, std::ios::binary );
+    out << contents;
+}
+
+// A source tree a few levels deep, and a target holding some of it: files at the same
+// level, under other names, changed, or missing along with their whole dir (d and below)
+static void makeSyncFixture(const std::string& src, const std::string& dst)
+{
+    std::mt19937 rng( 21 );
+    auto randomText = [&rng] (size_t len) {
+        std::string text( len, 0 );
+        for(char& c: text) c = 'a' + rng() % 26;
+        return text;
+    };
+
+    for(std::string dir: {"", "/a", "/a/b", "/a/b/c", "/d", "/d/e", "/f"}) {
+        bool inTarget = dir.compare( 0, 2, "/d" ) != 0;
+        ASSERT_EQ( 0, mkdir( (src + dir).c_str(), 0755 ) );
+        if ( inTarget && !dir.empty() ) { ASSERT_EQ( 0, mkdir( (dst + dir).c_str(), 0755 ) ); }
+
+        for(int i=0; i<12; i++) {
+            std::string name     = dir + "/file" + std::to_string( i );
+            std::string contents = randomText( i % 4 == 0 ? 100 : 1000 + rng() % 50000 );
+            writeFile( src + name, contents );
+            if ( !inTarget ) continue;
+            if ( i % 3 == 0 ) writeFile( dst + name, contents );
+            if ( i % 3 == 1 ) writeFile( dst + name + ".moved", contents );
+            if ( i % 3 == 2 ) writeFile( dst + name, contents + "x" );
+        }
+    }
+}
+
+// The same target with one walker or several: walkers change the order, not the result
+TEST(walkersTest, SameTargetAsSerialRun) {
+    std::string scratch = makeScratchDir();
+    ASSERT_FALSE( scratch.empty() );
+    ASSERT_EQ( 0, mkdir( (scratch + "/dst1").c_str(), 0755 ) );
+    ASSERT_EQ( 0, mkdir( (scratch + "/dst4").c_str(), 0755 ) );
+    makeSyncFixture( scratch + "/src", scratch + "/dst1" );
+    makeSyncFixture( scratch + "/src2", scratch + "/dst4" );     // same seed, same trees
+
+    std::string cache = scratch + "/cache";
+    int serial = runCopyDir( { "-q", "-c", cache, "-w", "1", scratch + "/src", scratch + "/dst1" } );
+    if ( serial == -1 ) GTEST_SKIP() << "no ./copyDir binary to run";
+    EXPECT_EQ( 0, serial );
+    EXPECT_EQ( 0, runCopyDir( { "-q", "-c", cache, "-w", "4", "-j", "2", scratch + "/src2", scratch + "/dst4" } ) );
+
+    std::map<std::string, std::string> tree1, tree4, source;
+    listTree( scratch + "/dst1", "", tree1 );
+    listTree( scratch + "/dst4", "", tree4 );
+    listTree( scratch + "/src", "", source );
+    EXPECT_TRUE( tree1 == tree4 );
+    EXPECT_EQ( "dir", tree1["/d/e"] );
+    EXPECT_EQ( source["/a/b/file1"], tree1["/a/b/file1.moved"] );
+    EXPECT_EQ( 0u, tree1.count( "/a/b/file1" ) );              // a duplicate, not copied
+    EXPECT_EQ( source["/a/b/file2"], tree1["/a/b/file2"] );    // changed, copied over
+
+    EXPECT_EQ( 0, system( ("rm -rf " + scratch).c_str() ) );
+}
+
+// With -t a file whose content is anywhere under the target is skipped, wherever it is;
+// without, only the dir at the same level counts
+TEST(treeDedupTest, SkipsContentFoundElsewhereInTarget) {
+    std::string scratch = makeScratchDir();
+    ASSERT_FALSE( scratch.empty() );
+    for(std::string dir: {"/src", "/src/x", "/dst", "/dst/other", "/dst/other/deep", "/plain"})
+        ASSERT_EQ( 0, mkdir( (scratch + dir).c_str(), 0755 ) );
+    std::string elsewhere( 20000, 'e' ), fresh( 20000, 'f' );
+    writeFile( scratch + "/src/x/file", elsewhere );
+    writeFile( scratch + "/src/x/new", fresh );
+    writeFile( scratch + "/dst/other/deep/renamed", elsewhere );
+
+    int tree = runCopyDir( { "-q", "-t", scratch + "/src", scratch + "/dst" } );
+    if ( tree == -1 ) GTEST_SKIP() << "no ./copyDir binary to run";
+    EXPECT_EQ( 0, tree );
+    EXPECT_EQ( 0, runCopyDir( { "-q", scratch + "/src", scratch + "/plain" } ) );
+
+    std::map<std::string, std::string> target, plain, source;
+    listTree( scratch + "/dst", "", target );
+    listTree( scratch + "/plain", "", plain );
+    listTree( scratch + "/src", "", source );
+    EXPECT_EQ( 0u, target.count( "/x/file" ) );
+    EXPECT_EQ( source["/x/new"], target["/x/new"] );
+    EXPECT_EQ( source["/x/file"], target["/other/deep/renamed"] );
+    EXPECT_EQ( source["/x/file"], plain["/x/file"] );
+
+    EXPECT_EQ( 0, system( ("rm -rf " + scratch).c_str() ) );
+}
+
+// Totals add up both lists, and odd bytes in file names do not break the JSON
+TEST(planTest, WritesTotalsAndEscapedPaths) {
+    Plan plan, other;
+    plan.copies.push_back( { "src/a\"b", "dst/a\"b", 100, false } );
+    plan.copies.push_back( { "src/c", "dst/c", 40, true } );
+    other.hashes.push_back( { "src/c", 40 } );
+    other.hashes.push_back( { "dst/tab\there", 40 } );
+    other.dirsToCreate = 2;
+    plan += other;
+
+    std::string path = writeScratchFile( std::vector<unsigned char>() );
+    ASSERT_EQ( 0, plan.write( path, "src", "dst", "md5", 16, false ) );
+
+    std::ifstream in( path );
+    std::string json( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+    EXPECT_NE( std::string::npos, json.find( "\"copyFiles\": 1, \"copyBytes\": 100" ) );
+    EXPECT_NE( std::string::npos, json.find( "\"duplicateFiles\": 1, \"duplicateBytes\": 40" ) );
+    EXPECT_NE( std::string::npos, json.find( "\"hashFiles\": 2, \"hashBytes\": 80" ) );
+    EXPECT_NE( std::string::npos, json.find( "\"readBytes\": 180, \"writeBytes\": 100, \"maxWriteBytes\": 140" ) );
+    EXPECT_NE( std::string::npos, json.find( "\"dirsToCreate\": 2" ) );
+    EXPECT_NE( std::string::npos, json.find( "\"src/a\\\"b\"" ) );
+    EXPECT_NE( std::string::npos, json.find( "\"dst/tab\\u0009here\"" ) );
+
+    EXPECT_NE( 0, plan.write( "/nonexistent/dir/plan.json", "src", "dst", "md5", 16, false ) );
+    unlink( path.c_str() );
+}
+
+// UTF-8 goes through; bytes that are not, stray, cut short or overlong, are escaped
+TEST(planTest, EscapesBytesThatAreNotUtf8) {
+    EXPECT_EQ( "\"caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80\"", jsonString( "caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80" ) );
+    EXPECT_EQ( "\"caf\\u00e9\"", jsonString( "caf\xe9" ) );
+    EXPECT_EQ( "\"\\u00e2\\u0082\"", jsonString( "\xe2\x82" ) );
+    EXPECT_EQ( "\"\\u00c0\\u00af\"", jsonString( "\xc0\xaf" ) );
+    EXPECT_EQ( "\"\\u00ed\\u00a0\\u0080\"", jsonString( "\xed\xa0\x80" ) );       // a surrogate
+    EXPECT_EQ( "\"\\u0080x\"", jsonString( "\x80x" ) );
+}
+
+// -p - is the plan alone on stdout; whatever is said goes to stderr
+TEST(planTest, DashIsStdout) {
+    std::string scratch = makeScratchDir();
+    ASSERT_FALSE( scratch.empty() );
+    ASSERT_EQ( 0, mkdir( (scratch + "/src").c_str(), 0755 ) );
+    ASSERT_EQ( 0, mkdir( (scratch + "/dst").c_str(), 0755 ) );
+    writeFile( scratch + "/src/file", "contents" );
+
+    int exitCode = runCopyDir( { "-p", "-", scratch + "/src", scratch + "/dst" },
+                               scratch + "/out", scratch + "/err" );
+    if ( exitCode == -1 ) GTEST_SKIP() << "no ./copyDir binary to run";
+    EXPECT_EQ( 0, exitCode );
+
+    std::vector<unsigned char> outBytes = readWholeFile( scratch + "/out" ), errBytes = readWholeFile( scratch + "/err" );
+    std::string out( outBytes.begin(), outBytes.end() ), err( errBytes.begin(), errBytes.end() );
+    ASSERT_FALSE( out.empty() );
+    EXPECT_EQ( '{', out.front() );
+    EXPECT_EQ( "}\n", out.substr( out.size() - 2 ) );
+    EXPECT_NE( std::string::npos, out.find( "\"copyFiles\": 1, \"copyBytes\": 8" ) );
+    EXPECT_NE( std::string::npos, err.find( "Plan written to -" ) );
+    EXPECT_NE( 0, access( (scratch + "/dst/file").c_str(), F_OK ) );
+
+    EXPECT_EQ( 0, system( ("rm -rf " + scratch).c_str() ) );
+}
+
+// Counters are per thread; whatever the threads, totals must add up, and ended threads'
+// blocks must keep their counts for the next ones
+TEST(metricsTest, ThreadsAddUpAndJsonHasAllStages) {
+    StageTotals before = metricsTotals( STAGE_MKDIR );
+
+    for(int round=0; round<2; round++) {
+        std::vector<std::thread> threads;
+        for(int t=0; t<4; t++)
+            threads.emplace_back( [] () {
+                for(int i=0; i<1000; i++) metricsRecord( STAGE_MKDIR, 1000 + i, 10, 2 );
+            } );
+        for(std::thread& thread: threads) thread.join();
+    }
+
+    StageTotals after = metricsTotals( STAGE_MKDIR );
+    EXPECT_EQ( 8000u, after.calls - before.calls );
+    EXPECT_EQ( 16000u, after.items - before.items );
+    EXPECT_EQ( 80000u, after.bytes - before.bytes );
+
+    std::string path = writeScratchFile( std::vector<unsigned char>() );
+    ASSERT_EQ( 0, metricsWriteJson( path, 1.5 ) );
+
+    std::ifstream in( path );
+    std::string json( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+    EXPECT_NE( std::string::npos, json.find( "\"wallSeconds\": 1.5" ) );
+    for(int st=0; st<STAGES; st++)
+        EXPECT_NE( std::string::npos, json.find( std::string( "\"" ) + stageName( (Stage) st ) + "\": {" ) );
+    // 1000 to 1999 ns all fall in the [1024, 2048) bucket but the first 24
+    EXPECT_NE( std::string::npos, json.find( "\"p50Ns\": 2048" ) );
+
+    unlink( path.c_str() );
+}
+
+// A few bytes inserted near the start shift every later offset; the chunks after the
+// edit must come out the same anyway, and a rebuild must take them from the old file
+TEST(chunkDedupTest, RebuildsEditedFileFromOldChunks) {
+    std::mt19937 rng( 7 );
+    std::vector<unsigned char> old( 8 << 20 );
+    for(unsigned char& byte: old) byte = rng();
+
+    std::vector<unsigned char> edited( old );
+    edited.insert( edited.begin() + (1 << 20), 100, 'x' );
+    for(int i=0; i<10; i++) edited[(5 << 20) + i] ^= 0xff;
+
+    Chunker chunker;
+    size_t chunks = 0;
+    for(size_t pos = 0; pos < old.size(); chunks++) {
+        size_t len = chunker.cut( old.data() + pos, old.size() - pos );
+        ASSERT_LE( len, chunker.maxSize );
+        if ( pos + len < old.size() ) { ASSERT_GE( len, chunker.minSize ); }
+        pos += len;
+    }
+    EXPECT_GT( chunks, old.size() / (256 * 1024) );     // not all max sized, nor tiny
+    EXPECT_LT( chunks, old.size() / (16 * 1024) );
+
+    std::string basis = writeScratchFile( old );
+    std::string src   = writeScratchFile( edited );
+    std::string dst   = writeScratchFile( std::vector<unsigned char>() );
+
+    ChunkIndex index( DIGEST_MD5 );
+    ASSERT_EQ( 0, index.add( basis ) );
+    EXPECT_EQ( ENOENT, index.add( basis + ".missing" ) );
+    EXPECT_EQ( 1u, index.paths.size() );
+
+    ChunkStats chunkStats;
+    CopyStats  stats;
+    DigestCtx  digest( DIGEST_MD5 );
+    ASSERT_EQ( 0, copyFileChunked( src, dst, index, &digest, chunkStats, stats ) );
+    EXPECT_EQ( 1u, stats.filesBy[COPY_CHUNKED] );
+    EXPECT_EQ( edited.size(), chunkStats.bytes );
+    EXPECT_GT( chunkStats.reusedBytes, edited.size() * 9 / 10 );
+    EXPECT_LT( chunkStats.reusedChunks, chunkStats.chunks );
+
+    std::ifstream in( dst, std::ios::binary );
+    std::vector<unsigned char> rebuilt( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+    EXPECT_TRUE( rebuilt == edited );
+
+    unsigned char expected[16], got[16];
+    ASSERT_EQ( 0, computeDigest( DIGEST_MD5, src, expected ) );
+    digest.final( got );
+    EXPECT_EQ( 0, memcmp( expected, got, 16 ) );
+
+    // Rebuilding over the very file chunks are taken from
+    ASSERT_EQ( 0, copyFileChunked( src, basis, index, NULL, chunkStats, stats ) );
+    std::ifstream again( basis, std::ios::binary );
+    rebuilt.assign( (std::istreambuf_iterator<char>( again )), std::istreambuf_iterator<char>() );
+    EXPECT_TRUE( rebuilt == edited );
+
+    unlink( basis.c_str() );
+    unlink( src.c_str() );
+    unlink( dst.c_str() );
+}
+
+// Two files of a dir rebuilt from one index: 'a' from the old 'b', which the copy of 'b'
+// has replaced by then. Its chunks must still come from the old contents.
+TEST(chunkDedupTest, BasisReplacedByAnEarlierCopy) {
+    std::mt19937 rng( 11 );
+    std::vector<unsigned char> oldA( 4 << 20 ), oldB( 4 << 20 ), newB( 4 << 20 );
+    for(unsigned char& byte: oldA) byte = rng();
+    for(unsigned char& byte: oldB) byte = rng();
+    for(unsigned char& byte: newB) byte = rng();
+    std::vector<unsigned char> newA( oldB );
+    for(int i=0; i<100 * 1024; i++) newA.push_back( rng() );
+
+    std::string dstA = writeScratchFile( oldA ), dstB = writeScratchFile( oldB );
+    std::string srcA = writeScratchFile( newA ), srcB = writeScratchFile( newB );
+
+    ChunkIndex index( DIGEST_MD5 );
+    ASSERT_EQ( 0, index.add( dstA ) );
+    ASSERT_EQ( 0, index.add( dstB ) );
+
+    ChunkStats chunkStats;
+    CopyStats  stats;
+    ASSERT_EQ( 0, copyFileChunked( srcB, dstB, index, NULL, chunkStats, stats ) );
+    ASSERT_EQ( 0, copyFileChunked( srcA, dstA, index, NULL, chunkStats, stats ) );
+    EXPECT_TRUE( readWholeFile( dstB ) == newB );
+    EXPECT_TRUE( readWholeFile( dstA ) == newA );
+    EXPECT_GT( chunkStats.reusedBytes, oldB.size() * 9 / 10 );
+
+    for(const std::string& path: {dstA, dstB, srcA, srcB}) unlink( path.c_str() );
+}
+
+// Appended to, edited in the middle, cut near the start: the file must end up as the
+// source, with only what changed written
+TEST(deltaUpdateTest, WritesOnlyWhatChanged) {
+    std::mt19937 rng( 8 );
+    std::vector<unsigned char> old( (4 << 20) + 333 );
+    for(unsigned char& byte: old) byte = rng();
+    const unsigned int block = deltaBlockSize( old.size() );
+
+    std::vector<unsigned char> appended( old );
+    for(int i=0; i<100000; i++) appended.push_back( rng() );
+
+    std::vector<unsigned char> edited( old );
+    for(int i=0; i<10; i++) edited[(2 << 20) + i] ^= 0x5a;
+
+    std::vector<unsigned char> cut( old );
+    cut.erase( cut.begin() + 1000, cut.begin() + 1500 );
+
+    for(const std::vector<unsigned char> *src: {&appended, &edited, &cut, &old}) {
+        std::string srcPath = writeScratchFile( *src );
+        std::string dstPath = writeScratchFile( old );
+
+        DeltaStats deltaStats;
+        CopyStats  stats;
+        DigestCtx  digest( DIGEST_MD5 );
+        ASSERT_EQ( 0, updateFileDelta( srcPath, dstPath, DIGEST_MD5, &digest, deltaStats, stats ) );
+        EXPECT_TRUE( readWholeFile( dstPath ) == *src );
+        EXPECT_EQ( 1u, stats.filesBy[COPY_DELTA] );
+        EXPECT_EQ( src->size(), deltaStats.inPlaceBytes + deltaStats.movedBytes + deltaStats.writtenBytes );
+
+        unsigned char expected[16], got[16];
+        ASSERT_EQ( 0, computeDigest( DIGEST_MD5, srcPath, expected ) );
+        digest.final( got );
+        EXPECT_EQ( 0, memcmp( expected, got, 16 ) );
+
+        if ( src == &appended ) { EXPECT_LE( deltaStats.writtenBytes, 100000u + block ); }
+        if ( src == &edited )   { EXPECT_LE( deltaStats.writtenBytes, 2u * block + 333 ); }
+        if ( src == &cut )      { EXPECT_GT( deltaStats.movedBytes, old.size() * 9 / 10 ); }
+        if ( src == &old )      { EXPECT_EQ( 333u, deltaStats.writtenBytes ); }
+
+        unlink( srcPath.c_str() );
+        unlink( dstPath.c_str() );
+    }
+
+    DeltaStats deltaStats;
+    CopyStats  stats;
+    EXPECT_EQ( ENOENT, updateFileDelta( "/nonexistent", "/nonexistent.too", DIGEST_MD5, NULL, deltaStats, stats ) );
+}
+
+// Page cache policies change how files are read and written, never what ends up in them;
+// direct falls back where the filesystem has no O_DIRECT (tmpfs)
+TEST(pageCacheTest, PoliciesCopyAndHashTheSame) {
+    std::mt19937 rng( 10 );
+    std::vector<unsigned char> data( (3 << 20) + 1234 );      // not a whole number of blocks
+    for(unsigned char& byte: data) byte = rng();
+    std::string src = writeScratchFile( data );
+    std::string dst = writeScratchFile( std::vector<unsigned char>( 100, 1 ) );
+
+    unsigned char expected[16];
+    ASSERT_EQ( 0, computeDigest( DIGEST_MD5, src, expected ) );
+
+    for(PageCache policy: {PAGE_CACHE_DROP, PAGE_CACHE_DIRECT}) {
+        setPageCache( policy );
+
+        CopyStats  stats;
+        CopyMethod method;
+        DigestCtx  digest( DIGEST_MD5 );
+        ASSERT_EQ( 0, copyFile( src, dst, &digest, method, stats ) ) << pageCacheName( policy );
+        EXPECT_TRUE( readWholeFile( dst ) == data ) << pageCacheName( policy );
+        if ( method == COPY_DIRECT ) { EXPECT_EQ( PAGE_CACHE_DIRECT, policy ); }
+
+        unsigned char got[16];
+        digest.final( got );
+        EXPECT_EQ( 0, memcmp( expected, got, 16 ) );
+        ASSERT_EQ( 0, computeDigest( DIGEST_MD5, dst, got ) );
+        EXPECT_EQ( 0, memcmp( expected, got, 16 ) );
+
+        ASSERT_EQ( 0, copyFile( src, dst, NULL, method, stats ) );
+        EXPECT_TRUE( readWholeFile( dst ) == data ) << pageCacheName( policy ) << " via " << copyMethodName( method );
+    }
+    setPageCache( PAGE_CACHE_KEEP );
+
+    unlink( src.c_str() );
+    unlink( dst.c_str() );
+}
+
+// Cache dirs are made all the way down
+TEST(digestCacheTest, PathForMakesMissingDirs) {
+    std::string scratch = makeScratchDir();
+    ASSERT_FALSE( scratch.empty() );
+    std::string cachePath = DigestCache::pathFor( "/some/target", scratch + "/a/b/c" );
+    ASSERT_FALSE( cachePath.empty() );
+    EXPECT_EQ( scratch + "/a/b/c/", cachePath.substr( 0, scratch.size() + 7 ) );
+
+    DigestCache cache;
+    EXPECT_EQ( 0, cache.open( cachePath ) );
+    cache.close();
+
+    EXPECT_EQ( 0, system( ("rm -rf " + scratch).c_str() ) );
+}
+
+// A journal left by a killed run: its temporary files go, what it got done is resumed
+TEST(journalTest, ResumesWhatAKilledRunGotDone) {
+    const char *tmpDir = getenv( "TMPDIR" );
+    std::string dir = std::string( tmpDir ? tmpDir : "/tmp" ) + "/copyDirTests.XXXXXX";
+    ASSERT_TRUE( mkdtemp( &dir[0] ) );
+    std::string path = dir + "/run.journal";
+
+    // Tabs and newlines in names must not break the records
+    std::string done = dir + "/done\tfile\nname", half = dir + "/" + ".copyDir-half.tmp";
+    std::ofstream( done ) << "copied";
+    std::ofstream( half ) << "half";
+    struct stat statbuf;
+    ASSERT_EQ( 0, stat( done.c_str(), &statbuf ) );
+    long long mtime = statbuf.st_mtim.tv_sec * 1000000000ll + statbuf.st_mtim.tv_nsec;
+
+    {
+        Journal killed;
+        ASSERT_EQ( 0, killed.open( path, "src", "dst", false ) );
+        killed.copyStarted( half );
+        killed.recordFile( done );
+        killed.recordDir( dir );
+    }   // never finished
+
+    {
+        Journal resumed;
+        ASSERT_EQ( 0, resumed.open( path, "src", "dst", true ) );
+        EXPECT_EQ( 1u, resumed.cleaned );
+        EXPECT_NE( 0, access( half.c_str(), F_OK ) );
+        EXPECT_TRUE( resumed.fileDone( done, 6, mtime ) );
+        EXPECT_FALSE( resumed.fileDone( done, 7, mtime ) );
+        EXPECT_EQ( 1u, resumed.resumableDirs() );
+
+        // A second run meanwhile gets no journal, and leaves this one's alone
+        std::ofstream( half ) << "half again";
+        resumed.copyStarted( half );
+        Journal concurrent;
+        EXPECT_EQ( EWOULDBLOCK, concurrent.open( path, "src", "dst", false ) );
+        EXPECT_EQ( 0, access( half.c_str(), F_OK ) );
+        unlink( half.c_str() );
+    }
+
+    // Another pair of dirs, or a run not resuming, starts over
+    Journal other;
+    ASSERT_EQ( 0, other.open( path, "src2", "dst", true ) );
+    EXPECT_EQ( 0u, other.resumableFiles() );
+
+    other.finish();
+    EXPECT_NE( 0, access( path.c_str(), F_OK ) );
+
+    // Copies are renamed into place; nothing is left under the temporary name
+    std::string dst = dir + "/copy";
+    CopyStats  stats;
+    CopyMethod method;
+    ASSERT_EQ( 0, copyFile( done, dst, NULL, method, stats ) );
+    EXPECT_NE( 0, access( tempPathFor( dst ).c_str(), F_OK ) );
+    EXPECT_EQ( dir + "/.copyDir-copy.tmp", tempPathFor( dst ) );
+    EXPECT_EQ( 0, access( dst.c_str(), F_OK ) );
+
+    unlink( done.c_str() );
+    unlink( dst.c_str() );
+    rmdir( dir.c_str() );
+}
+
+// Done with records reach the journal after a sync of the target, a second apart at most
+TEST(journalTest, HoldsRecordsBackUntilSynced) {
+    std::string scratch = makeScratchDir();
+    ASSERT_FALSE( scratch.empty() );
+    std::string path = scratch + "/run.journal", first = scratch + "/first", second = scratch + "/second";
+    writeFile( first, "1" );
+    writeFile( second, "2" );
+
+    Journal journal;
+    ASSERT_EQ( 0, journal.open( path, "src", scratch, false ) );
+    journal.recordFile( first );                // the first sync is due straight away
+    journal.recordFile( second );
+    auto contents = [&path] () {
+        std::vector<unsigned char> bytes = readWholeFile( path );
+        return std::string( bytes.begin(), bytes.end() );
+    };
+    EXPECT_NE( std::string::npos, contents().find( "F\t" + first ) );
+    EXPECT_EQ( std::string::npos, contents().find( "F\t" + second ) );
+
+    journal.flush();
+    EXPECT_NE( std::string::npos, contents().find( "F\t" + second ) );
+
+    journal.finish();
+    EXPECT_EQ( 0, system( ("rm -rf " + scratch).c_str() ) );
+}
+
+// A run on a target another one is syncing into does not start: their temporary files
+// would be the same
+TEST(journalTest, SecondRunOnTargetDoesNotStart) {
+    std::string scratch = makeScratchDir();
+    ASSERT_FALSE( scratch.empty() );
+    ASSERT_EQ( 0, mkdir( (scratch + "/src").c_str(), 0755 ) );
+    ASSERT_EQ( 0, mkdir( (scratch + "/dst").c_str(), 0755 ) );
+    writeFile( scratch + "/src/file", "contents" );
+    std::string cache = scratch + "/cache";
+
+    {
+        Journal running;
+        ASSERT_EQ( 0, running.open( Journal::pathFor( scratch + "/dst", cache ), scratch + "/src", scratch + "/dst", false ) );
+        int exitCode = runCopyDir( { "-c", cache, scratch + "/src", scratch + "/dst" } );
+        if ( exitCode == -1 ) GTEST_SKIP() << "no ./copyDir binary to run";
+        EXPECT_EQ( -2, exitCode );
+        EXPECT_NE( 0, access( (scratch + "/dst/file").c_str(), F_OK ) );
+    }
+
+    EXPECT_EQ( 0, runCopyDir( { "-c", cache, scratch + "/src", scratch + "/dst" } ) );
+    EXPECT_EQ( 0, access( (scratch + "/dst/file").c_str(), F_OK ) );
+
+    EXPECT_EQ( 0, system( ("rm -rf " + scratch).c_str() ) );
+}
+
+// Linking a duplicate replaces whatever held its path; a refused reflink leaves it as it was
+TEST(copyEngineTest, LinksDuplicatesIntoPlace) {
+    std::string existing = writeScratchFile( std::vector<unsigned char>( 5000, 7 ) );
+    std::string dst      = writeScratchFile( std::vector<unsigned char>( 10, 1 ) );
+
+    CopyStats stats;
+    int err = linkFile( existing, dst, LINK_DUPS_REFLINK, stats );
+    if ( err ) {
+        EXPECT_TRUE( err == EOPNOTSUPP || err == EXDEV || err == EINVAL || err == ENOTTY ) << strerror( err );
+        EXPECT_TRUE( readWholeFile( dst ) == std::vector<unsigned char>( 10, 1 ) );
+    }
+    else EXPECT_EQ( 1u, stats.filesBy[COPY_CLONED] );
+    EXPECT_NE( 0, access( tempPathFor( dst ).c_str(), F_OK ) );
+
+    ASSERT_EQ( 0, linkFile( existing, dst, LINK_DUPS_HARD, stats ) );
+    struct stat a, b;
+    ASSERT_EQ( 0, stat( existing.c_str(), &a ) );
+    ASSERT_EQ( 0, stat( dst.c_str(), &b ) );
+    EXPECT_EQ( a.st_ino, b.st_ino );
+    EXPECT_EQ( 2u, b.st_nlink );
+
+    // Again, over a name of the very same inode: a no-op for rename, nothing left behind
+    ASSERT_EQ( 0, linkFile( existing, dst, LINK_DUPS_HARD, stats ) );
+    EXPECT_NE( 0, access( tempPathFor( dst ).c_str(), F_OK ) );
+    EXPECT_EQ( 2u, stats.filesBy[COPY_HARDLINK] );
+
+    unlink( existing.c_str() );
+    unlink( dst.c_str() );
+}
+
+// Groups hold distinct files of the same contents; samples alone do not make a group
+TEST(dupGroupsTest, GroupsSameContentsOnly) {
+    const char *tmpDir = getenv( "TMPDIR" );
+    std::string root = std::string( tmpDir ? tmpDir : "/tmp" ) + "/copyDirTests.XXXXXX";
+    ASSERT_TRUE( mkdtemp( &root[0] ) );
+    ASSERT_EQ( 0, mkdir( (root + "/sub").c_str(), 0700 ) );
+
+    std::mt19937 rng( 12 );
+    std::vector<unsigned char> big( 100000 ), middle( 100000 );
+    for(unsigned char& byte: big) byte = rng();
+    middle = big;
+    middle[50000] ^= 1;                         // same ends, same sample
+
+    auto write = [&root] (const std::string& name, const std::vector<unsigned char>& data) {
+        std::ofstream( root + "/" + name, std::ios::binary ).write( (const char *) data.data(), data.size() );
+    };
+    write( "big", big );
+    write( "sub/big", big );
+    write( "middle", middle );
+    write( "small", std::vector<unsigned char>( 100, 3 ) );
+    write( "sub/small", std::vector<unsigned char>( 100, 3 ) );
+    write( "empty", {} );
+    write( "sub/empty", {} );
+    ASSERT_EQ( 0, link( (root + "/big").c_str(), (root + "/sub/hardlink").c_str() ) );
+
+    Catalogue catalogue;
+    ASSERT_EQ( 0, catalogue.build( root ) );
+    HashStats stats;
+    std::vector<DupGroup> groups;
+    EXPECT_EQ( 0u, findDupGroups( catalogue, DIGEST_MD5, 4, 2, IO_SYNC, stats, groups ) );
+
+    ASSERT_EQ( 2u, groups.size() );
+    EXPECT_EQ( (std::vector<std::string>{ "big", "sub/big" }), groups[0].paths );
+    EXPECT_EQ( (std::vector<std::string>{ "small", "sub/small" }), groups[1].paths );
+    EXPECT_EQ( 3u, stats.sampledFiles );
+
+    std::string json = root + "/groups.json";
+    ASSERT_EQ( 0, writeDupGroups( json, root, DIGEST_MD5, groups ) );
+    std::ifstream in( json );
+    std::string text( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+    EXPECT_NE( std::string::npos, text.find( "\"groups\": 2, \"duplicateFiles\": 2, \"duplicateBytes\": 100100" ) );
+
+    for(const char *name: {"big", "sub/big", "middle", "small", "sub/small", "empty", "sub/empty", "sub/hardlink", "groups.json"})
+        unlink( (root + "/" + name).c_str() );
+    rmdir( (root + "/sub").c_str() );
+    rmdir( root.c_str() );
+}
+
+// Mode, times and xattrs come along with the contents, when asked for
+TEST(metadataTest, CopiesKeepTheirSourceMetadata) {
+    std::string src = writeScratchFile( std::vector<unsigned char>( 3000, 5 ) );
+    std::string dst = writeScratchFile( {} );
+    unlink( dst.c_str() );
+
+    ASSERT_EQ( 0, chmod( src.c_str(), 0604 ) );
+    bool xattrs = !setxattr( src.c_str(), "user.copyDir", "yes", 3, 0 );     // not every filesystem has them
+    struct timespec times[2] = { { 1000000000, 1 }, { 1000000001, 999 } };
+    ASSERT_EQ( 0, utimensat( AT_FDCWD, src.c_str(), times, 0 ) );
+
+    setPreserveMetadata( true );
+    CopyStats  stats;
+    CopyMethod method;
+    ASSERT_EQ( 0, copyFile( src, dst, NULL, method, stats ) );
+    setPreserveMetadata( false );
+
+    struct stat a, b;
+    ASSERT_EQ( 0, stat( src.c_str(), &a ) );
+    ASSERT_EQ( 0, stat( dst.c_str(), &b ) );
+    EXPECT_EQ( 0604u, b.st_mode & 07777 );
+    EXPECT_EQ( a.st_uid, b.st_uid );
+    EXPECT_EQ( 1000000001, b.st_mtim.tv_sec );
+    EXPECT_EQ( 999, b.st_mtim.tv_nsec );
+    if ( xattrs ) {
+        char value[8];
+        ASSERT_EQ( 3, getxattr( dst.c_str(), "user.copyDir", value, sizeof(value) ) );
+        EXPECT_EQ( 0, memcmp( value, "yes", 3 ) );
+    }
+
+    // Off again: a new file's defaults
+    ASSERT_EQ( 0, copyFile( src, dst, NULL, method, stats ) );
+    ASSERT_EQ( 0, stat( dst.c_str(), &b ) );
+    EXPECT_NE( 1000000001, b.st_mtim.tv_sec );
+
+    unlink( src.c_str() );
+    unlink( dst.c_str() );
+}
+
+// Stripes land in any order and any thread; the copy is the same, short last one included
+TEST(copyEngineTest, CopiesInStripes) {
+    std::mt19937 rng( 13 );
+    std::vector<unsigned char> data( (1 << 20) + 12345 );
+    for(unsigned char& byte: data) byte = rng();
+    std::string src = writeScratchFile( data );
+    std::string dst = writeScratchFile( std::vector<unsigned char>( 10, 1 ) );
+
+    for(PageCache policy: {PAGE_CACHE_KEEP, PAGE_CACHE_DROP}) {
+        setPageCache( policy );
+        CopyStats  stats;
+        CopyMethod method;
+        ASSERT_EQ( 0, copyFileStriped( src, dst, 64 * 1024, 4, method, stats ) );
+        EXPECT_TRUE( method == COPY_STRIPED || method == COPY_REFLINK );
+        EXPECT_TRUE( readWholeFile( dst ) == data ) << pageCacheName( policy );
+        EXPECT_EQ( data.size(), stats.bytes );
+        EXPECT_NE( 0, access( tempPathFor( dst ).c_str(), F_OK ) );
+    }
+    setPageCache( PAGE_CACHE_KEEP );
+
+    unlink( src.c_str() );
+    unlink( dst.c_str() );
+}
+
+// Tar into a file, a name long enough for a pax header included, checksums and all; the
+// lengths format through a pipe, where the contents are spliced in
+TEST(archiveTest, StreamsTarAndLengths) {
+    std::mt19937 rng( 17 );
+    std::vector<unsigned char> a( 1000 ), b( 70000 );
+    for(unsigned char& byte: a) byte = rng();
+    for(unsigned char& byte: b) byte = rng();
+    std::string srcA = writeScratchFile( a ), srcB = writeScratchFile( b );
+    std::string longName = std::string( 120, 'd' ) + "/" + std::string( 150, 'f' );
+
+    std::string tarPath = writeScratchFile( {} );
+    ArchiveWriter tar;
+    CopyStats     stats;
+    CopyMethod    method;
+    ASSERT_EQ( 0, tar.open( tarPath, ARCHIVE_TAR ) );
+    ASSERT_EQ( 0, tar.add( srcA, "sub/a", method, stats ) );
+    ASSERT_EQ( 0, tar.add( srcB, longName, method, stats ) );
+    ASSERT_EQ( 0, tar.finish() );
+    EXPECT_EQ( 2u, stats.files );
+    EXPECT_EQ( a.size() + b.size(), stats.bytes );
+
+    // Header, 2 blocks of a; pax header and its records, header, 137 blocks of b; the end
+    std::vector<unsigned char> out = readWholeFile( tarPath );
+    ASSERT_EQ( (1 + 2 + 2 + 1 + 137 + 2) * 512u, out.size() );
+    auto header = [&out] (unsigned int block) { return (const char *) &out[block * 512]; };
+    for(unsigned int block: {0u, 3u, 5u}) {
+        unsigned int sum = 0;
+        for(unsigned int i=0; i<512; i++) sum += i >= 148 && i < 156 ? ' ' : out[block * 512 + i];
+        EXPECT_EQ( sum, strtoul( header( block ) + 148, NULL, 8 ) ) << block;
+        EXPECT_STREQ( "ustar", header( block ) + 257 );
+    }
+    EXPECT_STREQ( "sub/a", header( 0 ) );
+    EXPECT_EQ( a.size(), strtoul( header( 0 ) + 124, NULL, 8 ) );
+    EXPECT_EQ( 0, memcmp( a.data(), header( 1 ), a.size() ) );
+    EXPECT_EQ( 'x', header( 3 )[156] );
+    EXPECT_EQ( "281 path=" + longName + "\n", std::string( header( 4 ), strtoul( header( 3 ) + 124, NULL, 8 ) ) );
+    EXPECT_EQ( '0', header( 5 )[156] );
+    EXPECT_EQ( b.size(), strtoul( header( 5 ) + 124, NULL, 8 ) );
+    EXPECT_EQ( 0, memcmp( b.data(), header( 6 ), b.size() ) );
+    EXPECT_TRUE( std::all_of( out.end() - 1024, out.end(), [] (unsigned char c) { return !c; } ) );
+
+    // stdout stands in for the pipe's write end while the lengths go through
+    int pipeFds[2];
+    ASSERT_EQ( 0, pipe( pipeFds ) );
+    std::string streamed;
+    std::thread reader( [&] () {
+        char buf[4096];
+        ssize_t n;
+        while ( (n = read( pipeFds[0], buf, sizeof( buf ) )) > 0 ) streamed.append( buf, n );
+    } );
+    int savedStdout = dup( STDOUT_FILENO );
+    dup2( pipeFds[1], STDOUT_FILENO );
+    close( pipeFds[1] );
+    {
+        ArchiveWriter lengths;
+        EXPECT_EQ( 0, lengths.open( "-", ARCHIVE_LENGTHS ) );
+        EXPECT_EQ( 0, lengths.add( srcA, "sub/a", method, stats ) );
+        EXPECT_EQ( COPY_SPLICE, method );
+        EXPECT_EQ( ENOENT, lengths.add( srcA + ".missing", "gone", method, stats ) );
+        EXPECT_FALSE( lengths.broken() );
+        EXPECT_EQ( 0, lengths.add( srcB, "b", method, stats ) );
+        EXPECT_EQ( 0, lengths.finish() );
+    }
+    dup2( savedStdout, STDOUT_FILENO );
+    close( savedStdout );
+    reader.join();
+    close( pipeFds[0] );
+
+    std::string expected = "copyDir-stream 1\n5 1000\nsub/a" + std::string( a.begin(), a.end() ) +
+                           "1 70000\nb" + std::string( b.begin(), b.end() ) + "0 0\n";
+    EXPECT_TRUE( streamed == expected );
+
+    unlink( srcA.c_str() );
+    unlink( srcB.c_str() );
+    unlink( tarPath.c_str() );
+}
+
+}  // namespace copyDir
@@ -0,0 +1,541 @@
+#include "copyEngine.h"
+#include "metadata.h"
+#include "metrics.h"
+#include "pageCache.h"
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <initializer_list>
+#include <thread>
+
+const char *copyMethodName(CopyMethod method)
+{
+    switch ( method ) {
+        case COPY_REFLINK:    return "reflink";
+        case COPY_FILE_RANGE: return "copy_file_range";
+        case COPY_SENDFILE:   return "sendfile";
+        case COPY_BUFFERED:   return "buffered";
+        case COPY_URING:      return "io_uring";
+        case COPY_CHUNKED:    return "chunked";
+        case COPY_DELTA:      return "delta";
+        case COPY_DIRECT:     return "direct";
+        case COPY_HARDLINK:   return "hardlink";
+        case COPY_CLONED:     return "cloned";
+        case COPY_STRIPED:    return "striped";
+        case COPY_SPLICE:     return "splice";
+        case COPY_METHODS:    break;
+    }
+    return "?";
+}
+
+// Errors meaning 'not this way', as opposed to a real I/O failure
+static bool refused(int err)
+{
+    return err == EXDEV || err == EINVAL || err == ENOSYS || err == ENOTTY ||
+           err == EOPNOTSUPP || err == ENOTSUP;
+}
+
+// Each loop copies from offset 'done' on until EOF, advancing it; 0 or errno. The ones
+// going through the page cache drop it behind them, if told to: then they go a window at
+// a time, even in kernel.
+
+static size_t dropWindow(size_t max)
+{
+    return pageCache() == PAGE_CACHE_KEEP ? max : DropBehind::window;
+}
+
+// What a kernel method saying 0 at 'done' means: the end of the file, or (some FUSE and
+// network filesystems, procfs and the like) that it stopped short, a refusal then, for the
+// next method to go on from there
+static int endOrRefused(int fdIn, off_t done)
+{
+    struct stat statbuf;
+    if ( fstat( fdIn, &statbuf ) ) return errno;
+    return done < statbuf.st_size ? EINVAL : 0;
+}
+
+static int copyRangeLoop(int fdIn, int fdOut, off_t& done, DropBehind& dropIn, DropBehind& dropOut)
+{
+    while ( 1 ) {
+        ssize_t n = copy_file_range( fdIn, &done, fdOut, NULL, dropWindow( SSIZE_MAX ), 0 );
+        if ( n == -1 ) { if ( errno == EINTR ) continue; return errno; }
+        if ( !n ) return endOrRefused( fdIn, done );
+        dropIn.advance( done );
+        dropOut.advance( done );
+    }
+}
+
+static int sendfileLoop(int fdIn, int fdOut, off_t& done, DropBehind& dropIn, DropBehind& dropOut)
+{
+    while ( 1 ) {
+        ssize_t n = sendfile( fdOut, fdIn, &done, dropWindow( 0x7ffff000 ) );  // kernel's max per call
+        if ( n == -1 ) { if ( errno == EINTR ) continue; return errno; }
+        if ( !n ) return endOrRefused( fdIn, done );
+        dropIn.advance( done );
+        dropOut.advance( done );
+    }
+}
+
+static int bufferedLoop(int fdIn, int fdOut, off_t& done, DigestCtx *digest, DropBehind& dropIn, DropBehind& dropOut)
+{
+    const size_t bufSize = 1 << 20;
+    char *buf = (char *) malloc( bufSize );
+
+    int err = 0;
+    while ( !err ) {
+        ssize_t n = pread( fdIn, buf, bufSize, done );
+        if ( n == -1 ) { if ( errno != EINTR ) err = errno; continue; }
+        if ( !n ) break;
+
+        if ( digest ) digest->update( buf, n );
+
+        for(ssize_t written = 0; written < n; ) {
+            ssize_t w = write( fdOut, buf + written, n - written );
+            if ( w == -1 ) { if ( errno != EINTR ) { err = errno; break; } continue; }
+            written += w;
+        }
+        if ( !err ) done += n;
+        dropIn.advance( done );
+        dropOut.advance( done );
+    }
+
+    free( buf );
+    return err;
+}
+
+// Sets or clears O_DIRECT on an open file; false if the filesystem will not have it
+static bool setDirect(int fd, bool direct)
+{
+    int flags = fcntl( fd, F_GETFL );
+    return flags != -1 && !fcntl( fd, F_SETFL, direct ? flags | O_DIRECT : flags & ~O_DIRECT );
+}
+
+// Both ends with O_DIRECT, through an aligned buffer: the data never touches the page
+// cache. The tail of the file, not a whole block, is written with O_DIRECT cleared, and
+// dropped right after.
+static int directLoop(int fdIn, int fdOut, off_t& done, DigestCtx *digest)
+{
+    const size_t bufSize = 1 << 20;
+    void *buf;
+    if ( posix_memalign( &buf, DIRECT_ALIGN, bufSize ) ) return ENOMEM;
+
+    int  err  = 0;
+    bool tail = false;
+    while ( !err && !tail ) {
+        ssize_t n = pread( fdIn, buf, bufSize, done );
+        if ( n == -1 ) { if ( errno != EINTR ) err = errno; continue; }
+        if ( !n ) break;
+
+        if ( digest ) digest->update( buf, n );
+
+        if ( n % DIRECT_ALIGN ) {
+            tail = true;
+            if ( !setDirect( fdOut, false ) ) { err = errno; break; }
+        }
+        for(ssize_t written = 0; written < n; ) {
+            ssize_t w = write( fdOut, (char *) buf + written, n - written );
+            if ( w == -1 ) { if ( errno != EINTR ) { err = errno; break; } continue; }
+            written += w;
+        }
+        if ( !err ) done += n;
+    }
+    if ( tail ) {
+        DropBehind dropTail( fdOut, true );
+        dropTail.finish();
+    }
+
+    free( buf );
+    return err;
+}
+
+std::string tempPathFor(const std::string& dstFilepath)
+{
+    size_t      slash = dstFilepath.rfind( '/' );
+    std::string dir   = dstFilepath.substr( 0, slash == std::string::npos ? 0 : slash + 1 );
+    std::string name  = dstFilepath.substr( slash == std::string::npos ? 0 : slash + 1 );
+
+    // The name as is when it fits, so that a leftover says what it was; its digest otherwise
+    if ( name.size() + sizeof(".copyDir-.tmp") > NAME_MAX ) {
+        unsigned char sum[16];
+        DigestCtx ctx( DIGEST_FAST64 );
+        ctx.update( name.data(), name.size() );
+        ctx.final( sum );
+        char hex[2 * 8 + 1];
+        for(int i=0; i<8; i++) sprintf( &hex[2 * i], "%02x", sum[i] );
+        name = hex;
+    }
+    return dir + ".copyDir-" + name + ".tmp";
+}
+
+const char *linkDupsName(LinkDups how)
+{
+    switch ( how ) {
+        case LINK_DUPS_NONE:    return "none";
+        case LINK_DUPS_HARD:    return "hardlink";
+        case LINK_DUPS_REFLINK: return "reflink";
+    }
+    return "?";
+}
+
+bool linkDupsFromName(const char *name, LinkDups& how)
+{
+    for(LinkDups l: {LINK_DUPS_NONE, LINK_DUPS_HARD, LINK_DUPS_REFLINK}) {
+        if ( !strcasecmp( name, linkDupsName( l ) ) ) { how = l; return true; }
+    }
+    return false;
+}
+
+int linkFile(const std::string& existingFilepath, const std::string& dstFilepath, LinkDups how, CopyStats& stats)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    std::string tmpFilepath = tempPathFor( dstFilepath );
+    unlink( tmpFilepath.c_str() );                  // link() will not replace it
+
+    int err = 0;
+    if ( how == LINK_DUPS_HARD ) err = link( existingFilepath.c_str(), tmpFilepath.c_str() ) ? errno : 0;
+    else {
+        int fdIn = open( existingFilepath.c_str(), O_RDONLY | O_CLOEXEC );
+        if ( fdIn == -1 ) return errno;
+        int fdOut = open( tmpFilepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 );
+        if ( fdOut == -1 ) { err = errno; close( fdIn ); return err; }
+
+        err = ioctl( fdOut, FICLONE, fdIn ) ? errno : 0;
+        close( fdIn );
+        if ( close( fdOut ) && !err ) err = errno;
+    }
+
+    // Renaming a link over another name of the same inode does nothing at all, and leaves
+    // the temporary behind; hence the unlink either way
+    if ( !err && rename( tmpFilepath.c_str(), dstFilepath.c_str() ) ) err = errno;
+    unlink( tmpFilepath.c_str() );
+    if ( err ) return err;
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    metricsRecord( STAGE_COPY, std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count(), 0 );
+
+    // No bytes: none were copied
+    stats.files++;
+    stats.filesBy[how == LINK_DUPS_HARD ? COPY_HARDLINK : COPY_CLONED]++;
+    stats.seconds += std::chrono::duration<double>( elapsed ).count();
+
+    return 0;
+}
+
+int copyFile(const std::string& srcFilepath, const std::string& dstFilepath, DigestCtx *digest,
+             CopyMethod& method, CopyStats& stats)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    int fdIn = open( srcFilepath.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fdIn == -1 ) return errno;
+
+    std::string tmpFilepath = tempPathFor( dstFilepath );
+    int fdOut = open( tmpFilepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 );
+    if ( fdOut == -1 ) { int err = errno; close( fdIn ); return err; }
+
+    off_t done = 0;
+    int   err;
+
+    // Direct on both ends, or on neither
+    bool direct = pageCache() == PAGE_CACHE_DIRECT && setDirect( fdIn, true );
+    if ( direct && !setDirect( fdOut, true ) ) direct = !setDirect( fdIn, false );
+
+    DropBehind dropIn( fdIn, false ), dropOut( fdOut, true );
+
+    if ( digest ) {
+        // Contents have to come through here to be hashed; one pass does both
+        method = direct ? COPY_DIRECT : COPY_BUFFERED;
+        err = direct ? directLoop( fdIn, fdOut, done, digest ) : bufferedLoop( fdIn, fdOut, done, digest, dropIn, dropOut );
+    }
+    else {
+        // Whole file or nothing; and on success there is nothing left to do
+        method = COPY_REFLINK;
+        err = ioctl( fdOut, FICLONE, fdIn ) ? errno : 0;
+        if ( !err ) {
+            struct stat statbuf;
+            done = fstat( fdOut, &statbuf ) ? 0 : statbuf.st_size;
+        }
+
+        // All the loops write at the file offset of fdOut, and read at 'done', which they
+        // keep in step with it; so a refused method hands over right where it stopped
+        // (O_DIRECT leaves the file offset in step as well)
+        if ( err && refused( err ) && direct ) { method = COPY_DIRECT; err = directLoop( fdIn, fdOut, done, NULL ); }
+        if ( err && refused( err ) && !direct ) { method = COPY_FILE_RANGE; err = copyRangeLoop( fdIn, fdOut, done, dropIn, dropOut ); }
+        if ( err && refused( err ) && !direct ) { method = COPY_SENDFILE;   err = sendfileLoop( fdIn, fdOut, done, dropIn, dropOut ); }
+        if ( err && refused( err ) ) {
+            if ( direct ) { setDirect( fdIn, false ); setDirect( fdOut, false ); }
+            method = COPY_BUFFERED;
+            err = bufferedLoop( fdIn, fdOut, done, NULL, dropIn, dropOut );
+        }
+    }
+    if ( !direct ) {
+        dropIn.finish();
+        dropOut.finish();
+    }
+    if ( !err && preserveMetadata() ) err = copyMetadata( fdIn, fdOut );
+
+    close( fdIn );
+    if ( close( fdOut ) && !err ) err = errno;      // delayed write errors, NFS...
+
+    if ( !err && rename( tmpFilepath.c_str(), dstFilepath.c_str() ) ) err = errno;
+    if ( err ) { unlink( tmpFilepath.c_str() ); return err; }
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    metricsRecord( STAGE_COPY, std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count(), done );
+
+    stats.files++;
+    stats.bytes += done;
+    stats.filesBy[method]++;
+    stats.seconds += std::chrono::duration<double>( elapsed ).count();
+
+    return 0;
+}
+
+// One stripe, [offset, offset + len): in kernel while it will, through 'buf' otherwise;
+// 'inKernel' goes false for all the stripes on the first refusal
+static int copyStripe(int fdIn, int fdOut, off_t offset, size_t len, std::atomic<bool>& inKernel,
+                      std::vector<char>& buf)
+{
+    off_t in = offset, out = offset, end = offset + len;
+    while ( in < end && inKernel ) {
+        ssize_t n = copy_file_range( fdIn, &in, fdOut, &out, end - in, 0 );
+        if ( n == -1 ) {
+            if ( errno == EINTR ) continue;
+            if ( !refused( errno ) ) return errno;
+            inKernel = false;
+        }
+        else if ( !n ) return ESTALE;
+    }
+
+    // Both offsets are still in step: copy_file_range moves them together
+    if ( in < end && buf.empty() ) buf.resize( 1 << 20 );
+    while ( in < end ) {
+        ssize_t n = pread( fdIn, buf.data(), std::min( (off_t) buf.size(), end - in ), in );
+        if ( n == -1 ) { if ( errno == EINTR ) continue; return errno; }
+        if ( !n ) return ESTALE;
+        for(ssize_t w = 0; w < n; ) {
+            ssize_t m = pwrite( fdOut, buf.data() + w, n - w, in + w );
+            if ( m == -1 ) { if ( errno == EINTR ) continue; return errno; }
+            w += m;
+        }
+        in += n;
+    }
+
+    // Stripes end in any order: each one is dropped as a whole, no window to slide
+    if ( pageCache() != PAGE_CACHE_KEEP ) {
+        sync_file_range( fdOut, offset, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER );
+        posix_fadvise( fdIn, offset, len, POSIX_FADV_DONTNEED );
+        posix_fadvise( fdOut, offset, len, POSIX_FADV_DONTNEED );
+    }
+    return 0;
+}
+
+int copyFileStriped(const std::string& srcFilepath, const std::string& dstFilepath, unsigned long stripeBytes,
+                    unsigned int numThreads, CopyMethod& method, CopyStats& stats)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    int fdIn = open( srcFilepath.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fdIn == -1 ) return errno;
+
+    std::string tmpFilepath = tempPathFor( dstFilepath );
+    int fdOut = open( tmpFilepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 );
+    if ( fdOut == -1 ) { int err = errno; close( fdIn ); return err; }
+
+    struct stat statbuf;
+    int   err  = fstat( fdIn, &statbuf ) ? errno : 0;
+    off_t size = err ? 0 : statbuf.st_size;
+
+    method = COPY_REFLINK;
+    if ( !err && ioctl( fdOut, FICLONE, fdIn ) ) {
+        err = errno;
+        if ( refused( err ) ) {
+            method = COPY_STRIPED;
+            err = size && fallocate( fdOut, 0, 0, size ) ? errno : 0;
+            if ( err && refused( err ) ) err = 0;       // just not preallocated then
+
+            unsigned long             stripes = (size + stripeBytes - 1) / stripeBytes;
+            std::atomic<unsigned long> nextStripe( 0 );
+            std::atomic<int>          firstErr( err );
+            std::atomic<bool>         inKernel( true );
+
+            auto worker = [&] () {
+                std::vector<char> buf;
+                for(unsigned long i; !firstErr && (i = nextStripe++) < stripes; ) {
+                    off_t offset = i * stripeBytes;
+                    int errStripe = copyStripe( fdIn, fdOut, offset, std::min( (off_t) stripeBytes, size - offset ), inKernel, buf );
+                    int none = 0;
+                    if ( errStripe ) firstErr.compare_exchange_strong( none, errStripe );
+                }
+            };
+            std::vector<std::thread> threads;
+            for(unsigned int t=1; t<std::min( (unsigned long) numThreads, stripes ); t++) threads.emplace_back( worker );
+            worker();
+            for(std::thread& t: threads) t.join();
+            err = firstErr;
+        }
+    }
+    if ( !err && preserveMetadata() ) err = copyMetadata( fdIn, fdOut );
+
+    close( fdIn );
+    if ( close( fdOut ) && !err ) err = errno;
+
+    if ( !err && rename( tmpFilepath.c_str(), dstFilepath.c_str() ) ) err = errno;
+    if ( err ) { unlink( tmpFilepath.c_str() ); return err; }
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    metricsRecord( STAGE_COPY, std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count(), size );
+
+    stats.files++;
+    stats.bytes += size;
+    stats.filesBy[method]++;
+    stats.seconds += std::chrono::duration<double>( elapsed ).count();
+
+    return 0;
+}
+
+int copyToStream(int fdIn, int fdOut, unsigned long size, off_t& done, CopyMethod& method)
+{
+    struct stat outStat;
+    if ( fstat( fdOut, &outStat ) ) return errno;
+    int outFlags = fcntl( fdOut, F_GETFL );
+
+    DropBehind dropIn( fdIn, false );
+    const off_t end = size;
+    done = 0;
+
+    // Every kernel method reads at 'done' and writes at the stream position, advancing
+    // both alike. Some say 0 on files they cannot handle (procfs, sysfs) rather than refuse:
+    // only a file that did shrink is at its end.
+    auto inKernel = [&] (const std::function<ssize_t(size_t)>& move) {
+        while ( done < end ) {
+            ssize_t n = move( std::min( (off_t) dropWindow( 0x7ffff000 ), end - done ) );
+            if ( n == -1 ) { if ( errno == EINTR ) continue; return errno; }
+            if ( !n ) {
+                struct stat inStat;
+                if ( fstat( fdIn, &inStat ) ) return errno;
+                return inStat.st_size < end ? ESTALE : EINVAL;
+            }
+            dropIn.advance( done );
+        }
+        return 0;
+    };
+
+    int err = ENOSYS;
+    if ( S_ISFIFO( outStat.st_mode ) ) {
+        method = COPY_SPLICE;
+        err = inKernel( [&] (size_t len) { return splice( fdIn, &done, fdOut, NULL, len, SPLICE_F_MORE ); } );
+    }
+    if ( err && refused( err ) && S_ISREG( outStat.st_mode ) && outFlags != -1 && !(outFlags & O_APPEND) ) {
+        method = COPY_FILE_RANGE;
+        err = inKernel( [&] (size_t len) { return copy_file_range( fdIn, &done, fdOut, NULL, len, 0 ); } );
+    }
+    if ( err && refused( err ) ) {
+        method = COPY_SENDFILE;
+        err = inKernel( [&] (size_t len) { return sendfile( fdOut, fdIn, &done, len ); } );
+    }
+    if ( err && refused( err ) ) {
+        method = COPY_BUFFERED;
+        std::vector<char> buf( 1 << 20 );
+        err = 0;
+        while ( !err && done < end ) {
+            ssize_t n = pread( fdIn, buf.data(), std::min( (off_t) buf.size(), end - done ), done );
+            if ( n == -1 ) { if ( errno != EINTR ) err = errno; continue; }
+            if ( !n ) { err = ESTALE; break; }
+            for(ssize_t w = 0; w < n; ) {
+                ssize_t m = write( fdOut, buf.data() + w, n - w );
+                if ( m == -1 ) { if ( errno != EINTR ) { err = errno; break; } continue; }
+                w += m;
+                done += m;
+            }
+            dropIn.advance( done );
+        }
+    }
+    dropIn.finish();
+    return err;
+}
+
+void copyFiles(std::vector<CopyJob>& jobs, IoEngine io, CopyStats& stats,
+               const std::function<void(CopyJob&)>& jobDone)
+{
+    size_t nextJob = 0;
+
+    if ( io == IO_URING ) {
+        auto start = std::chrono::steady_clock::now();
+        unsigned long files = 0, bytes = 0;
+        std::vector<std::chrono::steady_clock::time_point> started( jobs.size() );
+
+        auto next = [&] (StreamJob& sj) {
+            for(; nextJob < jobs.size(); nextJob++) {
+                CopyJob& job = jobs[nextJob];
+                sj.fdIn = open( job.srcFilepath.c_str(), O_RDONLY | O_CLOEXEC );
+                if ( sj.fdIn == -1 ) { job.err = errno; if ( jobDone ) jobDone( job ); continue; }
+
+                sj.fdOut = open( tempPathFor( job.dstFilepath ).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666 );
+                if ( sj.fdOut == -1 ) { job.err = errno; close( sj.fdIn ); if ( jobDone ) jobDone( job ); continue; }
+
+                if ( job.hash ) sj.digest = new DigestCtx( job.kind );
+                sj.user = &job;
+                started[nextJob] = std::chrono::steady_clock::now();
+                nextJob++;
+                return true;
+            }
+            return false;
+        };
+
+        auto done = [&] (StreamJob& sj) {
+            CopyJob& job = *(CopyJob *) sj.user;
+            DropBehind( sj.fdIn, false ).finish();
+            DropBehind( sj.fdOut, true ).finish();
+            if ( !sj.err && preserveMetadata() ) sj.err = copyMetadata( sj.fdIn, sj.fdOut );
+            close( sj.fdIn );
+            if ( close( sj.fdOut ) && !sj.err ) sj.err = errno;
+
+            std::string tmpFilepath = tempPathFor( job.dstFilepath );
+            if ( !sj.err && rename( tmpFilepath.c_str(), job.dstFilepath.c_str() ) ) sj.err = errno;
+            if ( sj.err ) unlink( tmpFilepath.c_str() );
+
+            job.err    = sj.err;
+            job.method = COPY_URING;
+            if ( !job.err ) {
+                metricsRecord( STAGE_COPY, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now() - started[&job - &jobs[0]] ).count(), sj.bytes );
+                files++;
+                bytes += sj.bytes;
+                if ( sj.digest ) { sj.digest->final( job.digest ); job.digestCached = true; }
+            }
+            delete sj.digest;
+            if ( jobDone ) jobDone( job );
+        };
+
+        if ( !streamFilesUring( 16, next, done ) ) {
+            stats.files += files;
+            stats.bytes += bytes;
+            stats.filesBy[COPY_URING] += files;
+            stats.seconds += std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+            return;
+        }
+    }
+
+    for(; nextJob < jobs.size(); nextJob++) {
+        CopyJob& job = jobs[nextJob];
+        DigestCtx digest( job.kind );
+        job.err = copyFile( job.srcFilepath, job.dstFilepath, job.hash ? &digest : NULL, job.method, stats );
+        if ( !job.err && job.hash ) { digest.final( job.digest ); job.digestCached = true; }
+        if ( jobDone ) jobDone( job );
+    }
+}
@@ -0,0 +1,160 @@
+#ifndef __COPYDIR_COPYENGINE_H__
+#define __COPYDIR_COPYENGINE_H__
+
+#include "fileHash.h"
+#include "ioRing.h"
+
+#include <string.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+// How a file got copied, from cheapest to most expensive
+enum CopyMethod {
+    COPY_REFLINK,               // FICLONE: blocks shared, nothing copied (btrfs, xfs...)
+    COPY_FILE_RANGE,            // copy_file_range: in kernel, or offloaded to the storage
+    COPY_SENDFILE,              // sendfile: in kernel, through the page cache
+    COPY_BUFFERED,              // read/write through a user space buffer
+    COPY_URING,                 // read/write through io_uring, many files in flight
+    COPY_CHUNKED,               // rebuilt from chunks of target files, see chunkDedup.h
+    COPY_DELTA,                 // changed regions of the old file rewritten, see deltaUpdate.h
+    COPY_DIRECT,                // read/write with O_DIRECT, bypassing the page cache
+    COPY_HARDLINK,              // hardlink to the same contents already in the target
+    COPY_CLONED,                // reflink of the same contents already in the target
+    COPY_STRIPED,               // big file, stripes of it copied concurrently
+    COPY_SPLICE,                // splice: into a pipe, from the page cache, see archive.h
+    COPY_METHODS
+};
+
+const char *copyMethodName(CopyMethod method);
+
+// Accumulated over all the copies of a run
+struct CopyStats {
+    unsigned long files;
+    unsigned long bytes;
+    double        seconds;      // wall time spent copying
+    unsigned long filesBy[COPY_METHODS];
+
+    CopyStats() : files(0), bytes(0), seconds(0), filesBy() {}
+
+    CopyStats& operator+=(const CopyStats& other) {
+        files   += other.files;
+        bytes   += other.bytes;
+        seconds += other.seconds;
+        for(int m=0; m<COPY_METHODS; m++) filesBy[m] += other.filesBy[m];
+        return *this;
+    }
+};
+
+// Where a copy to 'dstFilepath' is written before being renamed into place: a hidden
+// name in the same directory, the same one every run, so that leftovers can be found
+std::string tempPathFor(const std::string& dstFilepath);
+
+/*!
+  * @brief Copies a file, overwriting the destination, the cheapest way the kernel allows.
+  *
+  * Tries a reflink first, then copy_file_range, then sendfile, and only then a plain
+  * buffered loop; a method the kernel refuses (other filesystem, unsupported, old
+  * kernel) hands over to the next one at the offset reached so far. With the page cache
+  * policy at 'direct' (see pageCache.h), an O_DIRECT loop stands for all but the reflink;
+  * at 'drop', the file is dropped from the cache behind the copy on both ends.
+  * @param digest if not NULL, fed with the contents on the way; then the data has to go
+  *        through user space anyway, so the buffered loop is used right away
+  * @param method set to the method that finished the copy
+  * The copy goes to tempPathFor( dstFilepath ), renamed over the destination once
+  * complete: a failed or killed copy never leaves a half written file under its name.
+  * So do all the other writes to the target, but deltas (updateFileDelta): those are in
+  * place.
+  * With metadata preserved (see metadata.h), it gets that of the source before the rename.
+  * @return 0 on success, errno otherwise; the destination is then untouched
+  */
+int copyFile(const std::string& srcFilepath, const std::string& dstFilepath, DigestCtx *digest,
+             CopyMethod& method, CopyStats& stats);
+
+/*!
+  * @brief Copies a big file as fixed-size stripes, several at a time, so that one huge
+  *        file keeps as many threads and device queues busy as a dir of small ones.
+  *
+  * A reflink is tried first, as copyFile does. Failing that, the whole size is
+  * preallocated (fallocate), so that stripes landing in any order do not fragment the
+  * file, then 'numThreads' workers take the stripes in turn, each copied at its offset
+  * with copy_file_range, or pread/pwrite where the kernel refuses. With the page cache
+  * policy at anything but 'keep', each stripe is written back and dropped once done.
+  * Goes through tempPathFor( dstFilepath ) and a rename, like copyFile, metadata included.
+  * @param method COPY_REFLINK or COPY_STRIPED
+  * @return 0 on success, errno otherwise (ESTALE if the source shrank meanwhile); the
+  *         destination is then untouched
+  * @remark no digest comes out of it: nothing streams through in order
+  */
+int copyFileStriped(const std::string& srcFilepath, const std::string& dstFilepath, unsigned long stripeBytes,
+                    unsigned int numThreads, CopyMethod& method, CopyStats& stats);
+
+/*!
+  * @brief Copies the first 'size' bytes of an open file to an open stream, at the
+  *        position the stream is at: a pipe, a file, a socket, a terminal...
+  *
+  * In kernel wherever the stream allows: splice into a pipe, copy_file_range into a
+  * regular file (not one opened for appending), sendfile into anything else; a buffered
+  * loop where refused, taking over where the refused one stopped. With the page cache
+  * policy at anything but 'keep', the source is dropped behind the stream.
+  * @param done bytes gone to the stream so far, error or not
+  * @param method the method that finished the copy
+  * @return 0 on success, ESTALE if the file is shorter than 'size' by now, errno otherwise
+  * @remark a file grown since 'size' was taken is cut there
+  */
+int copyToStream(int fdIn, int fdOut, unsigned long size, off_t& done, CopyMethod& method);
+
+// What to do with a source file whose contents are in the target under another name
+enum LinkDups {
+    LINK_DUPS_NONE,             // nothing: its own path stays missing, as it always did
+    LINK_DUPS_HARD,             // a hardlink to the file found; they share the inode
+    LINK_DUPS_REFLINK,          // a reflink (FICLONE): shared blocks, a file of its own
+};
+
+const char *linkDupsName(LinkDups how);
+bool        linkDupsFromName(const char *name, LinkDups& how);
+
+/*!
+  * @brief Makes 'dstFilepath' a hardlink or reflink to a file already holding its
+  *        contents; no data is read nor written. Goes through tempPathFor( dstFilepath )
+  *        and a rename, as copyFile does, so an existing destination is replaced whole.
+  * @return 0 on success, errno otherwise (EXDEV, EMLINK, EOPNOTSUPP... when the
+  *         filesystem will not); the destination is then untouched
+  */
+int linkFile(const std::string& existingFilepath, const std::string& dstFilepath, LinkDups how, CopyStats& stats);
+
+// A file to be copied, and how it went
+struct CopyJob {
+    std::string srcFilepath;
+    std::string dstFilepath;
+
+    // The digest of the contents, as FileTable keeps it: either known beforehand, or
+    // computed on the same pass as the copy if 'hash' is set
+    bool          hash;
+    DigestKind    kind;
+    bool          digestCached;
+    unsigned char digest[16];
+
+    int         err;            // 0, or errno
+    CopyMethod  method;         // if it went well
+
+    CopyJob(const std::string& src, const std::string& dst) :
+        srcFilepath(src), dstFilepath(dst), hash(false), kind(DIGEST_MD5), digestCached(false),
+        err(0), method(COPY_BUFFERED)
+    {
+        memset(digest, 0, 16);
+    }
+};
+
+/*!
+  * @brief Copies a batch of files: one by one with copyFile on IO_SYNC, or all streamed
+  *        together through a ring on IO_URING, so the devices see many requests at once.
+  *        Jobs with 'hash' set get their digest filled in from the very same reads.
+  * @param done if set, called with each job as it ends, well or not; from this very thread
+  * @remark a ring that cannot be set up means falling back to copyFile
+  */
+void copyFiles(std::vector<CopyJob>& jobs, IoEngine io, CopyStats& stats,
+               const std::function<void(CopyJob&)>& done = nullptr);
+
+#endif
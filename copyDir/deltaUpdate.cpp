@@ -0,0 +1,255 @@
+#include "deltaUpdate.h"
+#include "metadata.h"
+#include "metrics.h"
+#include "pageCache.h"
+
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+unsigned int deltaBlockSize(unsigned long dstSize)
+{
+    unsigned int size = 2 * 1024;
+    while ( size < 128 * 1024 && (unsigned long) size * size < dstSize ) size *= 2;
+    return size;
+}
+
+// rsync's weak checksum of a window: a is the sum of its bytes, b the sum of the a's of
+// all its prefixes; both mod 2^16. Sliding the window by one byte is O(1).
+struct RollingSum {
+    unsigned int a, b, len;
+
+    void init(const unsigned char *data, unsigned int _len) {
+        len = _len;
+        a = b = 0;
+        for(unsigned int i=0; i<len; i++) {
+            a += data[i];
+            b += a;
+        }
+    }
+
+    void roll(unsigned char out, unsigned char in) {
+        a += in - out;
+        b += a - len * out;
+    }
+
+    unsigned int value() const { return (a & 0xffff) | (b << 16); }
+};
+
+struct BlockSig {
+    unsigned int  weak;
+    unsigned int  block;
+    unsigned char strong[16];
+};
+
+static void strongDigest(DigestKind kind, const unsigned char *data, size_t len, unsigned char *digest)
+{
+    DigestCtx ctx( kind );
+    ctx.update( data, len );
+    ctx.final( digest );
+}
+
+static int readAt(int fd, unsigned char *buf, size_t len, off_t offset, size_t& got)
+{
+    for(got = 0; got < len; ) {
+        ssize_t n = pread( fd, buf + got, len - got, offset + got );
+        if ( n == -1 ) { if ( errno == EINTR ) continue; return errno; }
+        if ( !n ) break;
+        got += n;
+    }
+    return 0;
+}
+
+static int writeAt(int fd, const unsigned char *data, size_t len, off_t offset)
+{
+    while ( len ) {
+        ssize_t w = pwrite( fd, data, len, offset );
+        if ( w == -1 ) { if ( errno == EINTR ) continue; return errno; }
+        data   += w;
+        len    -= w;
+        offset += w;
+    }
+    return 0;
+}
+
+// Signatures of the whole blocks of the file, sorted by weak checksum; a short last block
+// is left out, a window of a whole block never matches it anyway
+static int signBlocks(int fd, unsigned int blockSize, DigestKind kind, std::vector<BlockSig>& sigs)
+{
+    std::vector<unsigned char> buf( std::max( blockSize, 1u << 20 ) );
+    off_t offset = 0;
+    while ( 1 ) {
+        size_t got;
+        int err = readAt( fd, buf.data(), buf.size(), offset, got );
+        if ( err ) return err;
+
+        for(size_t pos = 0; pos + blockSize <= got; pos += blockSize) {
+            BlockSig sig;
+            RollingSum sum;
+            sum.init( buf.data() + pos, blockSize );
+            sig.weak  = sum.value();
+            sig.block = (offset + pos) / blockSize;
+            strongDigest( kind, buf.data() + pos, blockSize, sig.strong );
+            sigs.push_back( sig );
+        }
+        if ( got < buf.size() ) break;
+        offset += got;
+    }
+
+    std::sort( sigs.begin(), sigs.end(), [] (const BlockSig& x, const BlockSig& y) {
+        return x.weak != y.weak ? x.weak < y.weak : x.block < y.block; } );
+    return 0;
+}
+
+// Copies a range further on in the file back to a lower offset; going forwards, nothing
+// is overwritten before it is read
+static int moveWithin(int fd, off_t from, off_t to, size_t len)
+{
+    unsigned char buf[64 * 1024];
+    while ( len ) {
+        size_t got;
+        int err = readAt( fd, buf, std::min( len, sizeof(buf) ), from, got );
+        if ( err ) return err;
+        if ( !got ) return ESTALE;
+        err = writeAt( fd, buf, got, to );
+        if ( err ) return err;
+        from += got;
+        to   += got;
+        len  -= got;
+    }
+    return 0;
+}
+
+int updateFileDelta(const std::string& srcFilepath, const std::string& dstFilepath, DigestKind kind,
+                    DigestCtx *digest, DeltaStats& deltaStats, CopyStats& stats)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    int fdOut = open( dstFilepath.c_str(), O_RDWR | O_CLOEXEC );
+    if ( fdOut == -1 ) return errno;
+
+    int fdIn = open( srcFilepath.c_str(), O_RDONLY | O_CLOEXEC );
+    if ( fdIn == -1 ) { int err = errno; close( fdOut ); return err; }
+
+    struct stat statbuf;
+    int err = fstat( fdOut, &statbuf ) ? errno : 0;
+
+    const unsigned int blockSize = deltaBlockSize( err ? 0 : statbuf.st_size );
+    std::vector<BlockSig> sigs;
+    if ( !err ) err = signBlocks( fdOut, blockSize, kind, sigs );
+
+    // A bit per 16 bits of weak checksum spares the search for most windows
+    std::vector<bool> maybe( 1 << 16 );
+    for(const BlockSig& sig: sigs) maybe[(sig.weak ^ (sig.weak >> 16)) & 0xffff] = true;
+
+    // The source streams through 'buf', which starts at offset 'base'; the window is at
+    // 'pos' in it. Bytes from 'literal' up to the window matched nothing, and are written
+    // out when a match comes, or before they leave the buffer.
+    const size_t bufSize = std::max( 8u << 20, 4 * blockSize );
+    std::vector<unsigned char> buf( bufSize );
+    size_t     have = 0, pos = 0;
+    off_t      base = 0, literal = 0;
+    bool       eof = false, rolling = false;
+    RollingSum sum;
+    DeltaStats local;
+
+    auto flushLiteral = [&] () {
+        off_t end = base + pos;
+        int errWrite = writeAt( fdOut, buf.data() + (literal - base), end - literal, literal );
+        local.writtenBytes += end - literal;
+        literal = end;
+        return errWrite;
+    };
+
+    while ( !err ) {
+        if ( !eof && have - pos < blockSize ) {
+            if ( (err = flushLiteral()) ) break;
+            memmove( buf.data(), buf.data() + pos, have - pos );
+            base += pos;
+            have -= pos;
+            pos = 0;
+
+            size_t got;
+            if ( (err = readAt( fdIn, buf.data() + have, bufSize - have, base + have, got )) ) break;
+            if ( digest ) digest->update( buf.data() + have, got );
+            have += got;
+            eof = have < bufSize;
+        }
+        if ( have - pos < blockSize ) break;
+
+        if ( !rolling ) { sum.init( buf.data() + pos, blockSize ); rolling = true; }
+
+        // Blocks below the window may be overwritten already; the one right at it is best
+        const BlockSig *match = NULL;
+        unsigned int weak = sum.value();
+        if ( maybe[(weak ^ (weak >> 16)) & 0xffff] ) {
+            BlockSig key;
+            key.weak = weak;
+            key.block = (base + pos) / blockSize;
+            auto it = std::lower_bound( sigs.begin(), sigs.end(), key, [] (const BlockSig& x, const BlockSig& y) {
+                return x.weak != y.weak ? x.weak < y.weak : x.block < y.block; } );
+            bool          hashed = false;
+            unsigned char strong[16];
+            for(; it != sigs.end() && it->weak == weak && !match; it++) {
+                if ( (off_t) it->block * blockSize < base + (off_t) pos ) continue;
+                if ( !hashed ) { strongDigest( kind, buf.data() + pos, blockSize, strong ); hashed = true; }
+                if ( !memcmp( strong, it->strong, 16 ) ) match = &*it;
+            }
+        }
+
+        if ( match ) {
+            if ( (err = flushLiteral()) ) break;
+            off_t at = base + pos, from = (off_t) match->block * blockSize;
+            if ( from == at ) local.inPlaceBytes += blockSize;
+            else {
+                if ( (err = moveWithin( fdOut, from, at, blockSize )) ) break;
+                local.movedBytes += blockSize;
+            }
+            pos += blockSize;
+            literal = base + pos;
+            rolling = false;
+            continue;
+        }
+
+        if ( pos + blockSize < have ) sum.roll( buf[pos], buf[pos + blockSize] );
+        else rolling = false;
+        pos++;
+    }
+
+    // What is left is shorter than a block: written as is, then the file cut there
+    off_t size = base + have;
+    if ( !err ) { pos = have; err = flushLiteral(); }
+    if ( !err && ftruncate( fdOut, size ) ) err = errno;
+
+    // No temporary to rename into place: the file is done once it is on disk, and only
+    // then does the caller hear of it (and the journal record it)
+    if ( !err && fdatasync( fdOut ) ) err = errno;
+
+    // Dropped from the page cache as a whole here, if the policy says so
+    DropBehind( fdIn, false ).finish();
+    DropBehind( fdOut, true ).finish();
+    if ( !err && preserveMetadata() ) err = copyMetadata( fdIn, fdOut );
+    close( fdIn );
+    if ( close( fdOut ) && !err ) err = errno;
+    if ( err ) return err;
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    metricsRecord( STAGE_COPY, std::chrono::duration_cast<std::chrono::nanoseconds>( elapsed ).count(), size );
+
+    local.files = 1;
+    local.bytes = size;
+    deltaStats += local;
+
+    stats.files++;
+    stats.bytes += size;
+    stats.filesBy[COPY_DELTA]++;
+    stats.seconds += std::chrono::duration<double>( elapsed ).count();
+
+    return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef __COPYDIR_DELTAUPDATE_H__
+#define __COPYDIR_DELTAUPDATE_H__
+
+#include "copyEngine.h"
+#include "fileHash.h"
+
+#include <string>
+
+// Accumulated over all the delta updates of a run
+struct DeltaStats {
+    unsigned long files;
+    unsigned long bytes;            // size of the files updated
+    unsigned long inPlaceBytes;     // already there, at the very same offset: not even read
+    unsigned long movedBytes;       // there, further on in the file; copied within it
+    unsigned long writtenBytes;     // new, taken from the source
+
+    DeltaStats() : files(0), bytes(0), inPlaceBytes(0), movedBytes(0), writtenBytes(0) {}
+
+    DeltaStats& operator+=(const DeltaStats& other) {
+        files        += other.files;
+        bytes        += other.bytes;
+        inPlaceBytes += other.inPlaceBytes;
+        movedBytes   += other.movedBytes;
+        writtenBytes += other.writtenBytes;
+        return *this;
+    }
+};
+
+// Block size for a destination of the given size: about its square root, as rsync does,
+// a power of 2 between 2 KB and 128 KB
+unsigned int deltaBlockSize(unsigned long dstSize);
+
+/*!
+  * @brief Rsync-like in-place update of an existing destination file to the contents of
+  *        the source: only the regions that changed are written.
+  *
+  * The destination is cut in blocks, each with a weak checksum (rsync's rolling one) and
+  * a strong digest of 'kind'. The source is read once, a window of one block rolling over
+  * it byte by byte; a window matching a block of the destination at its very offset is
+  * left alone, one matching a block further on is copied from there, anything else is
+  * written from the source. Appending to a file thus writes just the new tail.
+  * @remark in place means blocks are only taken from offsets not overwritten yet, so
+  *         data inserted near the start makes most of the file to be written again; and
+  *         that a failure leaves the destination half updated, as rsync --inplace does.
+  * @remark the only write that does not go through tempPathFor() and a rename (see
+  *         copyFile): a kill leaves the destination half updated under its own name. It
+  *         is synced to disk before this returns success.
+  * @param digest if not NULL, fed with the whole contents of the source
+  * @return 0 on success, errno otherwise; ENOENT if the destination does not exist
+  */
+int updateFileDelta(const std::string& srcFilepath, const std::string& dstFilepath, DigestKind kind,
+                    DigestCtx *digest, DeltaStats& deltaStats, CopyStats& stats);
+
+#endif
@@ -0,0 +1,289 @@
+#include "digestCache.h"
+#include "metrics.h"
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+static const char          cacheMagic[8]   = { 'C', 'P', 'D', 'I', 'G', 'S', 'T', '1' };
+static const unsigned long initialCapacity = 1024;      // records; always a power of 2
+
+struct DigestCache::Header {
+    char               magic[8];
+    unsigned int       recordSize;  // layout check, along with the magic
+    unsigned int       unused;
+    unsigned long long capacity;
+    unsigned long long count;       // used records; a hint for growing, nothing else
+};
+
+struct DigestCache::Record {
+    unsigned long long dev;
+    unsigned long long ino;
+    unsigned long long size;
+    long long          mtimeNs;
+    long long          ctimeNs;
+    unsigned char      sample[16];
+    unsigned char      digest[16];
+    unsigned short     sampleKB;    // what 'sample' was taken with
+    unsigned char      digestKind;  // what 'digest' is
+    unsigned char      flags;       // 0 means empty slot
+    unsigned int       unused;
+    unsigned long long check;       // of all the above
+
+    enum { USED = 1, HAS_SAMPLE = 2, HAS_DIGEST = 4 };
+
+    unsigned long long checksum() const {
+        unsigned char sum[16];
+        DigestCtx ctx( DIGEST_FAST64 );
+        ctx.update( this, offsetof( Record, check ) );
+        ctx.final( sum );
+
+        unsigned long long c;
+        memcpy( &c, sum, sizeof(c) );
+        return c;
+    }
+
+    bool valid() const { return flags && check == checksum(); }
+
+    bool sameFile(const FileTable& entries, FileTable::Handle h) const {
+        return dev == entries.dev( h ) && ino == entries.ino( h ) && size == entries.size( h ) &&
+               mtimeNs == entries.mtimeNs( h ) && ctimeNs == entries.ctimeNs( h );
+    }
+};
+
+DigestCache::DigestCache() : hits(0), stores(0), fd(-1), header(NULL), records(NULL), mapSize(0) {}
+
+DigestCache::~DigestCache()
+{
+    close();
+}
+
+// (Re)maps the file with room for 'capacity' records; 'reset' empties it
+int DigestCache::map(unsigned long capacity, bool reset)
+{
+    if ( header ) munmap( header, mapSize );
+    header  = NULL;
+    records = NULL;
+
+    mapSize = sizeof(Header) + capacity * sizeof(Record);
+    if ( reset && ftruncate( fd, 0 ) ) return errno;        // zeroes it all on the way
+    if ( ftruncate( fd, mapSize ) ) return errno;
+
+    void *addr = mmap( NULL, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    if ( addr == MAP_FAILED ) return errno;
+
+    header  = (Header *) addr;
+    records = (Record *) (header + 1);
+
+    if ( reset ) {
+        memcpy( header->magic, cacheMagic, sizeof(cacheMagic) );
+        header->recordSize = sizeof(Record);
+        header->capacity   = capacity;
+        header->count      = 0;
+    }
+
+    return 0;
+}
+
+int DigestCache::open(const std::string& path)
+{
+    close();
+
+    fd = ::open( path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644 );
+    if ( fd == -1 ) return errno;
+
+    // Two runs on the same target would step on each other's records
+    if ( flock( fd, LOCK_EX | LOCK_NB ) ) { int err = errno; close(); return err; }
+
+    struct stat statbuf;
+    Header      existing;
+    bool        reuse = !fstat( fd, &statbuf ) &&
+                        pread( fd, &existing, sizeof(existing), 0 ) == (ssize_t) sizeof(existing) &&
+                        !memcmp( existing.magic, cacheMagic, sizeof(cacheMagic) ) &&
+                        existing.recordSize == sizeof(Record) &&
+                        existing.capacity >= initialCapacity &&
+                        !(existing.capacity & (existing.capacity - 1)) &&
+                        (unsigned long long) statbuf.st_size == sizeof(Header) + existing.capacity * sizeof(Record);
+
+    int err = reuse ? map( existing.capacity, false ) : map( initialCapacity, true );
+    if ( err ) close();
+
+    return err;
+}
+
+void DigestCache::close()
+{
+    if ( header ) munmap( header, mapSize );
+    if ( fd != -1 ) ::close( fd );          // releases the lock too
+
+    fd      = -1;
+    header  = NULL;
+    records = NULL;
+    mapSize = 0;
+}
+
+// The record for (dev, ino) if there is one, or the empty slot it goes to
+DigestCache::Record *DigestCache::slotFor(unsigned long long dev, unsigned long long ino)
+{
+    unsigned long long mask = header->capacity - 1;
+
+    // splitmix64 finalizer; inode numbers are anything but random
+    unsigned long long h = ino * 0x9e3779b97f4a7c15ull ^ dev;
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+    h ^= h >> 31;
+
+    for(unsigned long long i = h & mask; ; i = (i + 1) & mask) {
+        Record *r = &records[i];
+        if ( !r->flags ) return r;
+        if ( r->dev == dev && r->ino == ino && r->valid() ) return r;
+    }
+}
+
+// Doubles the table, rehashing the valid records into it
+int DigestCache::grow()
+{
+    std::vector<Record> kept;
+    for(unsigned long long i=0; i<header->capacity; i++)
+        if ( records[i].valid() ) kept.push_back( records[i] );
+
+    int err = map( header->capacity * 2, true );
+    if ( err ) return err;
+
+    for(const Record& r: kept) *slotFor( r.dev, r.ino ) = r;
+    header->count = kept.size();
+
+    return 0;
+}
+
+void DigestCache::load(FileTable& entries, DigestKind kind, unsigned int sampleKB)
+{
+    if ( !header ) return;
+
+    StageTimer timer( STAGE_CACHE );
+    timer.setItems( entries.count() );
+
+    for(FileTable::Handle h=0; h<entries.count(); h++) {
+        if ( entries.isDir( h ) || !entries.ino( h ) ) continue;
+
+        const Record *r = slotFor( entries.dev( h ), entries.ino( h ) );
+        if ( !r->flags || !r->sameFile( entries, h ) ) continue;
+
+        bool hit = false;
+        if ( !entries.sampleCached( h ) && (r->flags & Record::HAS_SAMPLE) && r->sampleKB == sampleKB ) {
+            entries.setSample( h, r->sample );
+            hit = true;
+        }
+        if ( !entries.digestCached( h ) && (r->flags & Record::HAS_DIGEST) && r->digestKind == kind ) {
+            entries.setDigest( h, r->digest );
+            hit = true;
+        }
+        if ( hit ) hits++;
+    }
+}
+
+void DigestCache::save(const FileTable& entries, DigestKind kind, unsigned int sampleKB)
+{
+    if ( !header ) return;
+
+    StageTimer timer( STAGE_CACHE );
+    timer.setItems( entries.count() );
+
+    for(FileTable::Handle h=0; h<entries.count(); h++) {
+        if ( entries.isDir( h ) || !entries.ino( h ) ) continue;
+        if ( !entries.sampleCached( h ) && !entries.digestCached( h ) ) continue;
+
+        if ( (header->count + 1) * 2 > header->capacity && grow() ) return;     // keep it sparse
+
+        Record *r = slotFor( entries.dev( h ), entries.ino( h ) );
+
+        // A stale record for the same inode is replaced as a whole
+        Record updated;
+        if ( r->flags && r->sameFile( entries, h ) ) updated = *r;
+        else {
+            memset( &updated, 0, sizeof(updated) );
+            updated.dev     = entries.dev( h );
+            updated.ino     = entries.ino( h );
+            updated.size    = entries.size( h );
+            updated.mtimeNs = entries.mtimeNs( h );
+            updated.ctimeNs = entries.ctimeNs( h );
+            updated.flags   = Record::USED;
+        }
+
+        if ( entries.sampleCached( h ) ) {
+            memcpy( updated.sample, entries.sample( h ), 16 );
+            updated.sampleKB = sampleKB;
+            updated.flags   |= Record::HAS_SAMPLE;
+        }
+        if ( entries.digestCached( h ) ) {
+            memcpy( updated.digest, entries.digest( h ), 16 );
+            updated.digestKind = kind;
+            updated.flags     |= Record::HAS_DIGEST;
+        }
+        updated.check = updated.checksum();
+
+        if ( !memcmp( &updated, r, sizeof(updated) ) ) continue;
+
+        if ( !r->flags ) header->count++;
+        *r = updated;
+        stores++;
+    }
+}
+
+// mkdir -p; 0 or errno
+static int makeDirs(const std::string& dir)
+{
+    for(size_t slash = dir.find( '/', 1 ); ; slash = dir.find( '/', slash + 1 )) {
+        std::string prefix = dir.substr( 0, slash );
+        if ( !prefix.empty() && prefix.back() != '/' && mkdir( prefix.c_str(), 0700 ) && errno != EEXIST ) return errno;
+        if ( slash == std::string::npos ) return 0;
+    }
+}
+
+std::string DigestCache::pathFor(const std::string& root, const std::string& cacheDir)
+{
+    std::string dir = cacheDir;
+    if ( dir.empty() ) {
+        const char *xdg  = getenv( "XDG_CACHE_HOME" );
+        const char *home = getenv( "HOME" );
+        if      ( xdg && *xdg )   dir = xdg;
+        else if ( home && *home ) dir = std::string( home ) + "/.cache";
+        else return "";
+        dir += "/copyDir";
+    }
+    if ( makeDirs( dir ) ) return "";
+
+    // Named after the real path, so 'dst', './dst' and '/abs/dst' share it. A root yet
+    // to be created is resolved through its parent, to the name it will have.
+    char        resolved[PATH_MAX];
+    std::string rootPath = root;
+    while ( rootPath.size() > 1 && rootPath.back() == '/' ) rootPath.pop_back();
+    if ( realpath( rootPath.c_str(), resolved ) ) rootPath = resolved;
+    else {
+        size_t      slash  = rootPath.rfind( '/' );
+        std::string parent = slash == std::string::npos ? "." : rootPath.substr( 0, slash ? slash : 1 );
+        if ( realpath( parent.c_str(), resolved ) )
+            rootPath = std::string( resolved ) + "/" + rootPath.substr( slash == std::string::npos ? 0 : slash + 1 );
+    }
+
+    unsigned char sum[16];
+    DigestCtx ctx( DIGEST_FAST64 );
+    ctx.update( rootPath.data(), rootPath.size() );
+    ctx.final( sum );
+
+    char name[2 * 8 + sizeof(".digests")];
+    for(int i=0; i<8; i++) sprintf( &name[2 * i], "%02x", sum[i] );
+    strcpy( &name[16], ".digests" );
+
+    return dir + "/" + name;
+}
@@ -0,0 +1,67 @@
+#ifndef __COPYDIR_DIGESTCACHE_H__
+#define __COPYDIR_DIGESTCACHE_H__
+
+#include "fileTable.h"
+#include "fileHash.h"
+
+#include <string>
+
+/*!
+  * @brief On-disk digests of the files under a target root, kept between runs.
+  *
+  * A memory-mapped open-addressing table keyed by (device, inode), each record also
+  * holding the size, mtime and ctime the digests were computed for; any change in those
+  * makes the record stale, and it is just overwritten. So an unchanged target is not read
+  * at all on later runs, and files moved around within it keep their digests.
+  *
+  * Each record carries a checksum of itself; a torn or garbled one reads as a miss,
+  * never as a wrong digest. A file that does not look like a cache is started afresh.
+  * @remark records of deleted files are never purged; they just take room.
+  */
+class DigestCache {
+public:
+    unsigned long hits;         // entries filled in by load()
+    unsigned long stores;       // records written by save()
+
+    DigestCache();
+    ~DigestCache();
+
+    /*!
+      * @brief Maps the cache file, creating it if missing, and locks it for this process.
+      * @return 0 on success, errno otherwise (EWOULDBLOCK if another run holds it)
+      */
+    int open(const std::string& path);
+    void close();
+
+    /*!
+      * @brief Fills in the sample/digest of the entries the cache knows about, for the
+      *        run settings given; entries already cached are left untouched.
+      */
+    void load(FileTable& entries, DigestKind kind, unsigned int sampleKB);
+
+    // Writes down the samples/digests cached in the entries, for the run settings given
+    void save(const FileTable& entries, DigestKind kind, unsigned int sampleKB);
+
+    /*!
+      * @brief Where the cache for a target root lives: a file named after the root's real
+      *        path, under 'cacheDir', or $XDG_CACHE_HOME/copyDir, or ~/.cache/copyDir.
+      *        Missing directories are created.
+      * @return the path, or an empty string if there is no place for it
+      */
+    static std::string pathFor(const std::string& root, const std::string& cacheDir);
+
+private:
+    struct Header;
+    struct Record;
+
+    int           fd;
+    Header       *header;
+    Record       *records;
+    unsigned long mapSize;
+
+    int    map(unsigned long capacity, bool reset);
+    Record *slotFor(unsigned long long dev, unsigned long long ino);
+    int    grow();
+};
+
+#endif
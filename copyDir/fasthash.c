@@ -0,0 +1,269 @@
+/*
+ * Fast 128-bit non-cryptographic hash; see fasthash.h.
+ *
+ * Layout of the computation:
+ *   - input goes in 64-byte stripes, 8 little-endian 64-bit words each;
+ *   - word i of a stripe is mixed into accumulator i as (lo32 * hi32) of (word ^ key),
+ *     and added as is to its neighbour accumulator i^1, so that zero products still
+ *     leave a trace; keys shift by one word on each stripe of a block so identical
+ *     stripes at different positions do not cancel out;
+ *   - every 16 stripes (1 KB) accumulators are scrambled (xorshift, xor key, multiply);
+ *   - the last partial stripe is zero padded; the total length goes into the final
+ *     merge, which folds 128-bit products of accumulator pairs into two 64-bit halves.
+ *
+ * The AVX2 loop is the same thing on two registers of 4 accumulators each. The AVX2
+ * code is enabled per function, so the object runs on any x86-64.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+
+#include <immintrin.h>
+
+#include "fasthash.h"
+
+typedef unsigned long long u64;
+
+#define STRIPE_LEN			64
+#define STRIPES_PER_BLOCK	16
+
+#define PRIME32_1			0x9E3779B1u
+#define PRIME64_1			0x9E3779B185EBCA87ull
+#define PRIME64_2			0xC2B2AE3D27D4EB4Full
+#define AVALANCHE_MUL		0x165667919E3779F9ull
+
+/* Stripe keys; stripe n of a block uses kStripe[n .. n+7] */
+static const u64 kStripe[STRIPES_PER_BLOCK + 8] = {
+	0x2cb0f69f4abea221ull, 0x9417034723148989ull, 0xdd555950609dfe03ull, 0xdbafb150deb12800ull,
+	0x7e789b2e6c442cb6ull, 0xf41e5636c7e4f8c4ull, 0x0959d150f8fba7e4ull, 0xa97316f13cdb9eeaull,
+	0x74cd8258f9520068ull, 0x55c74a62e116868bull, 0xd2f4c799a2023cbdull, 0xdf98cb79a37b51b9ull,
+	0x396f5885524f3905ull, 0xaf1d56386ca3b276ull, 0xa9ffbe6b5104e85aull, 0x6bd0c51b9fd533b3ull,
+	0x980ce91c50ab4b56ull, 0x28ac395780fe62c5ull, 0x768912e3a6bcedc7ull, 0x50b3e8c9332c7c88ull,
+	0xce3bbfe520bd47daull, 0xcba6c8e8e0bb7c4full, 0xbf194db8434a346dull, 0x7d8f2a7b60416d7full,
+};
+
+static const u64 kScramble[8] = {
+	0x0849d1f6e0e10a5eull, 0x7654b590d064e22full, 0x16d1da9507df3af2ull, 0xf63aef1089ea30e4ull,
+	0x9ade6673cc6c522bull, 0x4c75bc274e37087cull, 0xd35e12b49f51f27bull, 0x22ddf2ffcee481eaull,
+};
+
+/* Final merge keys: first 8 for the low half, last 8 for the high one */
+static const u64 kMerge[16] = {
+	0x06007fb13c59a1f1ull, 0x8966a38c651ea4daull, 0x25242f018fc01ac6ull, 0xa73ec74fa31b717cull,
+	0x7ee0abdd9797d3a2ull, 0x5c06ff7dc4ac1880ull, 0x8434e41042c28a7dull, 0x770a372d64327351ull,
+	0xeed940dad9e9c06dull, 0x8977e93646524825ull, 0xa9897f0a62a51616ull, 0xa35d4250c53f2b3aull,
+	0x4072542a94b9c33eull, 0x3154a7a62447e8abull, 0x686865712a1a245eull, 0x0fba67727d7b3b98ull,
+};
+
+/* x86 only for now, like the AVX2 path; memcpy keeps it free of alignment and aliasing trouble */
+static inline u64 read64(const unsigned char *p)
+{
+	u64 v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * Consumes 'n' whole stripes, scrambling at block boundaries.
+ */
+static void consume_scalar(FH128_CTX *ctx, const unsigned char *p, unsigned long n)
+{
+	u64 acc[8];
+	unsigned int stripe = ctx->stripe;
+	int i;
+
+	memcpy(acc, ctx->acc, sizeof(acc));
+
+	while (n--) {
+		for (i = 0; i < 8; i++) {
+			u64 data = read64(p + 8 * i);
+			u64 key = data ^ kStripe[stripe + i];
+			acc[i ^ 1] += data;
+			acc[i] += (key & 0xffffffff) * (key >> 32);
+		}
+		p += STRIPE_LEN;
+
+		if (++stripe == STRIPES_PER_BLOCK) {
+			for (i = 0; i < 8; i++) {
+				acc[i] ^= acc[i] >> 47;
+				acc[i] ^= kScramble[i];
+				acc[i] *= PRIME32_1;
+			}
+			stripe = 0;
+		}
+	}
+
+	memcpy(ctx->acc, acc, sizeof(acc));
+	ctx->stripe = stripe;
+}
+
+#define AVX2_FUNC __attribute__((target("avx2")))
+
+static inline AVX2_FUNC __m256i accumulate256(__m256i acc, __m256i data, __m256i key)
+{
+	__m256i dk = _mm256_xor_si256(data, key);
+	__m256i product = _mm256_mul_epu32(dk, _mm256_srli_epi64(dk, 32));
+	__m256i swapped = _mm256_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));	/* word i^1 */
+
+	return _mm256_add_epi64(acc, _mm256_add_epi64(product, swapped));
+}
+
+static inline AVX2_FUNC __m256i scramble256(__m256i acc, __m256i key)
+{
+	const __m256i prime = _mm256_set1_epi32((int)PRIME32_1);
+	__m256i lo, hi;
+
+	acc = _mm256_xor_si256(acc, _mm256_srli_epi64(acc, 47));
+	acc = _mm256_xor_si256(acc, key);
+
+	/* 64x32 multiply out of two 32x32->64 ones */
+	lo = _mm256_mul_epu32(acc, prime);
+	hi = _mm256_mul_epu32(_mm256_srli_epi64(acc, 32), prime);
+	return _mm256_add_epi64(lo, _mm256_slli_epi64(hi, 32));
+}
+
+static AVX2_FUNC void consume_avx2(FH128_CTX *ctx, const unsigned char *p, unsigned long n)
+{
+	__m256i acc0 = _mm256_loadu_si256((const __m256i *)&ctx->acc[0]);
+	__m256i acc1 = _mm256_loadu_si256((const __m256i *)&ctx->acc[4]);
+	const __m256i scr0 = _mm256_loadu_si256((const __m256i *)&kScramble[0]);
+	const __m256i scr1 = _mm256_loadu_si256((const __m256i *)&kScramble[4]);
+	unsigned int stripe = ctx->stripe;
+
+	while (n--) {
+		__m256i d0 = _mm256_loadu_si256((const __m256i *)p);
+		__m256i d1 = _mm256_loadu_si256((const __m256i *)(p + 32));
+		acc0 = accumulate256(acc0, d0, _mm256_loadu_si256((const __m256i *)&kStripe[stripe]));
+		acc1 = accumulate256(acc1, d1, _mm256_loadu_si256((const __m256i *)&kStripe[stripe + 4]));
+		p += STRIPE_LEN;
+
+		if (++stripe == STRIPES_PER_BLOCK) {
+			acc0 = scramble256(acc0, scr0);
+			acc1 = scramble256(acc1, scr1);
+			stripe = 0;
+		}
+	}
+
+	_mm256_storeu_si256((__m256i *)&ctx->acc[0], acc0);
+	_mm256_storeu_si256((__m256i *)&ctx->acc[4], acc1);
+	ctx->stripe = stripe;
+}
+
+/*
+ * Hash pool threads all get here: the default is decided once, before any of them
+ * looks at it, and a later FH128_UseAVX2() is an atomic store, not a torn one.
+ */
+static atomic_int use_avx2;
+static pthread_once_t use_avx2_once = PTHREAD_ONCE_INIT;
+
+static void use_avx2_default(void)
+{
+	atomic_store(&use_avx2, __builtin_cpu_supports("avx2"));
+}
+
+int FH128_UseAVX2(int enable)
+{
+	pthread_once(&use_avx2_once, use_avx2_default);
+	atomic_store(&use_avx2, enable && __builtin_cpu_supports("avx2"));
+	return atomic_load(&use_avx2);
+}
+
+static inline void consume(FH128_CTX *ctx, const unsigned char *p, unsigned long n)
+{
+	pthread_once(&use_avx2_once, use_avx2_default);
+
+	if (atomic_load_explicit(&use_avx2, memory_order_relaxed))
+		consume_avx2(ctx, p, n);
+	else
+		consume_scalar(ctx, p, n);
+}
+
+void FH128_Init(FH128_CTX *ctx)
+{
+	int i;
+
+	/* Non-zero, distinct starting points */
+	for (i = 0; i < 8; i++)
+		ctx->acc[i] = kMerge[i] ^ PRIME64_1;
+
+	ctx->total = 0;
+	ctx->stripe = 0;
+	ctx->used = 0;
+}
+
+void FH128_Update(FH128_CTX *ctx, const void *data, unsigned long size)
+{
+	const unsigned char *ptr = (const unsigned char *)data;
+	unsigned long available;
+
+	ctx->total += size;
+
+	if (ctx->used) {
+		available = STRIPE_LEN - ctx->used;
+
+		if (size < available) {
+			memcpy(&ctx->buffer[ctx->used], ptr, size);
+			ctx->used += size;
+			return;
+		}
+
+		memcpy(&ctx->buffer[ctx->used], ptr, available);
+		ptr += available;
+		size -= available;
+		consume(ctx, ctx->buffer, 1);
+		ctx->used = 0;
+	}
+
+	if (size >= STRIPE_LEN) {
+		consume(ctx, ptr, size / STRIPE_LEN);
+		ptr += size & ~(unsigned long)(STRIPE_LEN - 1);
+		size &= STRIPE_LEN - 1;
+	}
+
+	memcpy(ctx->buffer, ptr, size);
+	ctx->used = size;
+}
+
+static inline u64 mix128(u64 a, u64 b)
+{
+	unsigned __int128 product = (unsigned __int128)a * b;
+	return (u64)product ^ (u64)(product >> 64);
+}
+
+static inline u64 avalanche(u64 h)
+{
+	h ^= h >> 37;
+	h *= AVALANCHE_MUL;
+	h ^= h >> 32;
+	return h;
+}
+
+#define OUT64(dst, src) \
+	{ int _b; for (_b = 0; _b < 8; _b++) (dst)[_b] = (unsigned char)((src) >> (8 * _b)); }
+
+void FH128_Final(unsigned char result[16], FH128_CTX *ctx)
+{
+	u64 lo, hi;
+	int i;
+
+	if (ctx->used) {
+		memset(&ctx->buffer[ctx->used], 0, STRIPE_LEN - ctx->used);
+		consume(ctx, ctx->buffer, 1);
+	}
+
+	lo = ctx->total * PRIME64_1;
+	hi = ~ctx->total * PRIME64_2;
+	for (i = 0; i < 8; i += 2) {
+		lo += mix128(ctx->acc[i] ^ kMerge[i], ctx->acc[i + 1] ^ kMerge[i + 1]);
+		hi += mix128(ctx->acc[i] ^ kMerge[8 + i], ctx->acc[i + 1] ^ kMerge[8 + i + 1]);
+	}
+
+	lo = avalanche(lo);
+	hi = avalanche(hi ^ lo);
+
+	OUT64(&result[0], lo)
+	OUT64(&result[8], hi)
+
+	memset(ctx, 0, sizeof(*ctx));
+}
@@ -0,0 +1,42 @@
+/*
+ * Fast 128-bit non-cryptographic hash, in the xxHash3 family: 8 64-bit accumulators
+ * fed by 64-byte stripes with a 32x32->64 multiply per lane, scrambled every 1 KB.
+ *
+ * Meant for duplicate detection on trusted data, where MD5 is way slower than the
+ * disks. It is NOT collision resistant against crafted input. Not XXH3 itself: its own
+ * constants, checked by SMHasher-style avalanche and collision tests (copyDirTests.cpp).
+ *
+ * Same OpenSSL-like API shape as md5.h. On AVX2 CPUs the bulk loop runs vectorized;
+ * both paths give bit-identical results.
+ */
+
+#ifndef _FASTHASH_H
+#define _FASTHASH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	unsigned long long acc[8];
+	unsigned long long total;		/* bytes fed so far */
+	unsigned int stripe;			/* stripes consumed in the current 1 KB block */
+	unsigned int used;				/* bytes waiting in buffer */
+	unsigned char buffer[64];		/* partial stripe */
+} FH128_CTX;
+
+extern void FH128_Init(FH128_CTX *ctx);
+extern void FH128_Update(FH128_CTX *ctx, const void *data, unsigned long size);
+extern void FH128_Final(unsigned char result[16], FH128_CTX *ctx);
+
+/*
+ * Selects the bulk loop: non-zero for AVX2 (if the CPU has it), zero for scalar.
+ * Returns whether AVX2 is in use afterwards. Default is AVX2 when available.
+ */
+extern int FH128_UseAVX2(int enable);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
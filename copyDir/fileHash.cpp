@@ -0,0 +1,302 @@
+extern "C" {
+#include "md5_mb.h"
+}
+
+#include "fileHash.h"
+#include "metrics.h"
+#include "pageCache.h"
+
+#include <sys/fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+const char *digestName(DigestKind kind)
+{
+    switch ( kind ) {
+        case DIGEST_MD5:     return "MD5";
+        case DIGEST_FAST128: return "fast128";
+        case DIGEST_FAST64:  return "fast64";
+    }
+    return "?";
+}
+
+unsigned int digestLength(DigestKind kind)
+{
+    return kind == DIGEST_FAST64 ? 8 : 16;
+}
+
+bool digestKindFromName(const char *name, DigestKind& kind)
+{
+    for(DigestKind k: {DIGEST_MD5, DIGEST_FAST128, DIGEST_FAST64}) {
+        if ( !strcasecmp( name, digestName( k ) ) ) { kind = k; return true; }
+    }
+    return false;
+}
+
+DigestCtx::DigestCtx(DigestKind _kind) : kind(_kind)
+{
+    if ( kind == DIGEST_MD5 ) MD5_Init( &ctx.md5 );
+    else                      FH128_Init( &ctx.fh128 );
+}
+
+void DigestCtx::update(const void *data, unsigned long size)
+{
+    if ( kind == DIGEST_MD5 ) MD5_Update( &ctx.md5, data, size );
+    else                      FH128_Update( &ctx.fh128, data, size );
+}
+
+void DigestCtx::final(unsigned char *digest)
+{
+    if ( kind == DIGEST_MD5 ) MD5_Final( digest, &ctx.md5 );
+    else                      FH128_Final( digest, &ctx.fh128 );
+
+    unsigned int len = digestLength( kind );
+    memset( digest + len, 0, 16 - len );
+}
+
+static bool logDigests = false;
+
+void setDigestLogging(bool enabled)
+{
+    logDigests = enabled;
+}
+
+void printDigest(DigestKind kind, const unsigned char *digest, const std::string& filepath)
+{
+    if ( !logDigests ) return;
+
+    char hex[2 * 16 + 1];
+    for(unsigned int i=0; i<digestLength( kind ); i++) sprintf( &hex[2 * i], "%02x", digest[i] );
+
+    printf("%s sum: %s - %s\n", digestName( kind ), hex, filepath.c_str());
+}
+
+// Reads the whole file through a buffer of each thread's own; 0 or errno
+static int digestBuffered(int fd, DigestCtx& ctx, StageTimer& timer)
+{
+    const size_t bufSize = 256 * 1024;      // a few hundred syscalls per 64 MB, not 32k
+    static thread_local std::vector<unsigned char> buf( bufSize );
+
+    DropBehind drop( fd, false );
+    off_t      done = 0;
+    while ( 1 ) {
+        ssize_t nbytes = read( fd, buf.data(), bufSize );
+        if ( nbytes == -1 ) { if ( errno == EINTR ) continue; return errno; }
+        if ( !nbytes ) break;       // EOF
+
+        ctx.update( buf.data(), nbytes );
+        timer.addBytes( nbytes );
+        drop.advance( done += nbytes );
+    }
+    drop.finish();
+    return 0;
+}
+
+// Reads the whole file, opened with O_DIRECT, into an aligned buffer; the device DMAs
+// straight into it and the page cache never sees the data. 0 or errno
+static int digestDirect(int fd, DigestCtx& ctx, StageTimer& timer)
+{
+    const size_t bufSize = 1 << 20;
+    static thread_local std::unique_ptr<unsigned char, decltype(&free)> buf( NULL, free );
+    if ( !buf ) {
+        void *p;
+        if ( posix_memalign( &p, DIRECT_ALIGN, bufSize ) ) return ENOMEM;
+        buf.reset( (unsigned char *) p );
+    }
+
+    while ( 1 ) {
+        ssize_t nbytes = read( fd, buf.get(), bufSize );
+        if ( nbytes == -1 ) { if ( errno == EINTR ) continue; return errno; }
+
+        ctx.update( buf.get(), nbytes );
+        timer.addBytes( nbytes );
+
+        // Anything but whole blocks is the tail of the file; reading on from there would
+        // be at an unaligned offset
+        if ( !nbytes || nbytes % DIRECT_ALIGN ) return 0;
+    }
+}
+
+// Maps the file a window at a time, asking for the next one to be read ahead while the
+// current one is hashed; no copies to user space at all. 0 or errno
+static int digestMapped(int fd, unsigned long size, DigestCtx& ctx, StageTimer& timer)
+{
+    const unsigned long window = 64ul << 20;    // a multiple of any page size
+
+    DropBehind drop( fd, false );
+
+    for(unsigned long offset = 0; offset < size; offset += window) {
+        unsigned long len = std::min( window, size - offset );
+        void *map = mmap( NULL, len, PROT_READ, MAP_SHARED, fd, offset );
+        if ( map == MAP_FAILED ) return errno;
+
+        madvise( map, len, MADV_SEQUENTIAL );
+        madvise( map, len, MADV_WILLNEED );
+        if ( offset + len < size )
+            posix_fadvise( fd, offset + len, std::min( window, size - offset - len ), POSIX_FADV_WILLNEED );
+
+        ctx.update( map, len );
+        timer.addBytes( len );
+        munmap( map, len );
+        drop.advance( offset + len );
+    }
+    drop.finish();
+    return 0;
+}
+
+// Returns 0 on success, errno on error, for sure related to file missing, etc.
+int computeDigest(DigestKind kind, const std::string& filepath, unsigned char *digest, HashRead how)
+{
+    StageTimer timer( STAGE_HASH );
+
+    // Filesystems without O_DIRECT (tmpfs...) refuse the open; dropping behind then
+    if ( how == HASH_READ_AUTO && pageCache() == PAGE_CACHE_DIRECT ) how = HASH_READ_DIRECT;
+    int fd = how == HASH_READ_DIRECT ? open( filepath.c_str(), O_RDONLY | O_CLOEXEC | O_DIRECT ) : -1;
+    if ( fd == -1 ) {
+        if ( how == HASH_READ_DIRECT ) how = HASH_READ_AUTO;
+        fd = open( filepath.c_str(), O_RDONLY | O_CLOEXEC );
+    }
+    if ( fd == -1 ) return errno;
+
+    struct stat statbuf;
+    if ( fstat( fd, &statbuf ) ) { int err = errno; close( fd ); return err; }
+
+    if ( how == HASH_READ_AUTO ) how = (unsigned long) statbuf.st_size >= HASH_MMAP_MIN_BYTES ? HASH_READ_MMAP : HASH_READ_BUFFERED;
+    // Empty files and special ones, whose size says nothing, go the plain way
+    if ( how == HASH_READ_MMAP && (!S_ISREG( statbuf.st_mode ) || !statbuf.st_size) ) how = HASH_READ_BUFFERED;
+
+    DigestCtx ctx( kind );
+
+    int err;
+    if      ( how == HASH_READ_DIRECT ) err = digestDirect( fd, ctx, timer );
+    else if ( how == HASH_READ_MMAP   ) err = digestMapped( fd, statbuf.st_size, ctx, timer );
+    else {
+        posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+        err = digestBuffered( fd, ctx, timer );
+    }
+    close( fd );
+    if ( err ) return err;
+
+    ctx.final( digest );
+
+    printDigest( kind, digest, filepath );
+
+    return 0;
+}
+
+// Reads until 'size' bytes or EOF; returns bytes read, or -1 on error
+static ssize_t readFull(int fd, unsigned char *buf, size_t size)
+{
+    size_t done = 0;
+    while ( done < size ) {
+        ssize_t n = read( fd, buf + done, size - done );
+        if ( n == -1 ) { if ( errno == EINTR ) continue; return -1; }
+        if ( !n ) break;
+        done += n;
+    }
+    return done;
+}
+
+int computeSample(const std::string& filepath, unsigned long size, unsigned long sampleBytes,
+                  unsigned char *sample)
+{
+    if ( sampleBytes > size ) sampleBytes = size;
+
+    StageTimer timer( STAGE_SAMPLE );
+
+    int fd = open( filepath.c_str(), O_RDONLY );
+    if ( fd == -1 ) return errno;
+
+    unsigned char *buf = (unsigned char *) malloc( sampleBytes );
+
+    // Same hash whatever the run digest is; a sample only has to rule files out, fast
+    DigestCtx ctx( DIGEST_FAST128 );
+
+    int err = 0;
+    for(off_t offset: {(off_t) 0, (off_t) (size - sampleBytes)}) {
+        ssize_t n = pread( fd, buf, sampleBytes, offset );
+        if ( n == -1 ) { err = errno; break; }
+        if ( (unsigned long) n != sampleBytes ) { err = EAGAIN; break; }
+
+        ctx.update( buf, n );
+        timer.addBytes( n );
+    }
+
+    if ( !err ) ctx.final( sample );
+
+    DropBehind( fd, false ).finish();
+    free( buf );
+    close(fd);
+
+    return err;
+}
+
+int computeMD5x8(const std::string *filepaths[], int numFiles, unsigned char *md5Sums[])
+{
+    const size_t chunkSize = 64 * 1024;     // per lane, multiple of the MD5 block
+
+    StageTimer timer( STAGE_HASH );         // one call, numFiles items
+    timer.setItems( numFiles );
+
+    int fds[MD5X8_LANES];
+    int lane, err = 0;
+    for(lane=0; lane<numFiles; lane++) {
+        fds[lane] = open( filepaths[lane]->c_str(), O_RDONLY );
+        if ( fds[lane] == -1 ) { err = errno; break; }
+    }
+    if ( err ) {
+        while ( lane-- > 0 ) close( fds[lane] );
+        return err;
+    }
+
+    unsigned char *buf = (unsigned char *) malloc( chunkSize * numFiles );
+    const void *lanePtrs[MD5X8_LANES];
+    for(lane=0; lane<MD5X8_LANES; lane++)
+        lanePtrs[lane] = buf + chunkSize * (lane < numFiles ? lane : 0);
+
+    MD5x8_CTX ctx;
+    MD5x8_Init(&ctx);
+
+    // Lockstep: every lane must deliver the same amount of bytes on each round
+    while ( !err ) {
+        ssize_t nbytes = 0;
+        for(lane=0; lane<numFiles; lane++) {
+            ssize_t n = readFull( fds[lane], buf + chunkSize * lane, chunkSize );
+            if ( n == -1 ) { err = errno; break; }
+            if ( lane && n != nbytes ) { err = EAGAIN; break; }
+            nbytes = n;
+        }
+        if ( err || !nbytes ) break;
+
+        MD5x8_Update(&ctx, lanePtrs, nbytes);
+        timer.addBytes( nbytes * numFiles );
+    }
+
+    if ( !err ) {
+        unsigned char results[MD5X8_LANES][16];
+        MD5x8_Final(results, &ctx);
+
+        for(lane=0; lane<numFiles; lane++) {
+            memcpy( md5Sums[lane], results[lane], 16 );
+            printDigest( DIGEST_MD5, md5Sums[lane], *filepaths[lane] );
+        }
+    }
+
+    free( buf );
+    for(lane=0; lane<numFiles; lane++) {
+        DropBehind( fds[lane], false ).finish();
+        close( fds[lane] );
+    }
+
+    return err;
+}
@@ -0,0 +1,90 @@
+#ifndef __COPYDIR_FILEHASH_H__
+#define __COPYDIR_FILEHASH_H__
+
+extern "C" {
+#include "md5.h"
+#include "fasthash.h"
+}
+
+#include <string>
+
+// How file contents are compared. MD5 is the compatible default; the fast ones are for
+// trusted data only, as they are not collision resistant.
+enum DigestKind {
+    DIGEST_MD5,
+    DIGEST_FAST128,
+    DIGEST_FAST64,              // low half of fast128; smaller, same speed
+};
+
+const char  *digestName(DigestKind kind);
+unsigned int digestLength(DigestKind kind);                 // in bytes, 16 at most
+bool         digestKindFromName(const char *name, DigestKind& kind);
+
+// Streaming digest of any kind: init on construction, feed with update(), then final()
+class DigestCtx {
+public:
+    explicit DigestCtx(DigestKind kind);
+
+    void update(const void *data, unsigned long size);
+    // Writes digestLength() bytes, and zeroes the rest up to 16
+    void final(unsigned char *digest);
+
+private:
+    DigestKind kind;
+    union {
+        MD5_CTX   md5;
+        FH128_CTX fh128;
+    } ctx;
+};
+
+// Logs a digest, the way computeDigest does; only once enabled (a printf per file adds
+// up on big trees, so it is for verbose runs)
+void printDigest(DigestKind kind, const unsigned char *digest, const std::string& filepath);
+void setDigestLogging(bool enabled);
+
+// How computeDigest gets at the contents of a file
+enum HashRead {
+    HASH_READ_AUTO,             // mapped from HASH_MMAP_MIN_BYTES on, buffered below
+    HASH_READ_BUFFERED,         // read() into a 256 KB buffer per thread
+    HASH_READ_MMAP,             // mapped in windows of 64 MB, with read-ahead hints
+    HASH_READ_DIRECT,           // O_DIRECT into an aligned 1 MB buffer, page cache bypassed
+};
+
+// Below this, mapping and unmapping costs more than the copies it saves; see 'make bench'
+#define HASH_MMAP_MIN_BYTES (1ul << 20)
+
+/*!
+  * @brief Computes the digest of a whole file, and logs it (see printDigest).
+  * @param digest 16-byte output buffer
+  * @param how buffered or mapped; the default picks by file size, or goes direct if the
+  *        page cache policy says so (see pageCache.h)
+  * @return 0 on success, errno on error, for sure related to file missing, etc.
+  * @remark a mapped file truncated by someone else while being hashed means SIGBUS; the
+  *         digest cache and size checks make that unlikely, not impossible
+  */
+int computeDigest(DigestKind kind, const std::string& filepath, unsigned char *digest,
+                  HashRead how = HASH_READ_AUTO);
+
+/*!
+  * @brief Cheap prefilter for files of the same size: fast128 of the first and the last
+  *        'sampleBytes' of the file. Files with different samples are different; equal
+  *        samples still need the full digest to tell.
+  * @param size the file size, as scanned; the tail is read at size - sampleBytes
+  * @param sample 16-byte output buffer
+  * @return 0 on success, errno on error (EAGAIN if the file is shorter than 'size' now)
+  * @remark only worth it for size > 2 * sampleBytes; otherwise just hash the whole file
+  */
+int computeSample(const std::string& filepath, unsigned long size, unsigned long sampleBytes,
+                  unsigned char *sample);
+
+/*!
+  * @brief Computes the MD5 sums of up to 8 files of the same size in a single pass, on
+  *        the multi-buffer kernel (md5_mb.h). Files are read chunk by chunk in turns.
+  * @param numFiles 1 to MD5X8_LANES; unused lanes just mirror the first file
+  * @return 0 on success; errno otherwise, or EAGAIN if the files turned out not to be
+  *         the same size anymore. On failure no digest is valid.
+  * @remark caller must check MD5x8_Available() first
+  */
+int computeMD5x8(const std::string *filepaths[], int numFiles, unsigned char *md5Sums[]);
+
+#endif
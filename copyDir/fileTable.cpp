@@ -0,0 +1,150 @@
+#include "fileTable.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+// Blocks start small, a directory with a handful of files should not take 1 MB, and
+// double up to a cap; names longer than a block get one of their own size.
+static const size_t firstBlockSize = 4 * 1024;
+static const size_t maxBlockSize   = 1024 * 1024;
+
+static const unsigned char noDigest[16] = {};
+
+FileTable::FileTable() : blockNext(NULL), blockFree(0), nextBlockSize(firstBlockSize) {}
+
+void FileTable::clear()
+{
+    names.clear();
+    sizes.clear();
+    flags.clear();
+    devs.clear();
+    inos.clear();
+    mtimes.clear();
+    ctimes.clear();
+    digestSlots.clear();
+    digests.clear();
+
+    blocks.clear();
+    blockNext     = NULL;
+    blockFree     = 0;
+    nextBlockSize = firstBlockSize;
+}
+
+const char *FileTable::intern(const char *name, size_t len)
+{
+    if ( len + 1 > blockFree ) {
+        size_t blockSize = std::max( nextBlockSize, len + 1 );
+        blocks.emplace_back( new char[blockSize] );
+        blockNext = blocks.back().get();
+        blockFree = blockSize;
+        nextBlockSize = std::min( nextBlockSize * 2, maxBlockSize );
+    }
+
+    char *copy = blockNext;
+    memcpy( copy, name, len );
+    copy[len] = '\0';
+    blockNext += len + 1;
+    blockFree -= len + 1;
+
+    return copy;
+}
+
+FileTable::Handle FileTable::add(const char *name, size_t nameLen, unsigned long size, bool isDir)
+{
+    names.push_back( intern( name, nameLen ) );
+    sizes.push_back( size );
+    flags.push_back( isDir ? IS_DIR : 0 );
+    devs.push_back( 0 );
+    inos.push_back( 0 );
+    mtimes.push_back( 0 );
+    ctimes.push_back( 0 );
+    digestSlots.push_back( 0 );
+
+    return sizes.size() - 1;
+}
+
+void FileTable::removeLast()
+{
+    // Its name is the last one in the arena, unless a new block was started for it
+    const char *name = names.back();
+    size_t      len  = strlen( name ) + 1;
+    if ( name + len == blockNext ) { blockNext -= len; blockFree += len; }
+
+    if ( digestSlots.back() && digestSlots.back() == digests.size() ) digests.pop_back();
+
+    names.pop_back();
+    sizes.pop_back();
+    flags.pop_back();
+    devs.pop_back();
+    inos.pop_back();
+    mtimes.pop_back();
+    ctimes.pop_back();
+    digestSlots.pop_back();
+}
+
+void FileTable::append(const FileTable& other)
+{
+    for(Handle o=0; o<other.count(); o++) {
+        Handle h = add( other.name( o ), strlen( other.name( o ) ), other.size( o ), other.isDir( o ) );
+        setIdentity( h, other.dev( o ), other.ino( o ), other.mtimeNs( o ), other.ctimeNs( o ) );
+        if ( other.sampleCached( o ) ) setSample( h, other.sample( o ) );
+        if ( other.digestCached( o ) ) setDigest( h, other.digest( o ) );
+    }
+}
+
+void FileTable::setDir(Handle h, bool isDir)
+{
+    if ( isDir ) flags[h] |= IS_DIR;
+    else         flags[h] &= ~IS_DIR;
+}
+
+void FileTable::setIdentity(Handle h, unsigned long dev, unsigned long ino, long long mtimeNs, long long ctimeNs)
+{
+    devs[h]   = dev;
+    inos[h]   = ino;
+    mtimes[h] = mtimeNs;
+    ctimes[h] = ctimeNs;
+}
+
+const unsigned char *FileTable::sample(Handle h) const
+{
+    return digestSlots[h] ? digests[ digestSlots[h] - 1 ].sample : noDigest;
+}
+
+const unsigned char *FileTable::digest(Handle h) const
+{
+    return digestSlots[h] ? digests[ digestSlots[h] - 1 ].digest : noDigest;
+}
+
+void FileTable::makeRoom(Handle h)
+{
+    if ( digestSlots[h] ) return;
+
+    digests.push_back( Digests() );
+    digestSlots[h] = digests.size();
+}
+
+unsigned char *FileTable::sampleBuf(Handle h)
+{
+    makeRoom( h );
+    return digests[ digestSlots[h] - 1 ].sample;
+}
+
+unsigned char *FileTable::digestBuf(Handle h)
+{
+    makeRoom( h );
+    return digests[ digestSlots[h] - 1 ].digest;
+}
+
+void FileTable::setSample(Handle h, const unsigned char *sample)
+{
+    memcpy( sampleBuf( h ), sample, 16 );
+    setSampleCached( h );
+}
+
+void FileTable::setDigest(Handle h, const unsigned char *digest)
+{
+    memcpy( digestBuf( h ), digest, 16 );
+    setDigestCached( h );
+}
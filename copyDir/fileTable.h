@@ -0,0 +1,108 @@
+#ifndef __COPYDIR_FILETABLE_H__
+#define __COPYDIR_FILETABLE_H__
+
+#include <memory>
+#include <string>
+#include <vector>
+
+/*!
+  * @brief The entries of a directory scan (or of a whole tree), column by column.
+  *
+  * It used to be a vector of FileEntry structs, each one with a std::string of its own
+  * and room for a sample and a digest, some 150 bytes a file, most of them never used.
+  * Now names are packed one after the other into an arena owned by the table, every
+  * other field lives in an array of its own, and an entry is just its index, a Handle.
+  * Samples and digests only get room when an entry is about to have them, which means
+  * the few files involved in size collisions.
+  * @remark the name, size, isDir and identity columns are not modified once the table is
+  *         built, so any number of threads may read them; see makeRoom() about digests.
+  * @remark not copyable, names point into the table's own arena; moving is fine.
+  */
+class FileTable {
+public:
+    typedef unsigned int Handle;
+
+    FileTable();
+    FileTable(FileTable&&) = default;
+    FileTable& operator=(FileTable&&) = default;
+    FileTable(const FileTable&) = delete;
+    FileTable& operator=(const FileTable&) = delete;
+
+    size_t count() const { return sizes.size(); }
+    bool   empty() const { return sizes.empty(); }
+    void   clear();
+
+    // Appends an entry, with no identity nor digests yet
+    Handle add(const char *name, size_t nameLen, unsigned long size, bool isDir);
+    Handle add(const std::string& name, unsigned long size, bool isDir) {
+        return add( name.data(), name.size(), size, isDir );
+    }
+    void   removeLast();
+
+    // Appends all the entries of another table, with whatever they have cached
+    void   append(const FileTable& other);
+
+    const char   *name(Handle h) const  { return names[h]; }
+    unsigned long size(Handle h) const  { return sizes[h]; }
+    bool          isDir(Handle h) const { return flags[h] & IS_DIR; }
+    void          setSize(Handle h, unsigned long size) { sizes[h] = size; }
+    void          setDir(Handle h, bool isDir);
+
+    // Identity as of the scan; tells whether a digest cached on disk is still valid
+    unsigned long dev(Handle h) const     { return devs[h]; }
+    unsigned long ino(Handle h) const     { return inos[h]; }
+    long long     mtimeNs(Handle h) const { return mtimes[h]; }
+    long long     ctimeNs(Handle h) const { return ctimes[h]; }
+    void setIdentity(Handle h, unsigned long dev, unsigned long ino, long long mtimeNs, long long ctimeNs);
+
+    // Fast hash of the first and last bytes, and MD5 or fast hash per run settings; see
+    // fileHash.h. All zeroes until cached.
+    bool sampleCached(Handle h) const { return flags[h] & SAMPLE_CACHED; }
+    bool digestCached(Handle h) const { return flags[h] & DIGEST_CACHED; }
+    const unsigned char *sample(Handle h) const;
+    const unsigned char *digest(Handle h) const;
+
+    /*!
+      * @brief Gives the entry room for its sample and digest, if it had none yet.
+      * @remark may move every sample and digest of the table; nobody else may be reading or
+      *         writing them meanwhile. Hashing workers get their room made beforehand.
+      */
+    void makeRoom(Handle h);
+
+    // Where the sample/digest is to be written, room made if needed; see makeRoom()
+    unsigned char *sampleBuf(Handle h);
+    unsigned char *digestBuf(Handle h);
+    void setSampleCached(Handle h) { flags[h] |= SAMPLE_CACHED; }
+    void setDigestCached(Handle h) { flags[h] |= DIGEST_CACHED; }
+
+    void setSample(Handle h, const unsigned char *sample);
+    void setDigest(Handle h, const unsigned char *digest);
+
+private:
+    enum { IS_DIR = 1, SAMPLE_CACHED = 2, DIGEST_CACHED = 4 };
+
+    struct Digests {
+        unsigned char sample[16];
+        unsigned char digest[16];
+    };
+
+    std::vector<const char *>   names;
+    std::vector<unsigned long>  sizes;
+    std::vector<unsigned char>  flags;
+    std::vector<unsigned long>  devs;
+    std::vector<unsigned long>  inos;
+    std::vector<long long>      mtimes;
+    std::vector<long long>      ctimes;
+    std::vector<unsigned int>   digestSlots;    // index in 'digests' + 1; 0 means no room
+    std::vector<Digests>        digests;
+
+    // Names arena: blocks only ever get appended to, so name pointers stay valid
+    std::vector<std::unique_ptr<char[]>> blocks;
+    char   *blockNext;
+    size_t  blockFree;
+    size_t  nextBlockSize;
+
+    const char *intern(const char *name, size_t len);
+};
+
+#endif
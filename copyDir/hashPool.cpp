@@ -0,0 +1,220 @@
+extern "C" {
+#include "md5_mb.h"
+}
+
+#include "hashPool.h"
+#include "fileHash.h"
+#include "metrics.h"
+#include "pageCache.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+
+// Runs 'work' on units 0..numUnits-1 with up to 'numThreads' threads, the calling one
+// included, each one taking the next unit from a shared cursor
+static void runWorkers(size_t numUnits, unsigned int numThreads, const std::function<void(size_t)>& work)
+{
+    std::atomic<size_t> nextUnit( 0 );
+
+    auto worker = [&] () {
+        size_t u;
+        while ( (u = nextUnit++) < numUnits ) work( u );
+    };
+
+    // No point in more threads than units
+    if ( numThreads > numUnits ) numThreads = numUnits;
+    if ( numThreads < 1 ) numThreads = 1;
+
+    std::vector<std::thread> threads;
+    for(unsigned int t=1; t<numThreads; t++) threads.emplace_back( worker );
+    worker();
+    for(std::thread& t: threads) t.join();
+}
+
+static inline unsigned long sizeOf(const HashJob& job)
+{
+    return job.table->size( job.entry );
+}
+
+// Workers only write into room made beforehand; making it may move all the digests
+static void makeRoom(std::vector<HashJob>& jobs)
+{
+    for(HashJob& job: jobs) job.table->makeRoom( job.entry );
+}
+
+// Files each worker keeps in flight on its ring
+static const unsigned int uringFilesInFlight = 16;
+
+unsigned int hashFiles(std::vector<HashJob>& jobs, DigestKind kind, unsigned int numThreads,
+                       IoEngine io, HashStats& stats)
+{
+    if ( jobs.empty() ) return 0;
+
+    auto start = std::chrono::steady_clock::now();
+    makeRoom( jobs );
+
+    if ( io == IO_URING ) {
+        std::atomic<size_t>        nextJob( 0 );
+        std::atomic<unsigned int>  numErrors( 0 );
+        std::atomic<unsigned long> bytesHashed( 0 );
+        std::vector<std::chrono::steady_clock::time_point> started( jobs.size() );
+
+        auto next = [&] (StreamJob& sj) {
+            size_t j;
+            while ( (j = nextJob++) < jobs.size() ) {
+                sj.fdIn = open( jobs[j].path.c_str(), O_RDONLY | O_CLOEXEC );
+                if ( sj.fdIn == -1 ) {
+                    jobs[j].err = errno;
+                    numErrors++;
+                    continue;
+                }
+                sj.digest  = new DigestCtx( kind );
+                sj.user    = &jobs[j];
+                started[j] = std::chrono::steady_clock::now();
+                return true;
+            }
+            return false;
+        };
+
+        auto done = [&] (StreamJob& sj) {
+            HashJob& job = *(HashJob *) sj.user;
+            DropBehind( sj.fdIn, false ).finish();
+            close( sj.fdIn );
+
+            job.err = sj.err;
+            if ( sj.err ) numErrors++;
+            else {
+                metricsRecord( STAGE_HASH, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now() - started[&job - &jobs[0]] ).count(), sj.bytes );
+                sj.digest->final( job.table->digestBuf( job.entry ) );
+                printDigest( kind, job.table->digest( job.entry ), job.path );
+                job.table->setDigestCached( job.entry );
+                bytesHashed += sj.bytes;
+            }
+            delete sj.digest;
+        };
+
+        // A ring that cannot be set up leaves its worker's share to the others, or to the
+        // blocking path if none of them could
+        runWorkers( numThreads, numThreads, [&] (size_t) { streamFilesUring( uringFilesInFlight, next, done ); } );
+        for(size_t j; (j = nextJob++) < jobs.size(); ) {
+            HashJob& job = jobs[j];
+            job.err = computeDigest( kind, job.path, job.table->digestBuf( job.entry ) );
+            if ( job.err ) numErrors++;
+            else { job.table->setDigestCached( job.entry ); bytesHashed += job.table->size( job.entry ); }
+        }
+
+        stats.files   += jobs.size() - numErrors;
+        stats.bytes   += bytesHashed;
+        stats.seconds += std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+        return numErrors;
+    }
+
+    // Work units: runs of up to 8 same-size jobs go together through the multi-buffer
+    // MD5 kernel, when the CPU has it; anything else is hashed on its own.
+    std::vector<size_t> order( jobs.size() );
+    for(size_t i=0; i<order.size(); i++) order[i] = i;
+
+    std::vector<size_t> unitStarts;
+    if ( kind == DIGEST_MD5 && MD5x8_Available() ) {
+        std::stable_sort( order.begin(), order.end(),
+                          [&jobs] (size_t a, size_t b) { return sizeOf( jobs[a] ) < sizeOf( jobs[b] ); } );
+        for(size_t i=0; i<order.size(); i++) {
+            bool sameSizeAsUnit = !unitStarts.empty() &&
+                                  i - unitStarts.back() < MD5X8_LANES &&
+                                  sizeOf( jobs[ order[i] ] ) == sizeOf( jobs[ order[ unitStarts.back() ] ] );
+            if ( !sameSizeAsUnit ) unitStarts.push_back( i );
+        }
+    }
+    else {
+        for(size_t i=0; i<order.size(); i++) unitStarts.push_back( i );
+    }
+    unitStarts.push_back( order.size() );
+
+    std::atomic<unsigned int>  numErrors( 0 );
+    std::atomic<unsigned long> bytesHashed( 0 );
+
+    auto hashOne = [&] (HashJob& job) {
+        job.err = computeDigest( kind, job.path, job.table->digestBuf( job.entry ) );
+        if ( job.err ) {
+            numErrors++;
+            return;
+        }
+
+        job.table->setDigestCached( job.entry );
+        bytesHashed += sizeOf( job );
+    };
+
+    auto hashUnit = [&] (size_t u) {
+        size_t first = unitStarts[u], numJobs = unitStarts[u + 1] - first;
+
+        if ( numJobs == 1 ) { hashOne( jobs[ order[first] ] ); return; }
+
+        const std::string *paths[MD5X8_LANES];
+        unsigned char     *sums[MD5X8_LANES];
+        for(size_t i=0; i<numJobs; i++) {
+            paths[i] = &jobs[ order[first + i] ].path;
+            sums[i]  =  jobs[ order[first + i] ].table->digestBuf( jobs[ order[first + i] ].entry );
+        }
+
+        // Any trouble (a file missing, or changed size meanwhile): go one by one
+        if ( computeMD5x8( paths, numJobs, sums ) ) {
+            for(size_t i=0; i<numJobs; i++) hashOne( jobs[ order[first + i] ] );
+            return;
+        }
+
+        for(size_t i=0; i<numJobs; i++) {
+            HashJob& job = jobs[ order[first + i] ];
+            job.err = 0;
+            job.table->setDigestCached( job.entry );
+            bytesHashed += sizeOf( job );
+        }
+    };
+
+    runWorkers( unitStarts.size() - 1, numThreads, hashUnit );
+
+    stats.files   += jobs.size() - numErrors;
+    stats.bytes   += bytesHashed;
+    stats.seconds += std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+    return numErrors;
+}
+
+unsigned int sampleFiles(std::vector<HashJob>& jobs, unsigned long sampleBytes,
+                         unsigned int numThreads, HashStats& stats)
+{
+    if ( jobs.empty() ) return 0;
+
+    auto start = std::chrono::steady_clock::now();
+    makeRoom( jobs );
+
+    std::atomic<unsigned int>  numErrors( 0 );
+    std::atomic<unsigned long> bytesRead( 0 );
+
+    runWorkers( jobs.size(), numThreads, [&] (size_t u) {
+        HashJob& job = jobs[u];
+        job.err = computeSample( job.path, sizeOf( job ), sampleBytes, job.table->sampleBuf( job.entry ) );
+        if ( job.err ) {
+            numErrors++;
+            return;
+        }
+
+        job.table->setSampleCached( job.entry );
+        bytesRead += std::min( sizeOf( job ), 2 * sampleBytes );
+    } );
+
+    stats.sampledFiles += jobs.size() - numErrors;
+    stats.sampledBytes += bytesRead;
+    stats.seconds      += std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+
+    return numErrors;
+}
@@ -0,0 +1,69 @@
+#ifndef __COPYDIR_HASHPOOL_H__
+#define __COPYDIR_HASHPOOL_H__
+
+#include "fileTable.h"
+#include "fileHash.h"
+#include "ioRing.h"
+
+#include <string>
+#include <vector>
+
+// A file to be hashed, and the entry its digest goes into
+struct HashJob {
+    std::string       path;
+    FileTable        *table;
+    FileTable::Handle entry;
+    int               err = 0;  // set by the pool: 0, or errno of a failure
+};
+
+// Accumulated over all the hashing stages of a run
+struct HashStats {
+    unsigned long files;
+    unsigned long bytes;
+    double        seconds;      // wall time spent in the hashing stages
+
+    unsigned long sampledFiles;
+    unsigned long sampledBytes; // read by the sampling stages; counted in 'seconds' too
+
+    HashStats() : files(0), bytes(0), seconds(0), sampledFiles(0), sampledBytes(0) {}
+
+    HashStats& operator+=(const HashStats& other) {
+        files        += other.files;
+        bytes        += other.bytes;
+        seconds      += other.seconds;
+        sampledFiles += other.sampledFiles;
+        sampledBytes += other.sampledBytes;
+        return *this;
+    }
+};
+
+/*!
+  * @brief Hashes all the jobs concurrently, writing results into the entries' digests.
+  *
+  * Jobs are handed out to 'numThreads' workers one at a time from a shared cursor, so
+  * a few huge files do not leave the other workers idle at the end of a static split.
+  * For MD5 on AVX2 CPUs, jobs of the same size are handed out in batches of up to 8 and
+  * hashed together by the multi-buffer kernel.
+  * With IO_URING, each worker instead keeps several files in flight on its own ring and
+  * hashes the chunks as they complete; the multi-buffer kernel is not used then.
+  * @return number of jobs that failed; their entries are left with no digest cached, and
+  *         their 'err' says why. Nothing is logged from the workers: that is for the caller.
+  * @remark entries must be distinct; each one is written by a single worker
+  * @remark the tables must not be used by anybody else meanwhile; room for the digests
+  *         is made before the workers start, see FileTable::makeRoom()
+  */
+unsigned int hashFiles(std::vector<HashJob>& jobs, DigestKind kind, unsigned int numThreads,
+                       IoEngine io, HashStats& stats);
+
+/*!
+  * @brief Samples all the jobs concurrently (see computeSample), writing results into
+  *        the entries' samples. Same scheduling as hashFiles.
+  * @return number of jobs that failed; their entries are left with no sample cached, and
+  *         their 'err' says why
+  * @remark entries must be distinct; each one is written by a single worker
+  * @remark the tables must not be used by anybody else meanwhile, as with hashFiles
+  */
+unsigned int sampleFiles(std::vector<HashJob>& jobs, unsigned long sampleBytes,
+                         unsigned int numThreads, HashStats& stats);
+
+#endif
@@ -0,0 +1,329 @@
+#include "ioRing.h"
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+const char *ioEngineName(IoEngine engine)
+{
+    switch ( engine ) {
+        case IO_SYNC:  return "sync";
+        case IO_URING: return "uring";
+    }
+    return "?";
+}
+
+bool ioEngineFromName(const char *name, IoEngine& engine)
+{
+    for(IoEngine e: {IO_SYNC, IO_URING}) {
+        if ( !strcasecmp( name, ioEngineName( e ) ) ) { engine = e; return true; }
+    }
+    return false;
+}
+
+IoRing::IoRing() : fd(-1), sqMap(MAP_FAILED), cqMap(MAP_FAILED), sqesMap(MAP_FAILED),
+                   sqMapSize(0), cqMapSize(0), sqesMapSize(0), toSubmit(0) {}
+
+IoRing::~IoRing()
+{
+    if ( sqesMap != MAP_FAILED ) munmap( sqesMap, sqesMapSize );
+    if ( cqMap != MAP_FAILED && cqMap != sqMap ) munmap( cqMap, cqMapSize );
+    if ( sqMap != MAP_FAILED ) munmap( sqMap, sqMapSize );
+    if ( fd != -1 ) close( fd );
+}
+
+int IoRing::init(unsigned int entries)
+{
+    struct io_uring_params p;
+    memset( &p, 0, sizeof(p) );
+
+    fd = syscall( __NR_io_uring_setup, entries, &p );
+    if ( fd == -1 ) return errno;
+
+    sqMapSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cqMapSize = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    // Since 5.4 both rings come in a single mapping
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if ( single ) sqMapSize = cqMapSize = std::max( sqMapSize, cqMapSize );
+
+    sqMap = mmap( NULL, sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING );
+    if ( sqMap == MAP_FAILED ) return errno;
+
+    cqMap = single ? sqMap :
+            mmap( NULL, cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING );
+    if ( cqMap == MAP_FAILED ) return errno;
+
+    sqesMapSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqesMap = mmap( NULL, sqesMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES );
+    if ( sqesMap == MAP_FAILED ) return errno;
+
+    char *sq = (char *) sqMap, *cq = (char *) cqMap;
+    sqHead  = (unsigned int *) (sq + p.sq_off.head);
+    sqTail  = (unsigned int *) (sq + p.sq_off.tail);
+    sqMask  = (unsigned int *) (sq + p.sq_off.ring_mask);
+    sqArray = (unsigned int *) (sq + p.sq_off.array);
+    cqHead  = (unsigned int *) (cq + p.cq_off.head);
+    cqTail  = (unsigned int *) (cq + p.cq_off.tail);
+    cqMask  = (unsigned int *) (cq + p.cq_off.ring_mask);
+    sqes    = sqesMap;
+    cqes    = cq + p.cq_off.cqes;
+    sqEntries = p.sq_entries;
+
+    return 0;
+}
+
+bool IoRing::prep(unsigned char opcode, int fdFile, const void *buf, unsigned int len, off_t offset,
+                  unsigned long long userData)
+{
+    unsigned int tail = *sqTail;
+    if ( tail - __atomic_load_n( sqHead, __ATOMIC_ACQUIRE ) >= sqEntries ) return false;
+
+    unsigned int index = tail & *sqMask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *) sqes)[index];
+    memset( sqe, 0, sizeof(*sqe) );
+    sqe->opcode    = opcode;
+    sqe->fd        = fdFile;
+    sqe->addr      = (unsigned long) buf;
+    sqe->len       = len;
+    sqe->off       = offset;
+    sqe->user_data = userData;
+
+    sqArray[index] = index;
+    __atomic_store_n( sqTail, tail + 1, __ATOMIC_RELEASE );
+    toSubmit++;
+
+    return true;
+}
+
+bool IoRing::prepRead(int fdFile, void *buf, unsigned int len, off_t offset, unsigned long long userData)
+{
+    return prep( IORING_OP_READ, fdFile, buf, len, offset, userData );
+}
+
+bool IoRing::prepWrite(int fdFile, const void *buf, unsigned int len, off_t offset, unsigned long long userData)
+{
+    return prep( IORING_OP_WRITE, fdFile, buf, len, offset, userData );
+}
+
+int IoRing::submitAndWait(unsigned int waitNr)
+{
+    while ( 1 ) {
+        int n = syscall( __NR_io_uring_enter, fd, toSubmit, waitNr,
+                         waitNr ? IORING_ENTER_GETEVENTS : 0, NULL, 0 );
+        if ( n >= 0 ) { toSubmit -= n; return 0; }
+        if ( errno != EINTR ) return errno;
+    }
+}
+
+bool IoRing::popCompletion(unsigned long long& userData, int& res)
+{
+    unsigned int head = *cqHead;
+    if ( head == __atomic_load_n( cqTail, __ATOMIC_ACQUIRE ) ) return false;
+
+    struct io_uring_cqe *cqe = &((struct io_uring_cqe *) cqes)[head & *cqMask];
+    userData = cqe->user_data;
+    res      = cqe->res;
+
+    __atomic_store_n( cqHead, head + 1, __ATOMIC_RELEASE );
+    return true;
+}
+
+bool IoRing::available()
+{
+    IoRing ring;
+    return !ring.init( 1 );
+}
+
+int streamFilesUring(unsigned int filesInFlight, const std::function<bool(StreamJob&)>& next,
+                     const std::function<void(StreamJob&)>& done)
+{
+    const unsigned int chunkSize     = 128 * 1024;
+    const unsigned int chunksPerFile = 4;               // power of 2; user data packs it in
+
+    enum ChunkState { FREE, READING, READY, WRITING };
+
+    struct Chunk {
+        ChunkState    state;
+        off_t         offset;
+        unsigned int  len;          // read so far, then written so far
+        unsigned int  size;         // what was read
+        unsigned char *buf;
+    };
+
+    struct Slot {
+        bool         active;
+        StreamJob    job;
+        off_t        size;          // of the file at the start
+        off_t        nextOffset;    // for the next read
+        bool         eof;
+        off_t        eofOffset;
+        unsigned int head, tail;    // next chunk to consume, and to read into
+        unsigned int inFlight;      // reads and writes
+        Chunk        chunks[chunksPerFile];
+    };
+
+    // Ahead of the ring, so that they outlive it; see the end
+    std::unique_ptr<unsigned char[]> buffers( new unsigned char[ (size_t) filesInFlight * chunksPerFile * chunkSize ] );
+    std::vector<Slot>                slots( filesInFlight );
+    for(unsigned int s=0; s<filesInFlight; s++) {
+        slots[s].active = false;
+        for(unsigned int c=0; c<chunksPerFile; c++)
+            slots[s].chunks[c].buf = &buffers[ ((size_t) s * chunksPerFile + c) * chunkSize ];
+    }
+
+    IoRing ring;
+    int err = ring.init( filesInFlight * chunksPerFile );
+    if ( err ) return err;
+
+    bool moreJobs = true;
+    unsigned int numActive = 0;
+
+    auto submitWrite = [&ring] (Slot& slot, unsigned int c, unsigned long long userData) {
+        Chunk& chunk = slot.chunks[c];
+        ring.prepWrite( slot.job.fdOut, chunk.buf + chunk.len, chunk.size - chunk.len,
+                        chunk.offset + chunk.len, userData );
+        chunk.state = WRITING;
+        slot.inFlight++;
+    };
+
+    while ( 1 ) {
+        for(unsigned int s=0; s<filesInFlight; s++) {
+            Slot& slot = slots[s];
+
+            // Round again whenever the slot is over with its file, for the next one
+            while ( 1 ) {
+                if ( !slot.active ) {
+                    if ( !moreJobs ) break;
+                    slot.job = StreamJob();
+                    if ( !(moreJobs = next( slot.job )) ) break;
+                    struct stat statbuf;
+                    slot.active     = true;
+                    slot.size       = fstat( slot.job.fdIn, &statbuf ) ? -1 : statbuf.st_size;
+                    slot.nextOffset = 0;
+                    slot.eof        = false;
+                    slot.eofOffset  = 0;
+                    slot.head = slot.tail = slot.inFlight = 0;
+                    for(Chunk& chunk: slot.chunks) chunk.state = FREE;
+                    numActive++;
+                }
+
+                // Keep reading ahead, in order, into the chunks as they get free
+                while ( !slot.eof && !slot.job.err && slot.chunks[slot.tail].state == FREE ) {
+                    Chunk& chunk = slot.chunks[slot.tail];
+                    chunk.offset = slot.nextOffset;
+                    chunk.len = chunk.size = 0;
+                    ring.prepRead( slot.job.fdIn, chunk.buf, chunkSize, chunk.offset,
+                                   (unsigned long long) s * chunksPerFile + slot.tail );
+                    chunk.state = READING;
+                    slot.inFlight++;
+                    slot.nextOffset += chunkSize;
+                    slot.tail = (slot.tail + 1) % chunksPerFile;
+                }
+
+                // Over: all read and consumed, or failed and nothing left in flight
+                bool over = !slot.inFlight && (slot.job.err || (slot.eof && slot.chunks[slot.head].state == FREE));
+                if ( !over ) break;
+                if ( !slot.job.err && (off_t) slot.job.bytes != slot.size ) slot.job.err = ESTALE;
+                done( slot.job );
+                slot.active = false;
+                numActive--;
+            }
+        }
+
+        if ( !numActive ) break;
+
+        if ( (err = ring.submitAndWait( 1 )) ) break;
+
+        unsigned long long userData;
+        int res;
+        while ( ring.popCompletion( userData, res ) ) {
+            Slot&  slot  = slots[ userData / chunksPerFile ];
+            unsigned int c = userData % chunksPerFile;
+            Chunk& chunk = slot.chunks[c];
+            slot.inFlight--;
+
+            if ( res < 0 ) {
+                if ( !slot.job.err ) slot.job.err = -res;
+                chunk.state = FREE;
+                continue;
+            }
+
+            if ( chunk.state == WRITING ) {
+                chunk.len += res;
+                if ( !res ) { if ( !slot.job.err ) slot.job.err = EIO; chunk.state = FREE; }
+                else if ( chunk.len < chunk.size && !slot.job.err ) submitWrite( slot, c, userData );
+                else chunk.state = FREE;
+                continue;
+            }
+
+            // A read. Short of the chunk and of the file size, it goes on where it stopped;
+            // past the size, a short one is EOF, and anything at or past it is beyond.
+            chunk.size += res;
+            if ( res && chunk.size < chunkSize && chunk.offset + chunk.size < slot.size && !slot.job.err ) {
+                ring.prepRead( slot.job.fdIn, chunk.buf + chunk.size, chunkSize - chunk.size,
+                               chunk.offset + chunk.size, userData );
+                slot.inFlight++;
+                continue;
+            }
+            chunk.state = READY;
+            if ( slot.eof && chunk.offset >= slot.eofOffset ) chunk.size = 0;
+            if ( chunk.size < chunkSize && (!slot.eof || chunk.offset + chunk.size < slot.eofOffset) ) {
+                slot.eof       = true;
+                slot.eofOffset = chunk.offset + chunk.size;
+            }
+
+            // Consume in file order: hash, then write or release
+            while ( slot.chunks[slot.head].state == READY ) {
+                unsigned int h = slot.head;
+                Chunk& ready = slot.chunks[h];
+                if ( slot.eof && ready.offset >= slot.eofOffset ) ready.size = 0;
+                else if ( slot.eof && ready.offset + ready.size > slot.eofOffset )
+                    ready.size = slot.eofOffset - ready.offset;
+
+                if ( !slot.job.err && ready.size ) {
+                    if ( slot.job.digest ) slot.job.digest->update( ready.buf, ready.size );
+                    slot.job.bytes += ready.size;
+                }
+
+                ready.len = 0;
+                if ( slot.job.fdOut != -1 && !slot.job.err && ready.size )
+                    submitWrite( slot, h, (unsigned long long) (&slot - &slots[0]) * chunksPerFile + h );
+                else ready.state = FREE;
+
+                slot.head = (h + 1) % chunksPerFile;
+            }
+        }
+    }
+
+    // Only on a failing ring; whatever is left open is reported as failed. Reads and writes
+    // still in flight may yet go into the buffers, or out of them: they are waited for
+    // before the files are handed back, and failing that the buffers are never freed.
+    unsigned int inFlight = 0;
+    for(Slot& slot: slots) {
+        if ( !slot.active ) continue;
+        if ( !slot.job.err ) slot.job.err = err;
+        inFlight += slot.inFlight;
+    }
+    while ( inFlight && !ring.submitAndWait( 1 ) ) {
+        unsigned long long userData;
+        int res;
+        while ( ring.popCompletion( userData, res ) ) inFlight--;
+    }
+    if ( inFlight ) buffers.release();
+
+    for(Slot& slot: slots)
+        if ( slot.active ) done( slot.job );
+
+    return 0;
+}
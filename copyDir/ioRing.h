@@ -0,0 +1,89 @@
+#ifndef __COPYDIR_IORING_H__
+#define __COPYDIR_IORING_H__
+
+#include "fileHash.h"
+
+#include <sys/types.h>
+
+#include <functional>
+
+// How file contents are read (and written) when hashing and copying
+enum IoEngine {
+    IO_SYNC,                    // blocking calls, one file per thread at a time
+    IO_URING,                   // io_uring, many reads and writes in flight per thread
+};
+
+const char *ioEngineName(IoEngine engine);
+bool        ioEngineFromName(const char *name, IoEngine& engine);
+
+/*!
+  * @brief Minimal io_uring on raw syscalls: just what streaming files needs.
+  *
+  * Not thread safe; meant to be owned by a single thread.
+  */
+class IoRing {
+public:
+    IoRing();
+    ~IoRing();
+
+    // @return 0 on success, errno otherwise (ENOSYS on kernels without io_uring)
+    int init(unsigned int entries);
+
+    // Queue a read/write at 'offset'; false if the submission queue is full
+    bool prepRead(int fd, void *buf, unsigned int len, off_t offset, unsigned long long userData);
+    bool prepWrite(int fd, const void *buf, unsigned int len, off_t offset, unsigned long long userData);
+
+    // Submits what was queued, and waits for at least 'waitNr' completions; 0 or errno
+    int submitAndWait(unsigned int waitNr);
+
+    // Pops a completion, if any; 'res' is the syscall-like result, -errno on error
+    bool popCompletion(unsigned long long& userData, int& res);
+
+    // Whether this kernel (and its seccomp policy) lets us set up a ring at all
+    static bool available();
+
+private:
+    int            fd;
+    void          *sqMap, *cqMap, *sqesMap;
+    size_t         sqMapSize, cqMapSize, sqesMapSize;
+
+    unsigned int  *sqHead, *sqTail, *sqMask, *sqArray;
+    unsigned int  *cqHead, *cqTail, *cqMask;
+    void          *sqes, *cqes;
+    unsigned int   sqEntries;
+    unsigned int   toSubmit;
+
+    bool prep(unsigned char opcode, int fd, const void *buf, unsigned int len, off_t offset,
+              unsigned long long userData);
+};
+
+// One file streamed through streamFilesUring
+struct StreamJob {
+    int           fdIn;
+    int           fdOut;        // -1 to just read it
+    DigestCtx    *digest;       // fed with the contents in order; NULL for none
+    void         *user;         // for the caller
+
+    unsigned long bytes;        // streamed so far
+    int           err;          // first error, errno
+
+    StreamJob() : fdIn(-1), fdOut(-1), digest(NULL), user(NULL), bytes(0), err(0) {}
+};
+
+/*!
+  * @brief Streams files through a ring owned by the calling thread: up to 'filesInFlight'
+  *        files at a time, each with a few chunk reads (and writes) outstanding.
+  *
+  * Reads are consumed in file order, so digests see the contents as a sequential read
+  * would; writes go at the offset they were read from. A short read goes on where it
+  * stopped, up to the size the file had when the job started; past that, it is the end.
+  * Should the file turn out to be of another size than that, it changed while streamed
+  * and the job fails with ESTALE.
+  * @param next fills in a job for the next file (fds open); false when there are no more
+  * @param done called once per job when the file is over, whether it went well or not
+  * @return 0, or errno if the ring could not be set up; then next() was never called
+  */
+int streamFilesUring(unsigned int filesInFlight, const std::function<bool(StreamJob&)>& next,
+                     const std::function<void(StreamJob&)>& done);
+
+#endif
@@ -0,0 +1,244 @@
+#include "journal.h"
+#include "digestCache.h"
+
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <fstream>
+#include <vector>
+
+// Names may hold anything but a NUL; tabs and newlines are what would break a record
+static std::string escape(const std::string& name)
+{
+    std::string out;
+    out.reserve( name.size() );
+    for(char c: name) {
+        if      ( c == '\\' ) out += "\\\\";
+        else if ( c == '\t' ) out += "\\t";
+        else if ( c == '\n' ) out += "\\n";
+        else out += c;
+    }
+    return out;
+}
+
+static std::string unescape(const std::string& field)
+{
+    std::string out;
+    out.reserve( field.size() );
+    for(size_t i=0; i<field.size(); i++) {
+        if ( field[i] != '\\' || i + 1 == field.size() ) { out += field[i]; continue; }
+        char c = field[++i];
+        out += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+    }
+    return out;
+}
+
+static std::vector<std::string> splitTabs(const std::string& line)
+{
+    std::vector<std::string> fields;
+    size_t start = 0;
+    while ( 1 ) {
+        size_t tab = line.find( '\t', start );
+        fields.push_back( line.substr( start, tab == std::string::npos ? std::string::npos : tab - start ) );
+        if ( tab == std::string::npos ) return fields;
+        start = tab + 1;
+    }
+}
+
+static bool toNumber(const std::string& field, long long& value)
+{
+    char *end;
+    errno = 0;
+    value = strtoll( field.c_str(), &end, 10 );
+    return !errno && !field.empty() && !*end;
+}
+
+static long long mtimeOf(const struct stat& statbuf)
+{
+    return statbuf.st_mtim.tv_sec * 1000000000ll + statbuf.st_mtim.tv_nsec;
+}
+
+Journal::~Journal()
+{
+    // A run that failed keeps its journal; what it got done is resumable
+    flush();
+    if ( fd != -1 ) close( fd );
+}
+
+int Journal::open(const std::string& _path, const std::string& source, const std::string& _target, bool resume)
+{
+    path   = _path;
+    target = _target;
+    files.clear();
+    dirs.clear();
+    pending.clear();
+
+    // Locked before anything is read or cleaned: two runs on the same target would
+    // remove each other's temporary files, and truncate each other's records. A journal
+    // removed by the run that held it is not the one at 'path' any more; the lock is
+    // taken again on whatever is there now.
+    if ( fd != -1 ) close( fd );
+    while ( 1 ) {
+        fd = ::open( path.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600 );
+        if ( fd == -1 ) return errno;
+        struct stat locked, current;
+        if ( flock( fd, LOCK_EX | LOCK_NB ) || fstat( fd, &locked ) ) {
+            int err = errno;
+            close( fd );
+            fd = -1;
+            return err;
+        }
+        if ( !stat( path.c_str(), &current ) && current.st_ino == locked.st_ino && current.st_dev == locked.st_dev ) break;
+        close( fd );
+    }
+
+    // Whatever the previous run left: a line cut short by the kill just does not parse
+    bool                     samePair = false, first = true;
+    std::vector<std::string> temps;
+    std::ifstream            in( path );
+    std::string              line;
+    while ( std::getline( in, line ) ) {
+        std::vector<std::string> f = splitTabs( line );
+        long long size, mtime;
+        if ( first ) {
+            samePair = f.size() == 3 && f[0] == "copyDir-journal 1" && unescape( f[1] ) == source && unescape( f[2] ) == target;
+            first = false;
+        }
+        else if ( f.size() == 2 && f[0] == "S" ) temps.push_back( unescape( f[1] ) );
+        else if ( f.size() == 4 && f[0] == "F" && toNumber( f[2], size ) && toNumber( f[3], mtime ) )
+            files[unescape( f[1] )] = std::make_pair( (unsigned long) size, mtime );
+        else if ( f.size() == 3 && f[0] == "D" && toNumber( f[2], mtime ) )
+            dirs[unescape( f[1] )] = mtime;
+    }
+    in.close();
+
+    // Copies that never got renamed into place; a finished one has no temporary left
+    for(const std::string& tmp: temps) {
+        if ( !unlink( tmp.c_str() ) ) cleaned++;
+    }
+
+    bool appending = resume && samePair;
+    if ( !appending ) {
+        files.clear();
+        dirs.clear();
+    }
+
+    // Appending starts on a line of its own, in case the last one was cut short
+    std::string header = appending ? "\n" : "copyDir-journal 1\t" + escape( source ) + "\t" + escape( target ) + "\n";
+    if ( (!appending && ftruncate( fd, 0 )) ||
+         write( fd, header.data(), header.size() ) != (ssize_t) header.size() ) {
+        int err = errno ? errno : EIO;
+        close( fd );
+        fd = -1;
+        return err;
+    }
+    return 0;
+}
+
+bool Journal::fileDone(const std::string& srcFilepath, unsigned long size, long long mtimeNs) const
+{
+    auto it = files.find( srcFilepath );
+    return it != files.end() && it->second.first == size && it->second.second == mtimeNs;
+}
+
+bool Journal::dirDone(const std::string& srcDir, long long mtimeNs) const
+{
+    auto it = dirs.find( srcDir );
+    return it != dirs.end() && it->second == mtimeNs;
+}
+
+void Journal::append(char type, const std::string& name, const std::string& fields)
+{
+    std::string line = std::string( 1, type ) + "\t" + escape( name ) + fields + "\n";
+
+    // Done with records wait for the next flush; see there
+    if ( type != 'S' ) {
+        {
+            std::lock_guard<std::mutex> lock( mutex );
+            pending += line;
+        }
+        flush( false );
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock( mutex );
+    if ( fd == -1 ) return;
+    // One write() per record; O_APPEND keeps them whole even with other writers around.
+    // A journal that cannot be written just means less to resume, not a failed run.
+    ssize_t w = write( fd, line.data(), line.size() );
+    (void) w;
+}
+
+void Journal::copyStarted(const std::string& tmpFilepath)
+{
+    append( 'S', tmpFilepath, "" );
+}
+
+void Journal::recordFile(const std::string& srcFilepath)
+{
+    struct stat statbuf;
+    if ( stat( srcFilepath.c_str(), &statbuf ) ) return;
+    append( 'F', srcFilepath, "\t" + std::to_string( statbuf.st_size ) + "\t" + std::to_string( mtimeOf( statbuf ) ) );
+}
+
+void Journal::recordDir(const std::string& srcDir)
+{
+    struct stat statbuf;
+    if ( stat( srcDir.c_str(), &statbuf ) ) return;
+    append( 'D', srcDir, "\t" + std::to_string( mtimeOf( statbuf ) ) );
+}
+
+void Journal::flush(bool now)
+{
+    // One at a time, so that records reach the file in the order they were made
+    std::lock_guard<std::mutex> flushLock( flushMutex );
+
+    std::string lines;
+    {
+        long long nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              std::chrono::steady_clock::now().time_since_epoch() ).count();
+        std::lock_guard<std::mutex> lock( mutex );
+        if ( fd == -1 || pending.empty() || (!now && nowNs - lastSyncNs < 1000000000ll) ) return;
+        lines.swap( pending );
+        lastSyncNs = nowNs;
+    }
+
+    // A record says a target file is in place, and resume takes its word for it: the
+    // file has to be on disk before the record is, data and name. A sync per file would
+    // cost more than it saves on trees of small ones; a sync of the target filesystem
+    // covers all the files done with since the last one, a second apart at most.
+    // (Target subdirs mounted from elsewhere are not covered.)
+    int fdTarget = ::open( target.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+    if ( fdTarget == -1 || syncfs( fdTarget ) ) sync();
+    if ( fdTarget != -1 ) close( fdTarget );
+
+    for(size_t written = 0; written < lines.size(); ) {
+        ssize_t w = write( fd, lines.data() + written, lines.size() - written );
+        if ( w == -1 ) { if ( errno == EINTR ) continue; return; }
+        written += w;
+    }
+    fdatasync( fd );
+}
+void Journal::finish()
+{
+    std::lock_guard<std::mutex> flushLock( flushMutex );
+    std::lock_guard<std::mutex> lock( mutex );
+    pending.clear();
+    if ( fd == -1 ) return;
+    unlink( path.c_str() );         // still locked, so no run opens it meanwhile
+    close( fd );
+    fd = -1;
+}
+
+std::string Journal::pathFor(const std::string& root, const std::string& cacheDir)
+{
+    std::string cachePath = DigestCache::pathFor( root, cacheDir );
+    const std::string suffix = ".digests";
+    if ( cachePath.size() < suffix.size() ) return "";
+    return cachePath.substr( 0, cachePath.size() - suffix.size() ) + ".journal";
+}
@@ -0,0 +1,81 @@
+#ifndef __COPYDIR_JOURNAL_H__
+#define __COPYDIR_JOURNAL_H__
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*!
+  * @brief Write-ahead journal of a run, so that a killed one can be resumed.
+  *
+  * A text file next to the digest cache, one record per line. Records: copies about to
+  * start (their temporary file), source files done with (copied, or found in the
+  * target), and source directories done with, all their files included. Copies started
+  * are written with a single write() as they happen. The others are held back, and
+  * written and synced at most a second apart, right after the target is synced: a
+  * record of a file done with is never on disk before the file is. A kill loses what was
+  * held back, to be done again on resume. A run that ends well removes its journal. It
+  * is locked while open, as the digest cache is: a second run on the same target gets
+  * none, and is not to start.
+  *
+  * Deltas (deltaUpdate.h) are the exception to copies going through a temporary file:
+  * they are written in place, and have no 'started' record. A killed one leaves its file
+  * half updated, with no record that it is done, so the next run compares it again and
+  * updates it again. Its done record is only made once it is synced to disk.
+  *
+  * Opening it always cleans up after a previous run: temporary files of copies that
+  * never finished are removed. With 'resume', the files and directories that run got
+  * done are also loaded, to be skipped, as long as they did not change since: size and
+  * mtime for files, mtime for directories (it changes as entries come and go).
+  */
+class Journal {
+public:
+    Journal() : cleaned(0), fd(-1), lastSyncNs(0) {}
+    ~Journal();
+
+    /*!
+      * @brief Opens the journal of a source and target pair, starting a new one unless
+      *        resuming the previous run of that same pair.
+      * @return 0 on success, errno otherwise; EWOULDBLOCK while another run has it
+      */
+    int open(const std::string& path, const std::string& source, const std::string& target, bool resume);
+
+    // Done with in the resumed run, and unchanged since
+    bool fileDone(const std::string& srcFilepath, unsigned long size, long long mtimeNs) const;
+    bool dirDone(const std::string& srcDir, long long mtimeNs) const;
+
+    // Thread safe; the file and dir records stat their source for its current size and mtime
+    void copyStarted(const std::string& tmpFilepath);
+    void recordFile(const std::string& srcFilepath);
+    void recordDir(const std::string& srcDir);
+
+    // Syncs the target, then writes and syncs the records held back; unless 'now', only
+    // once the last time is a second old
+    void flush(bool now = true);
+
+    // The run went well: nothing to resume, the journal is removed
+    void finish();
+
+    // Where the journal for a target root lives: next to its digest cache
+    static std::string pathFor(const std::string& root, const std::string& cacheDir);
+
+    unsigned long resumableFiles() const { return files.size(); }
+    unsigned long resumableDirs()  const { return dirs.size(); }
+    unsigned long cleaned;                          // temporary files removed on open
+
+private:
+    int         fd;
+    std::string path;
+    std::string target;
+    std::string pending;                            // records held back, see flush()
+    std::mutex  mutex;
+    std::mutex  flushMutex;
+    long long   lastSyncNs;                         // syncs come a second apart at most
+
+    std::unordered_map<std::string, std::pair<unsigned long, long long>> files;    // size, mtime
+    std::unordered_map<std::string, long long>                           dirs;     // mtime
+
+    void append(char type, const std::string& name, const std::string& fields);
+};
+
+#endif
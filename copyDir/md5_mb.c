@@ -0,0 +1,307 @@
+/*
+ * Multi-buffer MD5 on AVX2; see md5_mb.h.
+ *
+ * This is the same algorithm as body() in md5.c, step by step and constant by constant,
+ * with each 32-bit variable widened to a vector of 8 lanes: lane i holds the state of
+ * stream i. The message words of the 8 blocks are transposed so that vector X[j] holds
+ * word j of every lane's block.
+ *
+ * AVX2 code is enabled per function (target attribute) rather than with -mavx2 for the
+ * whole build, so the binary still runs on CPUs without it; callers check
+ * MD5x8_Available() first.
+ */
+
+#include <string.h>
+
+#include <immintrin.h>
+
+#include "md5_mb.h"
+
+#define AVX2_FUNC __attribute__((target("avx2")))
+
+/*
+ * The basic MD5 functions, same shapes as in md5.c.
+ */
+#define F(x, y, z)	_mm256_xor_si256((z), _mm256_and_si256((x), _mm256_xor_si256((y), (z))))
+#define G(x, y, z)	_mm256_xor_si256((y), _mm256_and_si256((z), _mm256_xor_si256((x), (y))))
+#define H(x, y, z)	_mm256_xor_si256(_mm256_xor_si256((x), (y)), (z))
+#define I(x, y, z)	_mm256_xor_si256((y), _mm256_or_si256((x), _mm256_xor_si256((z), ones)))
+
+#define ROTL(v, s) \
+	_mm256_or_si256(_mm256_slli_epi32((v), (s)), _mm256_srli_epi32((v), 32 - (s)))
+
+#define STEP(f, a, b, c, d, x, t, s) \
+	(a) = _mm256_add_epi32((a), _mm256_add_epi32(f((b), (c), (d)), \
+		_mm256_add_epi32((x), _mm256_set1_epi32((int)(t))))); \
+	(a) = ROTL((a), (s)); \
+	(a) = _mm256_add_epi32((a), (b));
+
+/*
+ * 8x8 transpose of 32-bit words: on input r[i] holds 8 words of lane i, on output
+ * r[j] holds word j of every lane.
+ */
+static inline AVX2_FUNC void transpose8(__m256i r[8])
+{
+	__m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+	__m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+	__m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+	__m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+	__m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+	__m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+	__m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+	__m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+	__m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+	__m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+	__m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+	__m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+	__m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+	__m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+	__m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+	__m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+	r[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+	r[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+	r[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+	r[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+	r[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+	r[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+	r[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+	r[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+}
+
+/*
+ * This processes 'blocks' 64-byte blocks of each lane, but does NOT update the bit
+ * counters. There are no alignment requirements. Pointers are advanced past the data.
+ */
+static AVX2_FUNC void body8(MD5x8_CTX *ctx, const unsigned char *ptr[MD5X8_LANES],
+	unsigned long blocks)
+{
+	const __m256i ones = _mm256_set1_epi32(-1);
+	__m256i a, b, c, d;
+	__m256i saved_a, saved_b, saved_c, saved_d;
+	__m256i X[16];
+	int lane;
+
+	a = _mm256_loadu_si256((const __m256i *)ctx->a);
+	b = _mm256_loadu_si256((const __m256i *)ctx->b);
+	c = _mm256_loadu_si256((const __m256i *)ctx->c);
+	d = _mm256_loadu_si256((const __m256i *)ctx->d);
+
+	while (blocks--) {
+		for (lane = 0; lane < MD5X8_LANES; lane++) {
+			X[lane] = _mm256_loadu_si256((const __m256i *)ptr[lane]);
+			X[lane + 8] = _mm256_loadu_si256((const __m256i *)(ptr[lane] + 32));
+			ptr[lane] += 64;
+		}
+		transpose8(&X[0]);
+		transpose8(&X[8]);
+
+		saved_a = a;
+		saved_b = b;
+		saved_c = c;
+		saved_d = d;
+
+/* Round 1 */
+		STEP(F, a, b, c, d, X[0], 0xd76aa478, 7)
+		STEP(F, d, a, b, c, X[1], 0xe8c7b756, 12)
+		STEP(F, c, d, a, b, X[2], 0x242070db, 17)
+		STEP(F, b, c, d, a, X[3], 0xc1bdceee, 22)
+		STEP(F, a, b, c, d, X[4], 0xf57c0faf, 7)
+		STEP(F, d, a, b, c, X[5], 0x4787c62a, 12)
+		STEP(F, c, d, a, b, X[6], 0xa8304613, 17)
+		STEP(F, b, c, d, a, X[7], 0xfd469501, 22)
+		STEP(F, a, b, c, d, X[8], 0x698098d8, 7)
+		STEP(F, d, a, b, c, X[9], 0x8b44f7af, 12)
+		STEP(F, c, d, a, b, X[10], 0xffff5bb1, 17)
+		STEP(F, b, c, d, a, X[11], 0x895cd7be, 22)
+		STEP(F, a, b, c, d, X[12], 0x6b901122, 7)
+		STEP(F, d, a, b, c, X[13], 0xfd987193, 12)
+		STEP(F, c, d, a, b, X[14], 0xa679438e, 17)
+		STEP(F, b, c, d, a, X[15], 0x49b40821, 22)
+
+/* Round 2 */
+		STEP(G, a, b, c, d, X[1], 0xf61e2562, 5)
+		STEP(G, d, a, b, c, X[6], 0xc040b340, 9)
+		STEP(G, c, d, a, b, X[11], 0x265e5a51, 14)
+		STEP(G, b, c, d, a, X[0], 0xe9b6c7aa, 20)
+		STEP(G, a, b, c, d, X[5], 0xd62f105d, 5)
+		STEP(G, d, a, b, c, X[10], 0x02441453, 9)
+		STEP(G, c, d, a, b, X[15], 0xd8a1e681, 14)
+		STEP(G, b, c, d, a, X[4], 0xe7d3fbc8, 20)
+		STEP(G, a, b, c, d, X[9], 0x21e1cde6, 5)
+		STEP(G, d, a, b, c, X[14], 0xc33707d6, 9)
+		STEP(G, c, d, a, b, X[3], 0xf4d50d87, 14)
+		STEP(G, b, c, d, a, X[8], 0x455a14ed, 20)
+		STEP(G, a, b, c, d, X[13], 0xa9e3e905, 5)
+		STEP(G, d, a, b, c, X[2], 0xfcefa3f8, 9)
+		STEP(G, c, d, a, b, X[7], 0x676f02d9, 14)
+		STEP(G, b, c, d, a, X[12], 0x8d2a4c8a, 20)
+
+/* Round 3 */
+		STEP(H, a, b, c, d, X[5], 0xfffa3942, 4)
+		STEP(H, d, a, b, c, X[8], 0x8771f681, 11)
+		STEP(H, c, d, a, b, X[11], 0x6d9d6122, 16)
+		STEP(H, b, c, d, a, X[14], 0xfde5380c, 23)
+		STEP(H, a, b, c, d, X[1], 0xa4beea44, 4)
+		STEP(H, d, a, b, c, X[4], 0x4bdecfa9, 11)
+		STEP(H, c, d, a, b, X[7], 0xf6bb4b60, 16)
+		STEP(H, b, c, d, a, X[10], 0xbebfbc70, 23)
+		STEP(H, a, b, c, d, X[13], 0x289b7ec6, 4)
+		STEP(H, d, a, b, c, X[0], 0xeaa127fa, 11)
+		STEP(H, c, d, a, b, X[3], 0xd4ef3085, 16)
+		STEP(H, b, c, d, a, X[6], 0x04881d05, 23)
+		STEP(H, a, b, c, d, X[9], 0xd9d4d039, 4)
+		STEP(H, d, a, b, c, X[12], 0xe6db99e5, 11)
+		STEP(H, c, d, a, b, X[15], 0x1fa27cf8, 16)
+		STEP(H, b, c, d, a, X[2], 0xc4ac5665, 23)
+
+/* Round 4 */
+		STEP(I, a, b, c, d, X[0], 0xf4292244, 6)
+		STEP(I, d, a, b, c, X[7], 0x432aff97, 10)
+		STEP(I, c, d, a, b, X[14], 0xab9423a7, 15)
+		STEP(I, b, c, d, a, X[5], 0xfc93a039, 21)
+		STEP(I, a, b, c, d, X[12], 0x655b59c3, 6)
+		STEP(I, d, a, b, c, X[3], 0x8f0ccc92, 10)
+		STEP(I, c, d, a, b, X[10], 0xffeff47d, 15)
+		STEP(I, b, c, d, a, X[1], 0x85845dd1, 21)
+		STEP(I, a, b, c, d, X[8], 0x6fa87e4f, 6)
+		STEP(I, d, a, b, c, X[15], 0xfe2ce6e0, 10)
+		STEP(I, c, d, a, b, X[6], 0xa3014314, 15)
+		STEP(I, b, c, d, a, X[13], 0x4e0811a1, 21)
+		STEP(I, a, b, c, d, X[4], 0xf7537e82, 6)
+		STEP(I, d, a, b, c, X[11], 0xbd3af235, 10)
+		STEP(I, c, d, a, b, X[2], 0x2ad7d2bb, 15)
+		STEP(I, b, c, d, a, X[9], 0xeb86d391, 21)
+
+		a = _mm256_add_epi32(a, saved_a);
+		b = _mm256_add_epi32(b, saved_b);
+		c = _mm256_add_epi32(c, saved_c);
+		d = _mm256_add_epi32(d, saved_d);
+	}
+
+	_mm256_storeu_si256((__m256i *)ctx->a, a);
+	_mm256_storeu_si256((__m256i *)ctx->b, b);
+	_mm256_storeu_si256((__m256i *)ctx->c, c);
+	_mm256_storeu_si256((__m256i *)ctx->d, d);
+}
+
+int MD5x8_Available(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+void MD5x8_Init(MD5x8_CTX *ctx)
+{
+	int lane;
+
+	for (lane = 0; lane < MD5X8_LANES; lane++) {
+		ctx->a[lane] = 0x67452301;
+		ctx->b[lane] = 0xefcdab89;
+		ctx->c[lane] = 0x98badcfe;
+		ctx->d[lane] = 0x10325476;
+	}
+
+	ctx->lo = 0;
+	ctx->hi = 0;
+}
+
+/* Runs body8 on the per-lane 64-byte buffers */
+static void body8_buffers(MD5x8_CTX *ctx)
+{
+	const unsigned char *ptr[MD5X8_LANES];
+	int lane;
+
+	for (lane = 0; lane < MD5X8_LANES; lane++)
+		ptr[lane] = ctx->buffer[lane];
+	body8(ctx, ptr, 1);
+}
+
+void MD5x8_Update(MD5x8_CTX *ctx, const void *data[MD5X8_LANES], unsigned long size)
+{
+	const unsigned char *ptr[MD5X8_LANES];
+	MD5_u32plus saved_lo;
+	unsigned long used, available;
+	int lane;
+
+	for (lane = 0; lane < MD5X8_LANES; lane++)
+		ptr[lane] = (const unsigned char *)data[lane];
+
+	saved_lo = ctx->lo;
+	if ((ctx->lo = (saved_lo + size) & 0x1fffffff) < saved_lo)
+		ctx->hi++;
+	ctx->hi += size >> 29;
+
+	used = saved_lo & 0x3f;
+
+	if (used) {
+		available = 64 - used;
+
+		if (size < available) {
+			for (lane = 0; lane < MD5X8_LANES; lane++)
+				memcpy(&ctx->buffer[lane][used], ptr[lane], size);
+			return;
+		}
+
+		for (lane = 0; lane < MD5X8_LANES; lane++) {
+			memcpy(&ctx->buffer[lane][used], ptr[lane], available);
+			ptr[lane] += available;
+		}
+		size -= available;
+		body8_buffers(ctx);
+	}
+
+	if (size >= 64) {
+		body8(ctx, ptr, size >> 6);
+		size &= 0x3f;
+	}
+
+	for (lane = 0; lane < MD5X8_LANES; lane++)
+		memcpy(ctx->buffer[lane], ptr[lane], size);
+}
+
+#define OUT(dst, src) \
+	(dst)[0] = (unsigned char)(src); \
+	(dst)[1] = (unsigned char)((src) >> 8); \
+	(dst)[2] = (unsigned char)((src) >> 16); \
+	(dst)[3] = (unsigned char)((src) >> 24);
+
+void MD5x8_Final(unsigned char result[MD5X8_LANES][16], MD5x8_CTX *ctx)
+{
+	unsigned long used, available;
+	int lane;
+
+	used = ctx->lo & 0x3f;
+
+	for (lane = 0; lane < MD5X8_LANES; lane++)
+		ctx->buffer[lane][used] = 0x80;
+	used++;
+
+	available = 64 - used;
+
+	if (available < 8) {
+		for (lane = 0; lane < MD5X8_LANES; lane++)
+			memset(&ctx->buffer[lane][used], 0, available);
+		body8_buffers(ctx);
+		used = 0;
+		available = 64;
+	}
+
+	ctx->lo <<= 3;
+	for (lane = 0; lane < MD5X8_LANES; lane++) {
+		memset(&ctx->buffer[lane][used], 0, available - 8);
+		OUT(&ctx->buffer[lane][56], ctx->lo)
+		OUT(&ctx->buffer[lane][60], ctx->hi)
+	}
+
+	body8_buffers(ctx);
+
+	for (lane = 0; lane < MD5X8_LANES; lane++) {
+		OUT(&result[lane][0], ctx->a[lane])
+		OUT(&result[lane][4], ctx->b[lane])
+		OUT(&result[lane][8], ctx->c[lane])
+		OUT(&result[lane][12], ctx->d[lane])
+	}
+
+	memset(ctx, 0, sizeof(*ctx));
+}
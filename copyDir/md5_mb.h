@@ -0,0 +1,39 @@
+/*
+ * Multi-buffer MD5: 8 independent MD5 streams advanced in lockstep, one per 32-bit
+ * lane of an AVX2 register. Same digests as md5.c, just 8 at a time.
+ *
+ * The API mirrors MD5_Init/MD5_Update/MD5_Final, but every call takes 8 buffers of
+ * the very same length. That fits nicely with copyDir, where the files to be hashed
+ * come in groups of equal size anyway.
+ */
+
+#ifndef _MD5_MB_H
+#define _MD5_MB_H
+
+#include "md5.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MD5X8_LANES 8
+
+typedef struct {
+	MD5_u32plus lo, hi;			/* shared; all lanes hold the same length */
+	MD5_u32plus a[MD5X8_LANES], b[MD5X8_LANES], c[MD5X8_LANES], d[MD5X8_LANES];
+	unsigned char buffer[MD5X8_LANES][64];
+} MD5x8_CTX;
+
+/* Non-zero if the CPU runs the AVX2 kernel; the other calls must not be used otherwise */
+extern int MD5x8_Available(void);
+
+extern void MD5x8_Init(MD5x8_CTX *ctx);
+/* Feeds 'size' bytes to each lane; data[i] goes to lane i. Lanes may share a buffer. */
+extern void MD5x8_Update(MD5x8_CTX *ctx, const void *data[MD5X8_LANES], unsigned long size);
+extern void MD5x8_Final(unsigned char result[MD5X8_LANES][16], MD5x8_CTX *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
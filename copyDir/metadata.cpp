@@ -0,0 +1,76 @@
+#include "metadata.h"
+
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+static bool preserve = false;
+
+void setPreserveMetadata(bool _preserve)
+{
+    preserve = _preserve;
+}
+
+bool preserveMetadata()
+{
+    return preserve;
+}
+
+// What copying an attribute may run into that cp -p lets go
+static bool notForUs(int err)
+{
+    return err == EPERM || err == EACCES || err == ENOTSUP || err == EOPNOTSUPP;
+}
+
+static int copyXattrs(int fdIn, int fdOut)
+{
+    // Most files have none: a single call then
+    ssize_t len = flistxattr( fdIn, NULL, 0 );
+    if ( len == -1 ) return notForUs( errno ) ? 0 : errno;
+    if ( !len ) return 0;
+
+    std::vector<char> names( len ), value;
+    len = flistxattr( fdIn, names.data(), names.size() );
+    if ( len == -1 ) return errno;
+
+    for(ssize_t pos = 0; pos < len; pos += strlen( &names[pos] ) + 1) {
+        const char *name = &names[pos];
+        ssize_t size = fgetxattr( fdIn, name, NULL, 0 );
+        if ( size > 0 ) {
+            value.resize( size );
+            size = fgetxattr( fdIn, name, value.data(), value.size() );
+        }
+        if ( size == -1 ) {
+            if ( errno == ENODATA || notForUs( errno ) ) continue;     // gone meanwhile, or not readable
+            return errno;
+        }
+        if ( fsetxattr( fdOut, name, value.data(), size, 0 ) && !notForUs( errno ) ) return errno;
+    }
+    return 0;
+}
+
+int copyMetadata(int fdIn, int fdOut)
+{
+    struct stat statbuf;
+    if ( fstat( fdIn, &statbuf ) ) return errno;
+
+    mode_t mode = statbuf.st_mode & 07777;
+    if ( fchown( fdOut, statbuf.st_uid, statbuf.st_gid ) ) {
+        if ( errno != EPERM ) return errno;
+        // Ours then; the group at least, if we are in it. Set-id bits would now stand for
+        // somebody else than meant.
+        if ( fchown( fdOut, -1, statbuf.st_gid ) ) mode &= ~S_ISGID;
+        mode &= ~S_ISUID;
+    }
+    if ( fchmod( fdOut, mode ) ) return errno;
+
+    int err = copyXattrs( fdIn, fdOut );
+    if ( err ) return err;
+
+    struct timespec times[2] = { statbuf.st_atim, statbuf.st_mtim };
+    return futimens( fdOut, times ) ? errno : 0;
+}
@@ -0,0 +1,23 @@
+#ifndef __COPYDIR_METADATA_H__
+#define __COPYDIR_METADATA_H__
+
+// Whether copies get the mode, ownership, times and extended attributes of their source.
+// Process wide, set once from the options; off by default, as it always was: copies get
+// whatever a new file gets.
+void setPreserveMetadata(bool preserve);
+bool preserveMetadata();
+
+/*!
+  * @brief Gives 'fdOut' the metadata of 'fdIn': owner and group, mode, extended
+  *        attributes (ACLs included), then access and modification times; in that order,
+  *        so that none undoes another. Descriptors only, no path looked up again; files
+  *        and directories alike.
+  * @return 0 on success, errno otherwise. Not being allowed to give a file away (not
+  *         root), to set some namespace of attributes (trusted.*, security.*), or a
+  *         filesystem with no attributes at all, is no failure: cp -p does not complain
+  *         either. Set-id bits are dropped along with an ownership that could not be kept.
+  * @remark to be called once the contents are all written, or the times would not stay
+  */
+int copyMetadata(int fdIn, int fdOut);
+
+#endif
@@ -0,0 +1,191 @@
+#include "metrics.h"
+
+#include <errno.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+// Bucket b holds latencies in [2^(b-1), 2^b) ns, bucket 0 just 0 ns; the last one is
+// about 78 hours and takes anything beyond, too
+static const int histBuckets = 49;
+
+// Written by the single thread owning the block, read by anybody; relaxed is plenty
+struct StageCounters {
+    std::atomic<unsigned long long> calls;
+    std::atomic<unsigned long long> items;
+    std::atomic<unsigned long long> bytes;
+    std::atomic<unsigned long long> ns;
+    std::atomic<unsigned long long> maxNs;
+    std::atomic<unsigned long long> hist[histBuckets];
+};
+
+struct alignas(64) ThreadMetrics {
+    StageCounters stages[STAGES];
+};
+
+// Blocks are never freed: a thread that ends hands its own over to the next one to start,
+// counts and all, and the hashing stages start short lived threads per directory. Leaked
+// on purpose, so that the last thread_local destructors still find it at exit.
+struct Registry {
+    std::mutex                                  mutex;
+    std::vector<std::unique_ptr<ThreadMetrics>> blocks;
+    std::vector<ThreadMetrics *>                unused;
+};
+static Registry& registry = *new Registry;
+
+struct BlockOwner {
+    ThreadMetrics *block;
+
+    BlockOwner() : block(NULL) {}
+    ~BlockOwner() {
+        if ( !block ) return;
+        std::lock_guard<std::mutex> lock( registry.mutex );
+        registry.unused.push_back( block );
+    }
+};
+static thread_local BlockOwner owner;
+
+static ThreadMetrics& ownBlock()
+{
+    if ( owner.block ) return *owner.block;
+
+    std::lock_guard<std::mutex> lock( registry.mutex );
+    if ( !registry.unused.empty() ) {
+        owner.block = registry.unused.back();
+        registry.unused.pop_back();
+    }
+    else {
+        registry.blocks.emplace_back( new ThreadMetrics() );
+        owner.block = registry.blocks.back().get();
+    }
+    return *owner.block;
+}
+
+static inline void bump(std::atomic<unsigned long long>& counter, unsigned long long n)
+{
+    counter.store( counter.load( std::memory_order_relaxed ) + n, std::memory_order_relaxed );
+}
+
+const char *stageName(Stage stage)
+{
+    switch ( stage ) {
+        case STAGE_SCAN:   return "scan";
+        case STAGE_STAT:   return "stat";
+        case STAGE_INDEX:  return "index";
+        case STAGE_SAMPLE: return "sample";
+        case STAGE_HASH:   return "hash";
+        case STAGE_COPY:   return "copy";
+        case STAGE_MKDIR:  return "mkdir";
+        case STAGE_CACHE:  return "cache";
+        case STAGE_CHUNK:  return "chunk";
+        default:           return "?";
+    }
+}
+
+void metricsRecord(Stage stage, unsigned long long ns, unsigned long long bytes, unsigned long long items)
+{
+    StageCounters& c = ownBlock().stages[stage];
+
+    int bucket = ns ? 64 - __builtin_clzll( ns ) : 0;
+    if ( bucket >= histBuckets ) bucket = histBuckets - 1;
+
+    bump( c.calls, 1 );
+    bump( c.items, items );
+    bump( c.bytes, bytes );
+    bump( c.ns, ns );
+    bump( c.hist[bucket], 1 );
+    if ( ns > c.maxNs.load( std::memory_order_relaxed ) ) c.maxNs.store( ns, std::memory_order_relaxed );
+}
+
+// All the blocks added up, histogram included
+struct StageSummary : StageTotals {
+    unsigned long long maxNs;
+    unsigned long long hist[histBuckets];
+};
+
+static StageSummary summarize(Stage stage)
+{
+    StageSummary s = StageSummary();
+
+    std::lock_guard<std::mutex> lock( registry.mutex );
+    for(const std::unique_ptr<ThreadMetrics>& block: registry.blocks) {
+        const StageCounters& c = block->stages[stage];
+        s.calls += c.calls.load( std::memory_order_relaxed );
+        s.items += c.items.load( std::memory_order_relaxed );
+        s.bytes += c.bytes.load( std::memory_order_relaxed );
+        s.ns    += c.ns.load( std::memory_order_relaxed );
+        s.maxNs  = std::max( s.maxNs, c.maxNs.load( std::memory_order_relaxed ) );
+        for(int b=0; b<histBuckets; b++) s.hist[b] += c.hist[b].load( std::memory_order_relaxed );
+    }
+    return s;
+}
+
+StageTotals metricsTotals(Stage stage)
+{
+    return summarize( stage );
+}
+
+// Upper bound of the bucket holding the given fraction of the calls
+static unsigned long long percentileNs(const StageSummary& s, double fraction)
+{
+    unsigned long long rank = (unsigned long long) (fraction * s.calls), seen = 0;
+    for(int b=0; b<histBuckets; b++) {
+        seen += s.hist[b];
+        if ( seen > rank ) return 1ull << b;
+    }
+    return s.maxNs;
+}
+
+std::string metricsProgressLine(double elapsedSeconds)
+{
+    StageTotals scan = metricsTotals( STAGE_SCAN ), hash = metricsTotals( STAGE_HASH );
+    StageTotals sample = metricsTotals( STAGE_SAMPLE ), copy = metricsTotals( STAGE_COPY );
+
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1) << "progress " << elapsedSeconds << " s: "
+         << scan.items << " entries scanned, " << sample.items << " files sampled, "
+         << hash.items << " hashed (" << hash.bytes / 1e6 << " MB), "
+         << copy.items << " copied (" << copy.bytes / 1e6 << " MB)";
+    return line.str();
+}
+
+int metricsWriteJson(const std::string& path, double wallSeconds)
+{
+    std::ofstream out( path );
+    if ( !out ) return errno ? errno : EIO;
+
+    out << "{" << std::endl << "  \"wallSeconds\": " << wallSeconds << "," << std::endl
+        << "  \"stages\": {";
+
+    for(int st=0; st<STAGES; st++) {
+        StageSummary s = summarize( (Stage) st );
+
+        out << (st ? "," : "") << std::endl
+            << "    \"" << stageName( (Stage) st ) << "\": { \"calls\": " << s.calls << ", \"items\": " << s.items
+            << ", \"bytes\": " << s.bytes << ", \"seconds\": " << s.ns / 1e9 << "," << std::endl
+            << "      \"p50Ns\": " << (s.calls ? percentileNs( s, 0.50 ) : 0)
+            << ", \"p90Ns\": " << (s.calls ? percentileNs( s, 0.90 ) : 0)
+            << ", \"p99Ns\": " << (s.calls ? percentileNs( s, 0.99 ) : 0)
+            << ", \"maxNs\": " << s.maxNs << "," << std::endl
+            << "      \"histogram\": [";
+
+        bool first = true;
+        for(int b=0; b<histBuckets; b++) {
+            if ( !s.hist[b] ) continue;
+            out << (first ? "" : ", ") << "{ \"belowNs\": " << (1ull << b) << ", \"calls\": " << s.hist[b] << " }";
+            first = false;
+        }
+        out << "] }";
+    }
+
+    out << std::endl << "  }" << std::endl << "}" << std::endl;
+
+    out.flush();
+    return out ? 0 : EIO;
+}
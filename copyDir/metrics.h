@@ -0,0 +1,71 @@
+#ifndef __COPYDIR_METRICS_H__
+#define __COPYDIR_METRICS_H__
+
+#include <chrono>
+#include <string>
+
+// Where the time goes; each one is timed per call (per file, per dir, per syscall...)
+enum Stage {
+    STAGE_SCAN,                 // getdents64 calls
+    STAGE_STAT,                 // statx/fstatat of every entry
+    STAGE_INDEX,                // size index builds
+    STAGE_SAMPLE,               // head and tail samples, the prefilter before full digests
+    STAGE_HASH,                 // full digests, verification included
+    STAGE_COPY,                 // file copies, hashing on the way included
+    STAGE_MKDIR,                // target dirs created
+    STAGE_CACHE,                // digest cache loads and saves
+    STAGE_CHUNK,                // target files chunked for --chunk-dedup
+    STAGES
+};
+
+const char *stageName(Stage stage);
+
+/*!
+  * @brief Adds one call of a stage: its latency, and the bytes and items it went through.
+  *
+  * Cheap enough for every statx: each thread has a block of counters of its own, so no
+  * two threads ever write the same cache line, and readers just add the blocks up.
+  * Latencies go to a histogram of power of 2 buckets, from 1 ns to hours.
+  */
+void metricsRecord(Stage stage, unsigned long long ns, unsigned long long bytes = 0, unsigned long long items = 1);
+
+// Times a scope into a stage; bytes and items can be told on the way
+class StageTimer {
+public:
+    explicit StageTimer(Stage _stage) : stage(_stage), bytes(0), items(1),
+                                        start( std::chrono::steady_clock::now() ) {}
+    ~StageTimer() {
+        metricsRecord( stage, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                  std::chrono::steady_clock::now() - start ).count(), bytes, items );
+    }
+
+    void addBytes(unsigned long long n) { bytes += n; }
+    void setItems(unsigned long long n) { items = n; }
+
+private:
+    Stage                                 stage;
+    unsigned long long                    bytes;
+    unsigned long long                    items;
+    std::chrono::steady_clock::time_point start;
+};
+
+// Totals so far of a stage, all threads added up; fine to call while they run
+struct StageTotals {
+    unsigned long long calls;
+    unsigned long long items;
+    unsigned long long bytes;
+    unsigned long long ns;      // summed over calls, so it may exceed the wall time
+};
+StageTotals metricsTotals(Stage stage);
+
+// One line with the files and bytes gone through so far, for periodic progress output
+std::string metricsProgressLine(double elapsedSeconds);
+
+/*!
+  * @brief Writes all the stages as a JSON object: calls, items, bytes, summed seconds,
+  *        latency percentiles and the non empty histogram buckets of each one.
+  * @return 0 on success, errno otherwise
+  */
+int metricsWriteJson(const std::string& path, double wallSeconds);
+
+#endif
@@ -0,0 +1,60 @@
+#include "pageCache.h"
+
+#include <fcntl.h>
+#include <strings.h>
+
+#include <initializer_list>
+
+static PageCache policy = PAGE_CACHE_KEEP;
+
+const char *pageCacheName(PageCache p)
+{
+    switch ( p ) {
+        case PAGE_CACHE_KEEP:   return "keep";
+        case PAGE_CACHE_DROP:   return "drop";
+        case PAGE_CACHE_DIRECT: return "direct";
+    }
+    return "?";
+}
+
+bool pageCacheFromName(const char *name, PageCache& p)
+{
+    for(PageCache c: {PAGE_CACHE_KEEP, PAGE_CACHE_DROP, PAGE_CACHE_DIRECT}) {
+        if ( !strcasecmp( name, pageCacheName( c ) ) ) { p = c; return true; }
+    }
+    return false;
+}
+
+void setPageCache(PageCache p)
+{
+    policy = p;
+}
+
+PageCache pageCache()
+{
+    return policy;
+}
+
+void DropBehind::advance(off_t done)
+{
+    if ( policy == PAGE_CACHE_KEEP || fd == -1 || done - started < window ) return;
+
+    if ( written ) {
+        sync_file_range( fd, started, done - started, SYNC_FILE_RANGE_WRITE );
+        sync_file_range( fd, dropped, started - dropped,
+                         SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER );
+    }
+    posix_fadvise( fd, dropped, started - dropped, POSIX_FADV_DONTNEED );
+    dropped = started;
+    started = done;
+}
+
+void DropBehind::finish()
+{
+    if ( policy == PAGE_CACHE_KEEP || fd == -1 ) return;
+
+    // A length of 0 means up to the end of the file
+    if ( written )
+        sync_file_range( fd, dropped, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER );
+    posix_fadvise( fd, dropped, 0, POSIX_FADV_DONTNEED );
+}
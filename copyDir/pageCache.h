@@ -0,0 +1,47 @@
+#ifndef __COPYDIR_PAGECACHE_H__
+#define __COPYDIR_PAGECACHE_H__
+
+#include <sys/types.h>
+
+// What a run leaves in the page cache, so that a big sync does not evict everybody else's
+enum PageCache {
+    PAGE_CACHE_KEEP,            // whatever the kernel does; fastest on a second run
+    PAGE_CACHE_DROP,            // files dropped from the cache behind the stream
+    PAGE_CACHE_DIRECT,          // O_DIRECT where possible; dropped behind elsewhere
+};
+
+const char *pageCacheName(PageCache policy);
+bool        pageCacheFromName(const char *name, PageCache& policy);
+
+// Process wide, set once from the options; PAGE_CACHE_KEEP by default
+void      setPageCache(PageCache policy);
+PageCache pageCache();
+
+// O_DIRECT wants buffers, offsets and lengths aligned to the logical block size; 4 KB
+// covers about every device
+#define DIRECT_ALIGN 4096
+
+/*!
+  * @brief Drops a file from the page cache as it is streamed, unless the policy keeps it.
+  *
+  * Told how far the stream got, it drops what is a window behind. Written pages cannot be
+  * dropped while dirty: a window gets its writeback started as it is passed, and waited
+  * for only one window later, so the writer seldom stalls on it.
+  */
+class DropBehind {
+public:
+    DropBehind(int _fd, bool _written) : fd(_fd), written(_written), started(0), dropped(0) {}
+
+    void advance(off_t done);   // the stream got to 'done', from offset 0
+    void finish();              // the stream is over; drops it all
+
+    static const off_t window = 8 << 20;
+
+private:
+    int   fd;
+    bool  written;
+    off_t started;              // writeback started up to here
+    off_t dropped;              // dropped up to here
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "plan.h"
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <fstream>
+#include <iostream>
+
+Plan& Plan::operator+=(const Plan& other)
+{
+    copies.insert( copies.end(), other.copies.begin(), other.copies.end() );
+    hashes.insert( hashes.end(), other.hashes.begin(), other.hashes.end() );
+    dirsToCreate += other.dirsToCreate;
+    sampledFiles += other.sampledFiles;
+    sampledBytes += other.sampledBytes;
+    return *this;
+}
+
+// Length of the UTF-8 sequence at 'i', 1 for ASCII; 0 if it is not one (stray, truncated,
+// overlong, a surrogate or past U+10FFFF)
+static size_t utf8Length(const std::string& s, size_t i)
+{
+    unsigned char c = s[i];
+    if ( c < 0x80 ) return 1;
+
+    size_t        len = c >= 0xc2 && c <= 0xdf ? 2 : c >= 0xe0 && c <= 0xef ? 3 : c >= 0xf0 && c <= 0xf4 ? 4 : 0;
+    unsigned char lo  = 0x80, hi = 0xbf;      // allowed for the second byte
+    if      ( c == 0xe0 ) lo = 0xa0;
+    else if ( c == 0xed ) hi = 0x9f;
+    else if ( c == 0xf0 ) lo = 0x90;
+    else if ( c == 0xf4 ) hi = 0x8f;
+    if ( !len || i + len > s.size() ) return 0;
+
+    for(size_t k=1; k<len; k++) {
+        unsigned char next = s[i + k];
+        if ( next < (k == 1 ? lo : 0x80) || next > (k == 1 ? hi : 0xbf) ) return 0;
+    }
+    return len;
+}
+
+std::string jsonString(const std::string& s)
+{
+    std::string out = "\"";
+    for(size_t i=0; i<s.size(); i++) {
+        unsigned char c = s[i];
+        size_t        len = utf8Length( s, i );
+        if      ( c == '"' || c == '\\' ) { out += '\\'; out += c; }
+        else if ( c < 0x20 || !len ) {
+            char esc[8];
+            snprintf( esc, sizeof(esc), "\\u%04x", c );
+            out += esc;
+        }
+        else { out.append( s, i, len ); i += len - 1; }
+    }
+    return out + "\"";
+}
+
+int Plan::write(const std::string& path, const std::string& source, const std::string& target,
+                const char *digestName, unsigned int sampleKB, bool treeDedup) const
+{
+    std::ofstream file;
+    if ( path != "-" ) {
+        file.open( path );
+        if ( !file ) return errno ? errno : EIO;
+    }
+    std::ostream& out = path == "-" ? std::cout : file;
+
+    unsigned long copyFiles = 0, copyBytes = 0, duplicateFiles = 0, duplicateBytes = 0, hashBytes = 0;
+    for(const Copy& c: copies) {
+        if ( c.likelyDuplicate ) { duplicateFiles++; duplicateBytes += c.size; }
+        else                     { copyFiles++;      copyBytes      += c.size; }
+    }
+    for(const Hash& h: hashes) hashBytes += h.size;
+
+    out << "{" << std::endl
+        << "  \"source\": " << jsonString( source ) << "," << std::endl
+        << "  \"target\": " << jsonString( target ) << "," << std::endl
+        << "  \"digest\": \"" << digestName << "\", \"sampleKB\": " << sampleKB
+        << ", \"treeDedup\": " << (treeDedup ? "true" : "false") << "," << std::endl
+        << "  \"totals\": {" << std::endl
+        << "    \"copyFiles\": " << copyFiles << ", \"copyBytes\": " << copyBytes << "," << std::endl
+        << "    \"duplicateFiles\": " << duplicateFiles << ", \"duplicateBytes\": " << duplicateBytes << "," << std::endl
+        << "    \"hashFiles\": " << hashes.size() << ", \"hashBytes\": " << hashBytes << "," << std::endl
+        << "    \"sampledFiles\": " << sampledFiles << ", \"sampledBytes\": " << sampledBytes << "," << std::endl
+        << "    \"readBytes\": " << hashBytes + copyBytes << ", \"writeBytes\": " << copyBytes
+        << ", \"maxWriteBytes\": " << copyBytes + duplicateBytes << "," << std::endl
+        << "    \"dirsToCreate\": " << dirsToCreate << std::endl
+        << "  }," << std::endl;
+
+    out << "  \"copy\": [";
+    for(size_t i=0; i<copies.size(); i++)
+        out << (i ? "," : "") << std::endl << "    { \"src\": " << jsonString( copies[i].src )
+            << ", \"dst\": " << jsonString( copies[i].dst ) << ", \"size\": " << copies[i].size
+            << ", \"likelyDuplicate\": " << (copies[i].likelyDuplicate ? "true" : "false") << " }";
+    out << (copies.empty() ? "" : "\n  ") << "]," << std::endl;
+
+    out << "  \"hash\": [";
+    for(size_t i=0; i<hashes.size(); i++)
+        out << (i ? "," : "") << std::endl << "    { \"path\": " << jsonString( hashes[i].path )
+            << ", \"size\": " << hashes[i].size << " }";
+    out << (hashes.empty() ? "" : "\n  ") << "]" << std::endl
+        << "}" << std::endl;
+
+    out.flush();
+    return out ? 0 : EIO;
+}
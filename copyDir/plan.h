@@ -0,0 +1,54 @@
+#ifndef __COPYDIR_PLAN_H__
+#define __COPYDIR_PLAN_H__
+
+#include <string>
+#include <vector>
+
+/*!
+  * @brief What a run would do, worked out from the scans and the cheap stages only.
+  *
+  * Filled in by a plan-only run (--plan): every directory is scanned and its same-size
+  * files sampled, as a real run would, but nothing is hashed in full, copied or created.
+  * A source file with no same-size, same-sample file left in the target is a copy for
+  * sure; one with some is an expected duplicate, to be confirmed by hashing the files
+  * listed, and copied after all if the digests differ.
+  */
+// Quoted and escaped for JSON; file names are bytes, and go through as is but for quotes,
+// backslashes and control characters. For the other JSON writers too.
+// Bytes that are not UTF-8 cannot be in JSON: each one becomes \u0080 to \u00ff, so a
+// reader gets the Latin-1 character, not the byte. Such names are not found again as read.
+std::string jsonString(const std::string& s);
+
+struct Plan {
+    struct Copy {
+        std::string   src;
+        std::string   dst;
+        unsigned long size;
+        bool          likelyDuplicate;  // skipped unless the digests say otherwise
+    };
+    struct Hash {
+        std::string   path;
+        unsigned long size;
+    };
+
+    std::vector<Copy> copies;
+    std::vector<Hash> hashes;
+    unsigned long     dirsToCreate;
+    unsigned long     sampledFiles;     // already read while planning
+    unsigned long     sampledBytes;
+
+    Plan() : dirsToCreate(0), sampledFiles(0), sampledBytes(0) {}
+
+    Plan& operator+=(const Plan& other);
+
+    /*!
+      * @brief Writes the plan as a JSON object: the run settings given, totals of files
+      *        and bytes to hash, read and write, then the 'copy' and 'hash' lists.
+      * @param path file to create, or "-" for std::cout
+      * @return 0 on success, errno otherwise
+      */
+    int write(const std::string& path, const std::string& source, const std::string& target,
+              const char *digestName, unsigned int sampleKB, bool treeDedup) const;
+};
+
+#endif
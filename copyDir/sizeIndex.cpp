@@ -0,0 +1,72 @@
+#include "sizeIndex.h"
+#include "metrics.h"
+
+// Fibonacci hashing; file sizes are far from uniformly distributed (think of all the
+// 4096-multiples around), so the low bits alone are a poor slot selector.
+static inline unsigned long hashSize(unsigned long size)
+{
+    return (size * 0x9E3779B97F4A7C15ul) >> 17;
+}
+
+// Returns the slot holding 'size', or the empty one where it should go
+unsigned long SizeIndex::slotFor(unsigned long size) const
+{
+    unsigned long i = hashSize( size ) & mask;
+    while ( slots[i].count && slots[i].size != size ) i = (i + 1) & mask;
+
+    return i;
+}
+
+void SizeIndex::build(const FileTable& entries)
+{
+    StageTimer timer( STAGE_INDEX );
+    timer.setItems( entries.count() );
+
+    // Keep load factor at 0.5 at most, so probing sequences stay really short
+    unsigned long capacity = 16;
+    while ( capacity < 2 * entries.count() ) capacity <<= 1;
+
+    slots.assign( capacity, Slot{0, 0, 0} );
+    mask = capacity - 1;
+
+    // 1st pass: count entries per size
+    unsigned int numFiles = 0;
+    for(FileTable::Handle h=0; h<entries.count(); h++) {
+        if ( entries.isDir( h ) ) continue;
+
+        Slot& slot = slots[ slotFor( entries.size( h ) ) ];
+        slot.size = entries.size( h );
+        slot.count++;
+        numFiles++;
+    }
+
+    // 2nd pass: give every run its place in 'order'; 'start' points past the run end
+    // for now, and walks back to the run beginning while scattering.
+    unsigned int end = 0;
+    for(Slot& slot: slots) {
+        if ( !slot.count ) continue;
+        end += slot.count;
+        slot.start = end;
+    }
+
+    // 3rd pass: scatter indices backwards, so each run keeps the scan order
+    order.resize( numFiles );
+    for(unsigned int i=entries.count(); i-- > 0; ) {
+        if ( entries.isDir( i ) ) continue;
+
+        Slot& slot = slots[ slotFor( entries.size( i ) ) ];
+        order[ --slot.start ] = i;
+    }
+}
+
+const unsigned int *SizeIndex::find(unsigned long size, unsigned int& count) const
+{
+    count = 0;
+    if ( slots.empty() ) return NULL;
+
+    const Slot& slot = slots[ slotFor( size ) ];
+    if ( !slot.count ) return NULL;
+
+    count = slot.count;
+    return &order[ slot.start ];
+}
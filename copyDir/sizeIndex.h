@@ -0,0 +1,44 @@
+#ifndef __COPYDIR_SIZEINDEX_H__
+#define __COPYDIR_SIZEINDEX_H__
+
+#include "fileTable.h"
+
+#include <vector>
+
+/*!
+  * @brief Size-keyed index over the entries of a directory scan.
+  *
+  * Open-addressing (linear probing) hash from file size to a contiguous run of entry
+  * indices, all of them of that very size. Built once per scan in linear time, so the
+  * lookup for each source file only touches the destination entries worth comparing.
+  * @remark directories are left out of the index; they never match a file.
+  * @remark within a run, entries keep the order they had in the scanned table.
+  */
+class SizeIndex {
+public:
+    SizeIndex() : mask(0) {}
+
+    void build(const FileTable& entries);
+
+    /*!
+      * @brief Looks up the run of entries of the given size.
+      * @param count set to the number of entries in the run; 0 if none
+      * @return pointer to the first entry index of the run, or NULL if none
+      */
+    const unsigned int *find(unsigned long size, unsigned int& count) const;
+
+private:
+    struct Slot {
+        unsigned long size;
+        unsigned int  start;
+        unsigned int  count;            // 0 means empty slot
+    };
+
+    std::vector<Slot>         slots;
+    std::vector<unsigned int> order;    // entry indices, grouped by size
+    unsigned long             mask;     // slots.size() - 1; capacity is a power of 2
+
+    unsigned long slotFor(unsigned long size) const;
+};
+
+#endif
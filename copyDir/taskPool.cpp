@@ -0,0 +1,84 @@
+#include "taskPool.h"
+
+// Index of the worker running on this thread, or -1 for any other thread
+static thread_local int selfIndex = -1;
+
+TaskPool::TaskPool(unsigned int numThreads) : queued(0), pending(0), nextQueue(0), stopping(false)
+{
+    if ( numThreads < 1 ) numThreads = 1;
+
+    for(unsigned int i=0; i<numThreads; i++) queues.emplace_back( new Queue );
+    for(unsigned int i=0; i<numThreads; i++) threads.emplace_back( &TaskPool::worker, this, i );
+}
+
+TaskPool::~TaskPool()
+{
+    wait();
+
+    {
+        std::lock_guard<std::mutex> lock( idleMutex );
+        stopping = true;
+    }
+    idleCond.notify_all();
+
+    for(std::thread& t: threads) t.join();
+}
+
+void TaskPool::submit(Task task)
+{
+    unsigned int q = selfIndex >= 0 ? selfIndex : nextQueue++ % queues.size();
+
+    pending++;
+    {
+        std::lock_guard<std::mutex> lock( queues[q]->mutex );
+        queues[q]->tasks.push_back( std::move( task ) );
+        queued++;
+    }
+
+    // Taking the lock orders this against a worker about to sleep; no wakeup gets lost
+    { std::lock_guard<std::mutex> lock( idleMutex ); }
+    idleCond.notify_one();
+}
+
+void TaskPool::wait()
+{
+    std::unique_lock<std::mutex> lock( idleMutex );
+    doneCond.wait( lock, [this] () { return pending == 0; } );
+}
+
+// Newest task of our own, or else the oldest one of somebody else's
+bool TaskPool::take(unsigned int self, Task& task)
+{
+    for(unsigned int i=0; i<queues.size(); i++) {
+        Queue& q = *queues[ (self + i) % queues.size() ];
+        std::lock_guard<std::mutex> lock( q.mutex );
+        if ( q.tasks.empty() ) continue;
+
+        if ( !i ) { task = std::move( q.tasks.back() );  q.tasks.pop_back(); }
+        else      { task = std::move( q.tasks.front() ); q.tasks.pop_front(); }
+        queued--;
+        return true;
+    }
+    return false;
+}
+
+void TaskPool::worker(unsigned int self)
+{
+    selfIndex = self;
+
+    while ( 1 ) {
+        Task task;
+        if ( take( self, task ) ) {
+            task();
+            if ( --pending == 0 ) {
+                { std::lock_guard<std::mutex> lock( idleMutex ); }
+                doneCond.notify_all();
+            }
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock( idleMutex );
+        idleCond.wait( lock, [this] () { return stopping || queued > 0; } );
+        if ( stopping && !queued ) return;
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef __COPYDIR_TASKPOOL_H__
+#define __COPYDIR_TASKPOOL_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*!
+  * @brief Work-stealing pool for tasks that spawn more tasks, like walking a tree.
+  *
+  * Each worker has its own deque: tasks submitted from a worker go to the back of its
+  * own, and it takes work from there too (depth first, warm caches), while idle workers
+  * steal from the front of the others' (the oldest tasks, likely the biggest subtrees).
+  * @remark tasks must not wait for other tasks; they just submit them
+  */
+class TaskPool {
+public:
+    typedef std::function<void()> Task;
+
+    explicit TaskPool(unsigned int numThreads);
+    ~TaskPool();                // waits for all the tasks, then stops the workers
+
+    void submit(Task task);
+
+    // Blocks until every task submitted, and every task those submitted, is over
+    void wait();
+
+private:
+    struct Queue {
+        std::mutex       mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread>            threads;
+
+    std::mutex                 idleMutex;
+    std::condition_variable    idleCond;        // workers, for tasks to show up
+    std::condition_variable    doneCond;        // wait(), for pending to reach 0
+    std::atomic<unsigned long> queued;          // sitting in the deques
+    std::atomic<unsigned long> pending;         // queued or running
+    std::atomic<unsigned int>  nextQueue;       // for submissions from outside
+    bool                       stopping;
+
+    bool take(unsigned int self, Task& task);
+    void worker(unsigned int self);
+};
+
+#endif